@@ -1,3 +1,23 @@
 // Common configuration for CPU and shaders.
 
 #define BVH_SET_BINDING 0
+// Triangles per BVH leaf, see bvh.max_leaf_size. The app builds the shaders with 1 for meshes
+// too large for leaf ranges, whose leafs hold single triangles.
+#ifndef BVH_MAX_LEAF_SIZE
+#define BVH_MAX_LEAF_SIZE 4
+#endif
+// Upload the BVH as compressed nodes with quantized child bounds, see compressed_bvh.h. The app
+// builds the shaders with it off for trees too deep for their traversal stack.
+#ifndef BVH_COMPRESSED_NODES
+#define BVH_COMPRESSED_NODES 0
+#endif
+// Upload the BVH as 4-wide nodes, see wide_bvh.h. Turned off like BVH_COMPRESSED_NODES.
+#ifndef BVH_WIDE_NODES
+#define BVH_WIDE_NODES 0
+#endif
+// Triangle storage: 0 for indices into the vertices, 1 for the vertices and 2 for the Woop
+// transform of every triangle in leaf order, see triangle_storage.h.
+#define BVH_TRIANGLE_FORMAT 0
+// Upload the vertex positions quantized to 16 bits within clusters of vertices, see
+// quantized_vertices.h.
+#define BVH_QUANTIZED_VERTICES 0
@@ -27,9 +27,16 @@ THE SOFTWARE.
 #include "primitive/mesh.h"
 #include "world/world.h"
 
+#include <bvh/bvh_builder.h>
+#include <bvh/task_pool.h>
+#include <bvh/triangle_bounds.h>
+
 #include <algorithm>
+#include <map>
+#include <type_traits>
 
 namespace {
+using bvh::kParallelForGrain;
 constexpr float kBoundsGrowthEps = 1e-4f;
 
 void scaleBounds(RadeonRays::bbox &bounds, float scale) {
@@ -37,6 +44,49 @@ void scaleBounds(RadeonRays::bbox &bounds, float scale) {
   bounds.pmin = center + (bounds.pmin - center) * scale;
   bounds.pmax = center + (bounds.pmax - center) * scale;
 }
+
+// Bounds of the faces of mesh with the vertices transformed by transform, if not null, or in
+// object space. Triangles go through compute_triangle_bounds, reading the vertices and faces in
+// place. Lines and quads, whose type is their number of vertices minus one, are redone here.
+void computeFaceBounds(
+  RadeonRays::Mesh const &mesh,
+  RadeonRays::matrix const *transform,
+  gsl::span<RadeonRays::bbox> out_bounds) {
+  using namespace RadeonRays;
+  float3 const *in_vertices = mesh.GetVertexData();
+  Mesh::Face const *faces = mesh.GetFaceData();
+  const bvh::VertexStream vertices = {
+    reinterpret_cast<float const *>(in_vertices), sizeof(float3)
+  };
+  const bvh::IndexStream indices = { faces, sizeof(faces[0].idx[0]), sizeof(Mesh::Face) };
+  bvh::compute_triangle_bounds(vertices, indices, mesh.num_faces(), out_bounds, transform);
+  for (int j = 0; j < mesh.num_faces(); ++j) {
+    if (faces[j].type_ == Mesh::FaceType::TRIANGLE) {
+      continue;
+    }
+    bbox box;
+    for (int k = 0; k <= int(faces[j].type_); ++k) {
+      const float3 &p = in_vertices[faces[j].idx[k]];
+      box.grow(transform ? transform_point(p, *transform) : p);
+    }
+    out_bounds[j] = box;
+  }
+}
+
+// Call fn(idx, range_begin, range_end) for the parts of [begin, end) in the consecutive ranges
+// starting at starts, in order. Tasks over a whole buffer find their first range once and walk
+// on from there.
+template <typename Fn>
+void forEachRange(std::vector<int> const &starts, int begin, int end, Fn &&fn) {
+  const auto iter = std::upper_bound(starts.cbegin(), starts.cend(), begin);
+  for (int idx = int(std::distance(starts.cbegin(), iter)) - 1; begin < end; ++idx) {
+    const int range_end = idx + 1 < int(starts.size()) ? std::min(end, starts[idx + 1]) : end;
+    if (range_end > begin) {
+      fn(idx, begin, range_end);
+      begin = range_end;
+    }
+  }
+}
 } // namespace
 
 // Preferred work group size for Radeon devices
@@ -45,6 +95,13 @@ static int const kWorkGroupSize = 64;
 namespace RadeonRays {
 
 void BvhBuilder::updateBvh(const World &world) {
+  auto two_level = world.options_.GetOption("bvh.two_level");
+  m_two_level = two_level && two_level->AsFloat() > 0.f;
+  if (m_two_level) {
+    updateTwoLevelBvh(world);
+    return;
+  }
+
   const int numshapes = (int)world.shapes_.size();
   int numvertices = 0;
   int numfaces = 0;
@@ -53,35 +110,7 @@ void BvhBuilder::updateBvh(const World &world) {
   m_mesh_vertices_start_idx.resize(numshapes);
   m_mesh_faces_start_idx.resize(numshapes);
 
-  // Check options
-  auto builder = world.options_.GetOption("bvh.builder");
-  auto splits = world.options_.GetOption("bvh.sah.use_splits");
-  auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-  auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-  auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-  auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
-  auto nbins = world.options_.GetOption("bvh.sah.num_bins");
-
-  bool use_sah = false;
-  bool use_splits = false;
-  int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
-  int num_bins = nbins ? (int)nbins->AsFloat() : 64;
-  float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
-  float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-  float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
-
-  if (builder && builder->AsString() == "sah") {
-    use_sah = true;
-  }
-
-  if (splits && splits->AsFloat() > 0.f) {
-    use_splits = true;
-  }
-
-  m_bvh.reset(
-    use_splits ?
-      new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
-      new Bvh(traversal_cost, num_bins, use_sah));
+  m_bvh = bvh::make_bvh(world.options_);
 
   // Partition the array into meshes and instances
   m_shapes = world.shapes_;
@@ -115,43 +144,48 @@ void BvhBuilder::updateBvh(const World &world) {
     numvertices += mesh->num_vertices();
   }
 
-  // We can't avoild allocating it here, since bounds aren't stored anywhere
-  std::vector<bbox> bounds(numfaces);
+  // Bounds aren't stored anywhere, they live in the arena kept across updates.
+  m_arena.reset();
+  auto bounds = m_arena.allocate<bbox>(numfaces);
 
-  // We handle meshes first collecting their world space bounds
-#pragma omp parallel for
+  // We handle meshes first collecting their world space bounds, from the vertices transformed
+  // like GetFaceBounds does. The faces are processed in parallel.
   for (int i = 0; i < nummeshes; ++i) {
     Mesh const *mesh = static_cast<Mesh const *>(m_shapes[i]);
+    matrix m, minv;
+    mesh->GetTransform(m, minv);
 
-    for (int j = 0; j < mesh->num_faces(); ++j) {
-      // Here we directly get world space bounds
-      auto &box = bounds[m_mesh_faces_start_idx[i] + j];
-      mesh->GetFaceBounds(j, false, box);
+    auto mesh_bounds = bounds.subspan(m_mesh_faces_start_idx[i], mesh->num_faces());
+    computeFaceBounds(*mesh, &m, mesh_bounds);
+    for (auto &box : mesh_bounds) {
       scaleBounds(box, 1 + kBoundsGrowthEps);
     }
   }
 
   // Then we handle instances. Need to flatten them into actual geometry.
-#pragma omp parallel for
+  auto tight_bounds = world.options_.GetOption("bvh.tight_instance_bounds");
+  const bool tight_instance_bounds = tight_bounds && tight_bounds->AsFloat() > 0.f;
   for (int i = nummeshes; i < nummeshes + numinstances; ++i) {
     Instance const *instance = static_cast<Instance const *>(m_shapes[i]);
     Mesh const *mesh = static_cast<Mesh const *>(instance->GetBaseShape());
 
     // Instance is using its own transform for base shape geometry
-    // so we need to get object space bounds and transform them manually
+    // so we need to get object space bounds and transform them manually, or transform the
+    // vertices like for meshes, which keeps the bounds tight under rotation.
     matrix m, minv;
     instance->GetTransform(m, minv);
 
-    for (int j = 0; j < mesh->num_faces(); ++j) {
-      bbox tmp;
-      mesh->GetFaceBounds(j, true, tmp);
-      auto &box = bounds[m_mesh_faces_start_idx[i] + j];
-      box = transform_bbox(tmp, m);
+    auto mesh_bounds = bounds.subspan(m_mesh_faces_start_idx[i], mesh->num_faces());
+    computeFaceBounds(*mesh, tight_instance_bounds ? &m : nullptr, mesh_bounds);
+    for (auto &box : mesh_bounds) {
+      if (!tight_instance_bounds) {
+        box = transform_bbox(box, m);
+      }
       scaleBounds(box, 1 + kBoundsGrowthEps);
     }
   }
 
-  m_bvh->Build(&bounds[0], numfaces);
+  m_bvh->Build(bounds.data(), numfaces);
 
 #ifdef RR_PROFILE
   m_bvh->PrintStatistics(std::cout);
@@ -163,6 +197,83 @@ void BvhBuilder::updateBvh(const World &world) {
   m_numfaces = numfaces;
   m_nummeshes = nummeshes;
   m_numinstances = numinstances;
+  updateFaceShapes();
+}
+
+void BvhBuilder::updateTwoLevelBvh(const World &world) {
+  m_shapes = world.shapes_;
+  const int numshapes = (int)m_shapes.size();
+
+  // Find the distinct meshes, instances share the mesh of their base shape.
+  std::map<Mesh const *, int> mesh_indices;
+  m_meshes.clear();
+  m_shape_meshes.resize(numshapes);
+  int numinstances = 0;
+  for (int i = 0; i < numshapes; ++i) {
+    ShapeImpl const *shape = static_cast<ShapeImpl const *>(m_shapes[i]);
+    Mesh const *mesh = nullptr;
+    if (shape->is_instance()) {
+      mesh = static_cast<Mesh const *>(static_cast<Instance const *>(shape)->GetBaseShape());
+      ++numinstances;
+    } else {
+      mesh = static_cast<Mesh const *>(shape);
+    }
+    const auto inserted = mesh_indices.emplace(mesh, (int)m_meshes.size());
+    if (inserted.second) {
+      m_meshes.push_back(mesh);
+    }
+    m_shape_meshes[i] = inserted.first->second;
+  }
+
+  const int nummeshes = (int)m_meshes.size();
+  int numvertices = 0;
+  int numfaces = 0;
+  m_mesh_vertices_start_idx.resize(nummeshes);
+  m_mesh_faces_start_idx.resize(nummeshes);
+  for (int i = 0; i < nummeshes; ++i) {
+    m_mesh_faces_start_idx[i] = numfaces;
+    m_mesh_vertices_start_idx[i] = numvertices;
+
+    numfaces += m_meshes[i]->num_faces();
+    numvertices += m_meshes[i]->num_vertices();
+  }
+
+  // Bottom level: one BVH per distinct mesh over its object space faces.
+  m_arena.reset();
+  m_mesh_bvhs.resize(nummeshes);
+  for (int i = 0; i < nummeshes; ++i) {
+    Mesh const *mesh = m_meshes[i];
+    auto bounds = m_arena.allocate<bbox>(mesh->num_faces());
+    computeFaceBounds(*mesh, nullptr, bounds);
+    for (auto &box : bounds) {
+      scaleBounds(box, 1 + kBoundsGrowthEps);
+    }
+    m_mesh_bvhs[i] = bvh::make_bvh(world.options_);
+    m_mesh_bvhs[i]->Build(bounds.data(), (int)bounds.size());
+  }
+
+  // Top level: one leaf per shape, bounding its mesh in world space.
+  auto bounds = m_arena.allocate<bbox>(numshapes);
+  for (int i = 0; i < numshapes; ++i) {
+    matrix m, minv;
+    static_cast<ShapeImpl const *>(m_shapes[i])->GetTransform(m, minv);
+    bounds[i] = transform_bbox(m_mesh_bvhs[m_shape_meshes[i]]->Bounds(), m);
+  }
+  m_bvh = bvh::make_bvh(world.options_);
+  m_bvh->Build(bounds.data(), numshapes);
+
+  std::vector<Bvh const *> bvhs(nummeshes + 1);
+  for (int i = 0; i < nummeshes; ++i) {
+    bvhs[i] = m_mesh_bvhs[i].get();
+  }
+  bvhs[nummeshes] = m_bvh.get();
+  m_translator.Process(bvhs.data(), m_mesh_faces_start_idx.data(), nummeshes);
+
+  m_numvertices = numvertices;
+  m_numfaces = numfaces;
+  m_nummeshes = nummeshes;
+  m_numinstances = numinstances;
+  updateFaceShapes();
 }
 
 
@@ -171,99 +282,126 @@ void BvhBuilder::fillBuffers(gsl::span<Node> out_nodes, gsl::span<float3> out_ve
   assert(out_vertices.size() == getVertexCount());
   assert(out_faces.size() == getFaceCount());
 
-  const int nummeshes = m_nummeshes;
-  const int numinstances = m_numinstances;
+  fillNodesAndVertices(out_nodes, out_vertices);
+  fillFaces(out_faces);
+}
+
+void BvhBuilder::fillBuffersShortFaces(
+  gsl::span<Node> out_nodes, gsl::span<Vertex> out_vertices, gsl::span<ShortFace> out_faces) {
+  assert(hasShortFaces());
+  assert(out_nodes.size() == getNodeCount());
+  assert(out_vertices.size() == getVertexCount());
+  assert(out_faces.size() == getShortFaceCount());
+
+  fillNodesAndVertices(out_nodes, out_vertices);
+  fillFaces(out_faces);
+  // Padding to a whole uint.
+  if (getShortFaceCount() > getFaceCount()) {
+    out_faces[getFaceCount()] = {};
+  }
+}
+
+FaceIds BvhBuilder::getFaceIds(int faceidx) const {
+  // The bottom level leafs of two-level BVHs reference the faces in mesh order.
+  const int index = m_two_level ? faceidx : m_bvh->GetIndices()[faceidx];
+  const int shapeidx = m_face_shapes[index];
+  const int prim_id = index - m_mesh_faces_start_idx[shapeidx];
+  return { m_two_level ? -1 : m_shapes[shapeidx]->GetId(), prim_id };
+}
+
+void BvhBuilder::updateFaceShapes() {
+  m_face_shapes.resize(m_numfaces);
+  bvh::TaskPool::global().parallelFor(0, m_numfaces, kParallelForGrain, [this](int begin, int end) {
+    forEachRange(m_mesh_faces_start_idx, begin, end, [this](int idx, int first, int last) {
+      std::fill(m_face_shapes.begin() + first, m_face_shapes.begin() + last, idx);
+    });
+  });
+}
+
+Mesh const *BvhBuilder::getMesh(int idx) const {
+  if (m_two_level) {
+    return m_meshes[idx];
+  }
+  ShapeImpl const *shape = static_cast<ShapeImpl const *>(m_shapes[idx]);
+  if (shape->is_instance()) {
+    return static_cast<Mesh const *>(static_cast<Instance const *>(shape)->GetBaseShape());
+  }
+  return static_cast<Mesh const *>(shape);
+}
 
+void BvhBuilder::fillNodesAndVertices(gsl::span<Node> out_nodes, gsl::span<Vertex> out_vertices) {
   // Copy nodes to output.
   auto &nodes = m_translator.getNodes();
   std::copy(nodes.cbegin(), nodes.cend(), out_nodes.begin());
 
-  // Transform and write vertices to output.
-  {
-    // Here we need to put data in world space rather than object space
-    // So we need to get the transform from the mesh and multiply each vertex
+  // Chunks of the vertex buffer are written in parallel, each walking the shapes it overlaps.
+  // Single-level BVHs need the vertices in world space, so every chunk fetches the transforms of
+  // its shapes on its own. Two-level BVHs keep them in object space, once per distinct mesh.
+  const auto fill = [&](int idx, int begin, int end) {
+    const int start = m_mesh_vertices_start_idx[idx];
+    float3 const *in_vertices = getMesh(idx)->GetVertexData();
+    if (m_two_level) {
+      std::copy(
+        in_vertices + begin - start, in_vertices + end - start, out_vertices.begin() + begin);
+      return;
+    }
     matrix m, minv;
-
-#pragma omp parallel for
-    for (int i = 0; i < nummeshes; ++i) {
-      // Get the mesh
-      Mesh const *mesh = static_cast<Mesh const *>(m_shapes[i]);
-      // Get vertex buffer of the current mesh
-      float3 const *in_vertices = mesh->GetVertexData();
-      // Get mesh transform
-      mesh->GetTransform(m, minv);
-
-      //#pragma omp parallel for
-      // Iterate thru vertices multiply and append them to GPU buffer
-      for (int j = 0; j < mesh->num_vertices(); ++j) {
-        out_vertices[m_mesh_vertices_start_idx[i] + j] = transform_point(in_vertices[j], m);
-      }
+    static_cast<ShapeImpl const *>(m_shapes[idx])->GetTransform(m, minv);
+    for (int i = begin; i < end; ++i) {
+      out_vertices[i] = transform_point(in_vertices[i - start], m);
     }
+  };
+  bvh::TaskPool::global().parallelFor(0, m_numvertices, kParallelForGrain, [&](int begin, int end) {
+    forEachRange(m_mesh_vertices_start_idx, begin, end, fill);
+  });
+}
 
-#pragma omp parallel for
-    for (int i = nummeshes; i < nummeshes + numinstances; ++i) {
-      Instance const *instance = static_cast<Instance const *>(m_shapes[i]);
-      // Get the mesh
-      Mesh const *mesh = static_cast<Mesh const *>(instance->GetBaseShape());
-      // Get vertex buffer of the current mesh
-      float3 const *in_vertices = mesh->GetVertexData();
-      // Get mesh transform
-      instance->GetTransform(m, minv);
-
-      //#pragma omp parallel for
-      // Iterate thru vertices multiply and append them to GPU buffer
-      for (int j = 0; j < mesh->num_vertices(); ++j) {
-        out_vertices[m_mesh_vertices_start_idx[i] + j] = transform_point(in_vertices[j], m);
-      }
+template <typename FaceType>
+void BvhBuilder::fillFaces(gsl::span<FaceType> out_faces) {
+  using Index = std::remove_extent_t<decltype(FaceType::idx)>;
+  const auto set_face = [](FaceType &face, Mesh::Face const &in_face, int vertices_start_idx) {
+    for (int j = 0; j < 3; ++j) {
+      face.idx[j] = static_cast<Index>(in_face.idx[j] + vertices_start_idx);
     }
-  }
+  };
+
+  // Two-level BVHs keep the faces in mesh order, the bottom level leafs reference them by mesh
+  // face index plus the start of the mesh. Otherwise they are permuted into the primitive order of
+  // the BVH, which can hold more indices than there are faces for some BVHs. Either way a face
+  // finds its shape in m_face_shapes, so chunks of faces are written in parallel.
+  int const *reordering = m_two_level ? nullptr : m_bvh->GetIndices();
+  const int numindices = m_two_level ? m_numfaces : int(m_bvh->GetNumIndices());
+  bvh::TaskPool::global().parallelFor(0, numindices, kParallelForGrain, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      const int index = reordering ? reordering[i] : i;
+      const int shapeidx = m_face_shapes[index];
+      const int faceidx = index - m_mesh_faces_start_idx[shapeidx];
+      // The shape and primitive ids are not stored, see getFaceIds.
+      set_face(
+        out_faces[i], getMesh(shapeidx)->GetFaceData()[faceidx],
+        m_mesh_vertices_start_idx[shapeidx]);
+    }
+  });
+}
 
-  // Create face buffer
-  {
-    // This number is different from the number of faces for some BVHs
-    const auto numindices = m_bvh->GetNumIndices();
-    // Create face buffer
-
-    // Here the point is to add mesh starting index to actual index contained within the mesh,
-    // getting absolute index in the buffer.
-    // Besides that we need to permute the faces accorningly to BVH reordering, which
-    // is contained within bvh.primids_
-    int const *reordering = m_bvh->GetIndices();
-    for (size_t i = 0; i < numindices; ++i) {
-      int indextolook4 = reordering[i];
-
-      // We need to find a shape corresponding to current face
-      auto iter =
-        std::upper_bound(m_mesh_faces_start_idx.cbegin(), m_mesh_faces_start_idx.cend(), indextolook4);
-
-      // Find the index of the shape
-      int shapeidx = static_cast<int>(std::distance(m_mesh_faces_start_idx.cbegin(), iter) - 1);
-
-      // Get the mesh directly or out of instance
-      Mesh const *mesh = nullptr;
-      if (shapeidx < nummeshes) {
-        mesh = static_cast<Mesh const *>(m_shapes[shapeidx]);
-      } else {
-        mesh =
-          static_cast<Mesh const *>(static_cast<Instance const *>(m_shapes[shapeidx])->GetBaseShape());
-      }
+void BvhBuilder::fillShapeBuffer(gsl::span<ShapeData> out_shapes) {
+  assert(out_shapes.size() == getShapeCount());
 
-      // Get vertex buffer of the current mesh
-      Mesh::Face const *myfacedata = mesh->GetFaceData();
-      // Find face idx
-      int faceidx = indextolook4 - m_mesh_faces_start_idx[shapeidx];
-      // Find mesh start idx
-      int mystartidx = m_mesh_vertices_start_idx[shapeidx];
-
-      // Copy face data to GPU buffer
-      out_faces[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-      out_faces[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-      out_faces[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
-
-      // Optimization: we are putting faceid here
-      out_faces[i].shape_id = m_shapes[shapeidx]->GetId();
-      out_faces[i].prim_id = faceidx;
-    }
+  const auto &roots = m_translator.getRoots();
+  for (int i = 0; i < getShapeCount(); ++i) {
+    ShapeImpl const *shape = static_cast<ShapeImpl const *>(m_shapes[i]);
+    matrix m, minv;
+    shape->GetTransform(m, minv);
+
+    ShapeData &data = out_shapes[i];
+    data = {};
+    data.id = shape->GetId();
+    data.bvhidx = roots[m_shape_meshes[i]];
+    data.mask = shape->GetMask();
+    data.m0 = float3(minv.m[0][0], minv.m[0][1], minv.m[0][2], minv.m[0][3]);
+    data.m1 = float3(minv.m[1][0], minv.m[1][1], minv.m[1][2], minv.m[1][3]);
+    data.m2 = float3(minv.m[2][0], minv.m[2][1], minv.m[2][2], minv.m[2][3]);
+    data.m3 = float3(minv.m[3][0], minv.m[3][1], minv.m[3][2], minv.m[3][3]);
   }
 }
 
@@ -63,15 +63,19 @@ THE SOFTWARE.
 
 #pragma once
 
+#include <cstdint>
 #include <memory>
 
 #include <gsl/span>
 
+#include <bvh/build_arena.h>
+
 #include "math/float3.h"
 #include "plain_bvh_translator.h"
 
 namespace RadeonRays {
 class Bvh;
+class Mesh;
 class World;
 
 using Node = PlainBvhTranslator::Node;
@@ -79,21 +83,58 @@ using Node = PlainBvhTranslator::Node;
 // Position
 using Vertex = float3;
 
+// Vertex indices of a face, 12 bytes. The shape and primitive of a face are not stored, they
+// follow from its position in the faces buffer, see BvhBuilder::getFaceIds.
 #pragma pack(push, 1)
 struct Face {
-  // Up to 3 indices
   int idx[3];
-  // Shape ID
+};
+// Same with 16-bit indices, 6 bytes, for up to kMaxShortFaceVertices vertices. Shaders read them
+// as pairs per uint (see BVH_SHORT_INDICES in bvh.glslh).
+struct ShortFace {
+  uint16_t idx[3];
+};
+#pragma pack(pop)
+static_assert(sizeof(Face) == 12, "Face is read as 3 ints by shaders");
+static_assert(sizeof(ShortFace) == 6, "ShortFace is read as 3 16-bit halves by shaders");
+
+constexpr int kMaxShortFaceVertices = 65536;
+
+// What a face belongs to, as in Intersection.shapeid and primid.
+struct FaceIds {
+  // Id of the shape, -1 in two-level mode, where faces are shared by the instances of a mesh and
+  // the shape is the one whose bottom level BVH was hit.
   int shape_id;
-  // Primitive ID
+  // Face index in the mesh of the shape.
   int prim_id;
-  int padding[3];
 };
-#pragma pack(pop)
+
+// Shape of a two-level BVH, laid out like ShapeData in bvh.glslh (std140).
+struct ShapeData {
+  int id;
+  // Root node of the bottom level BVH of the shape's mesh.
+  int bvhidx;
+  int mask;
+  int padding1;
+  // Rows of the world to object space transform.
+  float3 m0;
+  float3 m1;
+  float3 m2;
+  float3 m3;
+  float3 linearvelocity;
+  float3 angularvelocity;
+};
 
 class BvhBuilder {
  public:
   /// Build BVH from geometry in World.
+  /// Instances are flattened into world space geometry by default. With the "bvh.two_level"
+  /// option set, a BVH is built once per distinct mesh in object space instead, and a top level
+  /// BVH over the shapes references them through the shape buffer. Vertices and faces are then
+  /// only stored once per mesh.
+  /// Flattened instances are bounded by their object space face bounds transformed to world
+  /// space, which grow under rotation. The "bvh.tight_instance_bounds" option bounds the
+  /// transformed vertices instead, like for meshes, for a tighter tree at no extra build time.
   /// @post get*Count and get*BufferSizeBytes will return an updated value after this call.
   /// @param world World contaning geometry from which to build/update the bvh.
   void updateBvh(const World &world);
@@ -104,6 +145,13 @@ class BvhBuilder {
   size_t getVertexBufferSizeBytes() const { return getVertexCount() * sizeof(Vertex); }
   int getFaceCount() const { return m_numfaces; }
   size_t getFaceBufferSizeBytes() const { return getFaceCount() * sizeof(Face); }
+  /// Whether the faces fit ShortFace.
+  bool hasShortFaces() const { return m_numvertices <= kMaxShortFaceVertices; }
+  /// Number of short faces, rounded up to an even count so that the buffer holds whole uints.
+  int getShortFaceCount() const { return (m_numfaces + 1) & ~1; }
+  size_t getShortFaceBufferSizeBytes() const { return getShortFaceCount() * sizeof(ShortFace); }
+  int getShapeCount() const { return m_two_level ? int(m_shapes.size()) : 0; }
+  size_t getShapeBufferSizeBytes() const { return getShapeCount() * sizeof(ShapeData); }
 
   /// Write BVH buffer data to specified buffers.
   /// @pre \ref updateBvh has been called successfully at least once.
@@ -112,17 +160,52 @@ class BvhBuilder {
   /// @pre out_faces.size() == getFaceCount()
   void
   fillBuffers(gsl::span<Node> out_nodes, gsl::span<Vertex> out_vertices, gsl::span<Face> out_faces);
+  /// Same with 16-bit indices.
+  /// @pre hasShortFaces()
+  /// @pre out_faces.size() == getShortFaceCount()
+  void fillBuffersShortFaces(
+    gsl::span<Node> out_nodes, gsl::span<Vertex> out_vertices, gsl::span<ShortFace> out_faces);
+
+  /// Shape and primitive of the face at faceidx in the faces buffer, which is the primid a shader
+  /// reports for a hit. Faces are in the leaf order of the BVH, so this looks the face up in the
+  /// primitive order of the BVH and the face ranges of the shapes.
+  FaceIds getFaceIds(int faceidx) const;
+
+  /// Write the shape buffer of a two-level BVH.
+  /// @pre out_shapes.size() == getShapeCount()
+  void fillShapeBuffer(gsl::span<ShapeData> out_shapes);
 
  private:
+  void updateTwoLevelBvh(const World &world);
+  void updateFaceShapes();
+  // Mesh of the shape, or distinct mesh in two-level mode, at idx in the start arrays.
+  Mesh const *getMesh(int idx) const;
+  void fillNodesAndVertices(gsl::span<Node> out_nodes, gsl::span<Vertex> out_vertices);
+  template <typename FaceType>
+  void fillFaces(gsl::span<FaceType> out_faces);
+
+  // Scratch memory of the leaf bounds, kept across updates.
+  bvh::BuildArena m_arena;
+  // The BVH over all faces, or the top level BVH in two-level mode.
   std::unique_ptr<Bvh> m_bvh;
   PlainBvhTranslator m_translator;
   std::vector<Shape const *> m_shapes;
   std::vector<int> m_mesh_vertices_start_idx;
   std::vector<int> m_mesh_faces_start_idx;
+  // Index into the start arrays of the shape (the distinct mesh in two-level mode) of every face,
+  // so that the faces find their shape in constant time.
+  std::vector<int> m_face_shapes;
   int m_numvertices = 0;
   int m_numfaces = 0;
   int m_nummeshes = 0;
   int m_numinstances = 0;
+
+  // Two-level mode: the distinct meshes with their bottom level BVHs, and the mesh of every
+  // shape. The start indices above are per distinct mesh.
+  bool m_two_level = false;
+  std::vector<Mesh const *> m_meshes;
+  std::vector<std::unique_ptr<Bvh>> m_mesh_bvhs;
+  std::vector<int> m_shape_meshes;
 };
 
 } // namespace RadeonRays
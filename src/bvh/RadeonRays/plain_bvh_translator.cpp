@@ -27,116 +27,54 @@ THE SOFTWARE.
 
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <stack>
 
 namespace {
-inline float floatBitsFromInt(uint32_t i) { return *(float *)&i; }
-inline uint32_t intFromFloatBits(float x) { return *(uint32_t *)&x; }
+// Payloads and skip links are stored in the bits of the w components, see bvh_builder.h.
+constexpr uint32_t kInvalidIndex = 0xFFFFFFFF;
+
+inline float floatBitsFromInt(uint32_t i) {
+  float x;
+  std::memcpy(&x, &i, sizeof(x));
+  return x;
+}
+
+inline uint32_t intFromFloatBits(float x) {
+  uint32_t i;
+  std::memcpy(&i, &x, sizeof(i));
+  return i;
+}
 } // unnamed namespace
 
 namespace RadeonRays {
 void PlainBvhTranslator::Process(Bvh &bvh) {
   // WARNING: this is crucial in order for the nodes not to migrate in memory as push_back adds nodes
   nodecnt_ = 0;
+  root_ = 0;
+  toplevelcnt_ = 0;
+  roots_.resize(0);
   int newsize = bvh.m_nodecnt;
   nodes_.resize(newsize);
   // extra_.resize(newsize);
 
-  // Check if we have been initialized
-  assert(bvh.m_root);
-
-  // Save current root position
-  int rootidx = 0;
-
-  // Process root
-  ProcessNode(bvh.m_root);
-
-  assert(nodecnt_ == nodes_.size());
+  ProcessTree(bvh, 0);
 
-  // Set next ptr
-  // TODO: use 0xffffffff
-  nodes_[rootidx].bounds.pmax.w = -1;
-
-  //
-  for (int i = rootidx; i < (int)nodes_.size(); ++i) {
-    // TODO: use 0xffffffff
-    if (nodes_[i].bounds.pmin.w != -1.f) {
-      nodes_[i + 1].bounds.pmax.w = nodes_[i].bounds.pmin.w;
-      // TODO: use intFromFloatBits
-      nodes_[(int)(nodes_[i].bounds.pmin.w)].bounds.pmax.w = nodes_[i].bounds.pmax.w;
-    }
-  }
-
-  const auto &reordering = bvh.GetIndices();
-  for (int i = rootidx; i < (int)nodes_.size(); ++i) {
-    auto &node = nodes_[i];
-    // TODO: use 0xffffffff
-    if (node.bounds.pmin.w == -1.f) {
-      // nodes_[i].bounds.pmin.w = (float)extra_[i];
-      // TODO: use floatBitsFromInt
-
-      // Here it is assumed that primitive indices
-      // [reordering[s], reordering[s+1], ..., reordering[s+n-1]]
-      // are contiguous.
-      // s = node.primitives.start, n = node.primitives.count
-      const auto startidx = node.primitives.first;
-      for (int j = 1; j < node.primitives.count; ++j) {
-        assert(reordering[startidx + j] == reordering[startidx] + j);
-      }
-
-      const uint32_t primitive_idx = reordering[startidx];
-      node.bounds.pmin.w = float(primitive_idx);
-      // nodes_[i].bounds.pmin.w = floatBitsFromInt(extra_[i]);
-    } else {
-      // TODO: use 0xffffffff
-      node.bounds.pmin.w = -1.f;
-    }
-  }
+  assert(nodecnt_ == int(nodes_.size()));
 }
 
 void PlainBvhTranslator::UpdateTopLevel(Bvh const &bvh) {
-  assert(false);
-  // TODO: use common logic with Process.
-  return;
+  // The top level BVH comes first, its size must not change for the bottom level BVHs to stay
+  // in place.
+  assert(!roots_.empty());
+  assert(bvh.m_nodecnt == toplevelcnt_);
 
-#if 0
   nodecnt_ = root_;
-
-  // Process root
-  ProcessNode(bvh.m_root);
-
-  // Set next ptr
-  nodes_[root_].bounds.pmax.w = -1;
-
-  for (int j = root_; j < root_ + bvh.m_nodecnt; ++j) {
-    // TODO: use 0xffffffff
-    if (nodes_[j].bounds.pmin.w != -1.f) {
-      nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-      // TODO: use intFromFloatBits
-      nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
-    }
-  }
-
-  for (int j = root_; j < root_ + bvh.m_nodecnt; ++j) {
-    // TODO: use 0xffffffff
-    if (nodes_[j].bounds.pmin.w == -1.f) {
-      // TODO: use floatBitsFromInt
-      nodes_[j].bounds.pmin.w = (float)extra_[j];
-    } else {
-      // TODO: use 0xffffffff
-      nodes_[j].bounds.pmin.w = -1.f;
-    }
-  }
-#endif
+  ProcessTree(bvh, 0);
 }
 
 void PlainBvhTranslator::Process(Bvh const **bvhs, int const *offsets, int numbvhs) {
-  assert(false);
-  // TODO: use common logic with Process.
-  return;
-
-#if 0
   // First of all count the number of required nodes for all BVH's
   int nodecnt = 0;
   for (int i = 0; i < numbvhs + 1; ++i) {
@@ -147,132 +85,123 @@ void PlainBvhTranslator::Process(Bvh const **bvhs, int const *offsets, int numbv
     nodecnt += bvhs[i]->m_nodecnt;
   }
 
+  nodecnt_ = 0;
   nodes_.resize(nodecnt);
-  extra_.resize(nodecnt);
-  roots_.resize(numbvhs);
+  roots_.assign(numbvhs, -1);
+
+  // The top level BVH goes first, so traversal starts at node 0 like for a single BVH.
+  assert(bvhs[numbvhs]);
+  root_ = 0;
+  toplevelcnt_ = bvhs[numbvhs]->m_nodecnt;
+  ProcessTree(*bvhs[numbvhs], 0);
 
   for (int i = 0; i < numbvhs; ++i) {
     if (!bvhs[i]) {
       continue;
     }
 
-    int currentroot = nodecnt_;
-
-    roots_[i] = currentroot;
-
-    // Process root
-    ProcessNode(bvhs[i]->m_root, offsets[i]);
-
-    // Set next ptr
-    // TODO: use 0xffffffff
-    nodes_[currentroot].bounds.pmax.w = -1;
+    roots_[i] = nodecnt_;
+    ProcessTree(*bvhs[i], offsets[i]);
+  }
 
-    for (int j = currentroot; j < currentroot + bvhs[i]->m_nodecnt; ++j) {
-      // TODO: use 0xffffffff
-      if (nodes_[j].bounds.pmin.w != -1.f) {
-        nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-        // TODO: use intFromFloatBits
-        nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
-      }
-    }
+  assert(nodecnt_ == int(nodes_.size()));
+}
 
-    for (int j = currentroot; j < currentroot + bvhs[i]->m_nodecnt; ++j) {
-      // TODO: use 0xffffffff
-      if (nodes_[j].bounds.pmin.w == -1.f) {
-        // TODO: use floatBitsFromInt
-        nodes_[j].bounds.pmin.w = (float)extra_[j];
-      } else {
-        // TODO: use 0xffffffff
-        nodes_[j].bounds.pmin.w = -1.f;
-      }
-    }
-  }
+void PlainBvhTranslator::ProcessTree(Bvh const &bvh, int offset) {
+  // Check if we have been initialized
+  assert(bvh.m_root);
 
-  // The final one
-  root_ = nodecnt_;
+  // Save current root position
+  const int rootidx = nodecnt_;
 
   // Process root
-  ProcessNode(bvhs[numbvhs]->m_root);
+  ProcessNode(bvh.m_root);
+  const int endidx = nodecnt_;
 
   // Set next ptr
-  // TODO: use 0xffffffff
-  nodes_[root_].bounds.pmax.w = -1;
-
-  for (int j = root_; j < root_ + bvhs[numbvhs]->m_nodecnt; ++j) {
-    // TODO: use 0xffffffff
-    if (nodes_[j].bounds.pmin.w != -1.f) {
-      nodes_[j + 1].bounds.pmax.w = nodes_[j].bounds.pmin.w;
-      // TODO: use intFromFloatBits
-      nodes_[(int)(nodes_[j].bounds.pmin.w)].bounds.pmax.w = nodes_[j].bounds.pmax.w;
+  nodes_[rootidx].bounds.pmax.w = floatBitsFromInt(kInvalidIndex);
+
+  // Internal nodes hold the index of their right child in pmin.w at this point.
+  for (int i = rootidx; i < endidx; ++i) {
+    const uint32_t rightidx = intFromFloatBits(nodes_[i].bounds.pmin.w);
+    if (rightidx != kInvalidIndex) {
+      nodes_[i + 1].bounds.pmax.w = nodes_[i].bounds.pmin.w;
+      nodes_[rightidx].bounds.pmax.w = nodes_[i].bounds.pmax.w;
     }
   }
 
-  for (int j = root_; j < root_ + bvhs[numbvhs]->m_nodecnt; ++j) {
-    // TODO: use 0xffffffff
-    if (nodes_[j].bounds.pmin.w == -1.f) {
-      // TODO: use floatBitsFromInt
-      nodes_[j].bounds.pmin.w = (float)extra_[j];
+  const auto reordering = bvh.GetIndices();
+  for (int i = rootidx; i < endidx; ++i) {
+    auto &node = nodes_[i];
+    if (intFromFloatBits(node.bounds.pmin.w) == kInvalidIndex) {
+      // nodes_[i].bounds.pmin.w = (float)extra_[i];
+
+      // Here it is assumed that primitive indices
+      // [reordering[s], reordering[s+1], ..., reordering[s+n-1]]
+      // are contiguous.
+      // s = node.primitives.start, n = node.primitives.count
+      const auto startidx = node.primitives.first;
+      for (int j = 1; j < node.primitives.count; ++j) {
+        assert(reordering[startidx + j] == reordering[startidx] + j);
+      }
+
+      // Primitives of a bottom level BVH are numbered after those of the previous ones.
+      const uint32_t primitive_idx = reordering[startidx] + offset;
+      node.bounds.pmin.w = floatBitsFromInt(primitive_idx);
+      // nodes_[i].bounds.pmin.w = floatBitsFromInt(extra_[i]);
     } else {
-      // TODO: use 0xffffffff
-      nodes_[j].bounds.pmin.w = -1.f;
+      node.bounds.pmin.w = floatBitsFromInt(kInvalidIndex);
     }
   }
-#endif
 }
 
-int PlainBvhTranslator::ProcessNode(Bvh::Node const *n) {
-  int idx = nodecnt_;
-  // std::cout << "Index " << idx << "\n";
-  Node &node = nodes_[nodecnt_];
-  node.bounds = n->bounds;
-  // int &extra = extra_[nodecnt_];
-  nodecnt_++;
-
-  if (n->type == Bvh::kLeaf) {
-    int startidx = n->startidx;
-    node.primitives.first = startidx;
-    node.primitives.count = n->numprims;
-    // TODO: use 0xffffffff
-    node.bounds.pmin.w = -1.f;
-  } else {
-    ProcessNode(n->lc);
-    // TODO: use floatBitsFromInt
-    node.bounds.pmin.w = (float)ProcessNode(n->rc);
-    node.primitives.first = -1;
-    node.primitives.count = -1;
-  }
-
-  return idx;
-}
+int PlainBvhTranslator::ProcessNode(Bvh::Node const *root) {
+  // Depth-first with an explicit stack: degenerate trees get deeper than the call stack allows.
+  // Every entry remembers the node whose right child it is, -1 for left children.
+  struct StackEntry {
+    Bvh::Node const *node;
+    int parentidx;
+  };
+  std::stack<StackEntry> stack;
+  stack.push({ root, -1 });
+
+  const int rootidx = nodecnt_;
+  while (!stack.empty()) {
+    const StackEntry entry = stack.top();
+    stack.pop();
+
+    Bvh::Node const *n = entry.node;
+    int idx = nodecnt_;
+    // std::cout << "Index " << idx << "\n";
+    Node &node = nodes_[nodecnt_];
+    node.bounds = n->bounds;
+    // int &extra = extra_[nodecnt_];
+    nodecnt_++;
+
+    if (entry.parentidx != -1) {
+      nodes_[entry.parentidx].bounds.pmin.w = floatBitsFromInt(uint32_t(idx));
+    }
 
-#if 0
-int PlainBvhTranslator::ProcessNode(Bvh::Node const *n, int offset) {
-  int idx = nodecnt_;
-  Node &node = nodes_[nodecnt_];
-  node.bounds = n->bounds;
-  // int &extra = extra_[nodecnt_];
-  nodecnt_++;
-
-  if (n->type == Bvh::kLeaf) {
-    int startidx = n->startidx + offset;
-    // extra = (startidx << 4) | (n->numprims & 0xF);
-    node.primitives.first = startidx;
-    node.primitives.count = n->numprims;
-    // TODO: use 0xffffffff
-    node.bounds.pmin.w = -1.f;
-  } else {
-    ProcessNode(n->lc, offset);
-    // TODO: use floatBitsFromInt
-    node.bounds.pmin.w = (float)ProcessNode(n->rc, offset);
+    if (n->type == Bvh::kLeaf) {
+      int startidx = n->startidx;
+      node.primitives.first = startidx;
+      node.primitives.count = n->numprims;
+      node.bounds.pmin.w = floatBitsFromInt(kInvalidIndex);
+    } else {
+      stack.push({ n->rc, idx });
+      stack.push({ n->lc, -1 });
+      node.primitives.first = -1;
+      node.primitives.count = -1;
+    }
   }
 
-  return idx;
+  return rootidx;
 }
-#endif
 
 void PlainBvhTranslator::Flush() {
   nodecnt_ = 0;
   root_ = 0;
+  toplevelcnt_ = 0;
   roots_.resize(0);
   nodes_.resize(0);
   // extra_.resize(0);
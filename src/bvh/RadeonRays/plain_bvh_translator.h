@@ -56,10 +56,16 @@ class PlainBvhTranslator {
 
   void Flush();
   void Process(Bvh &bvh);
+  // Two-level BVH: bvhs[0..numbvhs) are the bottom level BVHs, whose primitive indices are
+  // shifted by offsets[i], and bvhs[numbvhs] is the top level BVH over them. The top level BVH
+  // is translated first, followed by the bottom level ones starting at getRoots()[i]. Each tree
+  // ends with a 0xFFFFFFFF skip link at its root.
   void Process(Bvh const **bvhs, int const *offsets, int numbvhs);
+  // Translate a rebuilt top level BVH with the same number of nodes in place.
   void UpdateTopLevel(Bvh const &bvh);
 
   const std::vector<Node> &getNodes() const { return nodes_; }
+  const std::vector<int> &getRoots() const { return roots_; }
 
  private:
   std::vector<Node> nodes_;
@@ -67,10 +73,12 @@ class PlainBvhTranslator {
   std::vector<int> roots_;
   int nodecnt_ = 0;
   int root_ = 0;
+  int toplevelcnt_ = 0;
 
  private:
+  // Translate bvh at nodecnt_ with skip links relative to its own root.
+  void ProcessTree(Bvh const &bvh, int offset);
   int ProcessNode(Bvh::Node const *node);
-  // int ProcessNode(Bvh::Node const *n, int offset);
 
   PlainBvhTranslator(PlainBvhTranslator const &) = delete;
   PlainBvhTranslator &operator=(PlainBvhTranslator const &) = delete;
@@ -0,0 +1,58 @@
+#include <bvh/build_arena.h>
+
+#include <algorithm>
+#include <cstdint>
+
+namespace bvh {
+
+namespace {
+constexpr size_t kMinBlockSize = 1 << 20;
+} // namespace
+
+void BuildArena::reset() {
+  m_allocation_count = 0;
+  if (m_blocks.size() > 1) {
+    const size_t size = getCapacityBytes();
+    m_blocks.clear();
+    m_blocks.push_back({ std::unique_ptr<unsigned char[]>(new unsigned char[size]), size });
+    // Counted towards the next build, which needed it.
+    m_allocation_count = 1;
+  }
+  m_current_block = 0;
+  m_offset = 0;
+  m_used_bytes = 0;
+}
+
+size_t BuildArena::getCapacityBytes() const {
+  size_t size = 0;
+  for (const auto &block : m_blocks) {
+    size += block.size;
+  }
+  return size;
+}
+
+void *BuildArena::allocateBytes(size_t size, size_t alignment) {
+  // Try the current block, then the following ones kept from earlier builds.
+  for (; m_current_block < m_blocks.size(); ++m_current_block, m_offset = 0) {
+    const Block &block = m_blocks[m_current_block];
+    const auto base = reinterpret_cast<uintptr_t>(block.data.get());
+    const size_t offset = ((base + m_offset + alignment - 1) & ~(alignment - 1)) - base;
+    if (offset + size <= block.size) {
+      m_used_bytes += offset + size - m_offset;
+      m_offset = offset + size;
+      return block.data.get() + offset;
+    }
+  }
+
+  // Blocks grow geometrically so that large builds take few allocations.
+  const size_t block_size =
+    std::max({ size + alignment, kMinBlockSize, getCapacityBytes() });
+  m_blocks.push_back(
+    { std::unique_ptr<unsigned char[]>(new unsigned char[block_size]), block_size });
+  ++m_allocation_count;
+  m_current_block = m_blocks.size() - 1;
+  m_offset = 0;
+  return allocateBytes(size, alignment);
+}
+
+} // namespace bvh
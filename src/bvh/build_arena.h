@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include <gsl/span>
+
+namespace bvh {
+
+// Bump allocator for the scratch memory of a BVH build.
+// Memory is handed out from large blocks and only released all at once by reset(), which keeps
+// the blocks for the next build: once an arena has seen a build, builds of the same size do not
+// allocate. Not thread-safe: allocate on the thread driving the build and hand the spans to the
+// workers.
+class BuildArena {
+ public:
+  BuildArena() = default;
+
+  // Allocate count default-initialized objects. Destructors never run, so only trivially
+  // destructible types are allowed.
+  template <typename T>
+  gsl::span<T> allocate(size_t count);
+
+  // Release every allocation. If the previous build needed several blocks they are merged into
+  // one of the peak size, so that the next build fits into it.
+  void reset();
+
+  // Heap allocations and bytes handed out since the last reset. Nothing is freed before a reset,
+  // so the bytes in use are also the peak.
+  int getAllocationCount() const { return m_allocation_count; }
+  size_t getPeakBytes() const { return m_used_bytes; }
+  size_t getCapacityBytes() const;
+
+ private:
+  void *allocateBytes(size_t size, size_t alignment);
+
+  struct Block {
+    std::unique_ptr<unsigned char[]> data;
+    size_t size;
+  };
+  std::vector<Block> m_blocks;
+  // Block allocations are served from and the first free byte in it.
+  size_t m_current_block = 0;
+  size_t m_offset = 0;
+  size_t m_used_bytes = 0;
+  int m_allocation_count = 0;
+
+  BuildArena(const BuildArena &) = delete;
+  BuildArena &operator=(const BuildArena &) = delete;
+};
+
+template <typename T>
+gsl::span<T> BuildArena::allocate(size_t count) {
+  static_assert(
+    std::is_trivially_destructible<T>::value, "BuildArena does not run destructors");
+  if (count == 0) {
+    return {};
+  }
+  T *data = static_cast<T *>(allocateBytes(count * sizeof(T), alignof(T)));
+  for (size_t i = 0; i < count; ++i) {
+    new (data + i) T;
+  }
+  return { data, static_cast<std::ptrdiff_t>(count) };
+}
+
+} // namespace bvh
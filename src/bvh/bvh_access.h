@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+
+// RadeonRays
+#include <accelerator/bvh.h>
+
+namespace bvh {
+
+// Access to the pointer tree of a built RadeonRays::Bvh, for the passes that work on it between
+// Bvh::Build and the translation to skip links. The tree is protected in RadeonRays; member
+// pointers formed in a derived class can be applied to any Bvh.
+struct BvhAccess : RadeonRays::Bvh {
+  using Node = Bvh::Node;
+  using Bvh::kInternal;
+  using Bvh::kLeaf;
+
+  static Node *root(Bvh &bvh) { return bvh.*(&BvhAccess::m_root); }
+  static const Node *root(const Bvh &bvh) { return bvh.*(&BvhAccess::m_root); }
+  static std::vector<Node> &nodes(Bvh &bvh) { return bvh.*(&BvhAccess::m_nodes); }
+};
+
+} // namespace bvh
@@ -1,18 +1,72 @@
 #include <bvh/bvh_builder.h>
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
+#include <string>
 
 // RadeonRays
 #include <accelerator/split_bvh.h>
 
 #include "RadeonRays/plain_bvh_translator.h"
+#include "bvh_access.h"
+#include "bvh_cache.h"
+#include "hlbvh.h"
+#include "linear_bvh.h"
+#include "node_layout.h"
+#include "parallel_bvh.h"
+#include "parallel_split_bvh.h"
+#include "ploc_bvh.h"
+#include "task_pool.h"
+#include "treelet_optimizer.h"
 
 namespace bvh {
 
-using Bvh = RadeonRays::Bvh;
 using SplitBvh = RadeonRays::SplitBvh;
 
-// Factory method for RadeonRays BVH implementations.
+namespace {
+// Scale up bounds a bit to avoid cracks when tracing rays against the scene.
+bbox scale_leaf_bounds(bbox leaf) {
+  constexpr float kBoundsScale = 1 + 1e-4f;
+  const auto center = leaf.center();
+  leaf.pmin = center + (leaf.pmin - center) * kBoundsScale;
+  leaf.pmax = center + (leaf.pmax - center) * kBoundsScale;
+  return leaf;
+}
+
+// Names of the options read on every build_bvh call, so that looking them up does not allocate.
+const std::string kBuilderOption = "bvh.builder";
+const std::string kUseSplitsOption = "bvh.sah.use_splits";
+const std::string kTraversalCostOption = "bvh.sah.traversal_cost";
+const std::string kNumBinsOption = "bvh.sah.num_bins";
+const std::string kTreeletPassesOption = "bvh.treelet.passes";
+const std::string kTreeletLeavesOption = "bvh.treelet.leaves";
+const std::string kMaxLeafSizeOption = "bvh.max_leaf_size";
+const std::string kLayoutBlockSizeOption = "bvh.layout.block_size";
+
+// Whether the options select "sah_parallel" without splits, which ParallelBvh writes as skip
+// links directly, and its parameters. "sah" stays on RadeonRays::Bvh, the reference the parallel
+// builder is checked against.
+bool use_skip_links_bvh(const BvhOptions &options, float &traversal_cost, int &num_bins) {
+  auto builder = options.GetOption(kBuilderOption);
+  auto splits = options.GetOption(kUseSplitsOption);
+  auto tcost = options.GetOption(kTraversalCostOption);
+  auto nbins = options.GetOption(kNumBinsOption);
+  if (!builder || builder->AsString() != "sah_parallel") {
+    return false;
+  }
+  if (splits && splits->AsFloat() > 0.f) {
+    return false;
+  }
+  traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+  num_bins = nbins ? (int)nbins->AsFloat() : 64;
+  return true;
+}
+} // namespace
+
+BuildContext::BuildContext() = default;
+BuildContext::~BuildContext() = default;
+
 std::unique_ptr<Bvh> make_bvh(const BvhOptions &options) {
   // Check options
   auto builder = options.GetOption("bvh.builder");
@@ -22,57 +76,369 @@ std::unique_ptr<Bvh> make_bvh(const BvhOptions &options) {
   auto tcost = options.GetOption("bvh.sah.traversal_cost");
   auto node_budget = options.GetOption("bvh.sah.extra_node_budget");
   auto nbins = options.GetOption("bvh.sah.num_bins");
+  auto mbits = options.GetOption("bvh.lbvh.morton_bits");
+  auto cbits = options.GetOption("bvh.hlbvh.cluster_bits");
+  auto pradius = options.GetOption("bvh.ploc.radius");
 
   bool use_sah = false;
+  bool use_parallel_sah = false;
+  bool use_lbvh = false;
+  bool use_hlbvh = false;
+  bool use_ploc = false;
   bool use_splits = false;
   int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
   int num_bins = nbins ? (int)nbins->AsFloat() : 64;
   float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
   float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
   float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+  int morton_bits = mbits ? (int)mbits->AsFloat() : 30;
+  int cluster_bits = cbits ? (int)cbits->AsFloat() : 15;
+  int ploc_radius = pradius ? (int)pradius->AsFloat() : 16;
 
   if (builder && builder->AsString() == "sah") {
     use_sah = true;
   }
 
+  if (builder && builder->AsString() == "sah_parallel") {
+    use_parallel_sah = true;
+  }
+
+  if (builder && builder->AsString() == "lbvh") {
+    use_lbvh = true;
+  }
+
+  if (builder && builder->AsString() == "hlbvh") {
+    use_hlbvh = true;
+  }
+
+  if (builder && builder->AsString() == "ploc") {
+    use_ploc = true;
+  }
+
   if (splits && splits->AsFloat() > 0.f) {
     use_splits = true;
   }
 
-  if (use_splits) {
+  if (use_splits && use_parallel_sah) {
+    return std::make_unique<ParallelSplitBvh>(
+      traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget);
+  } else if (use_splits) {
     return std::make_unique<SplitBvh>(
       traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget);
+  } else if (use_parallel_sah) {
+    return std::make_unique<ParallelBvh>(traversal_cost, num_bins);
+  } else if (use_lbvh) {
+    return std::make_unique<LinearBvh>(traversal_cost, morton_bits);
+  } else if (use_hlbvh) {
+    return std::make_unique<HlBvh>(traversal_cost, morton_bits, cluster_bits);
+  } else if (use_ploc) {
+    return std::make_unique<PlocBvh>(traversal_cost, morton_bits, ploc_radius);
   } else {
     return std::make_unique<Bvh>(traversal_cost, num_bins, use_sah);
   }
 }
 
-std::vector<bbox> build_bvh(gsl::span<bbox> leaf_bounds, const BvhOptions &options) {
-  // Scale up bounds a bit to avoid cracks when tracing rays against the scene.
-  // TODO: move this into bvh->Build to avoid this additional copy.
-  std::vector<bbox> scaled_leafs(leaf_bounds.begin(), leaf_bounds.end());
-  for (auto &leaf : scaled_leafs) {
-    constexpr float kBoundsScale = 1 + 1e-4f;
-    const auto center = leaf.center();
-    leaf.pmin = center + (leaf.pmin - center) * kBoundsScale;
-    leaf.pmax = center + (leaf.pmax - center) * kBoundsScale;
-  }
-  // Build BVH in tree-like representation.
-  auto bvh = make_bvh(options);
-  bvh->Build(scaled_leafs.data(), scaled_leafs.size());
-  // bvh->PrintStatistics(std::cout);
-
-  // Translate to linear skip-links representation.
-  RadeonRays::PlainBvhTranslator translator;
-  translator.Process(*bvh);
-
-  // Copy out the linearized nodes.
-  std::vector<bbox> res;
-  res.reserve(translator.getNodes().size());
-  for (const auto &translator_node : translator.getNodes()) {
-    res.push_back(translator_node.bounds);
+std::vector<bbox>
+build_bvh(gsl::span<bbox> leaf_bounds, const BvhOptions &options, BvhStats *out_stats) {
+  BuildContext context;
+  build_bvh(leaf_bounds, options, context, out_stats);
+  return std::move(context.m_nodes);
+}
+
+gsl::span<const bbox> build_bvh(
+  gsl::span<bbox> leaf_bounds,
+  const BvhOptions &options,
+  BuildContext &context,
+  BvhStats *out_stats) {
+  const auto start_time = std::chrono::steady_clock::now();
+  auto &arena = context.m_arena;
+  auto &res = context.m_nodes;
+  arena.reset();
+  const size_t nodes_capacity = res.capacity();
+  int alloc_count = 0;
+
+  const int numleafs = int(leaf_bounds.size());
+  auto scaled_leafs = arena.allocate<bbox>(numleafs);
+  std::transform(leaf_bounds.begin(), leaf_bounds.end(), scaled_leafs.begin(), scale_leaf_bounds);
+
+  auto passes = options.GetOption(kTreeletPassesOption);
+  auto treelet_leaves = options.GetOption(kTreeletLeavesOption);
+  auto leaf_size = options.GetOption(kMaxLeafSizeOption);
+  auto layout = options.GetOption(kLayoutBlockSizeOption);
+  const int treelet_passes = passes ? (int)passes->AsFloat() : 0;
+  const int layout_block_size = layout ? (int)layout->AsFloat() : 0;
+  // Ranges can not address the primitives of larger scenes, they get single primitive leafs.
+  const int max_leaf_size = leaf_size && numleafs <= kMaxLeafRangeStart + 1 ?
+    std::min(std::max((int)leaf_size->AsFloat(), 1), kMaxLeafSize) :
+    1;
+  auto &primitive_order = context.m_primitive_order;
+  const size_t primitive_order_capacity = primitive_order.capacity();
+  primitive_order.resize(max_leaf_size > 1 ? numleafs : 0);
+  float unoptimized_sah_cost = 0.f;
+
+  float traversal_cost = 0.f;
+  int num_bins = 0;
+  if (treelet_passes == 0 && use_skip_links_bvh(options, traversal_cost, num_bins)) {
+    // Emit the linear skip-links representation directly, reusing the builder of the context.
+    if (
+      !context.m_skip_links_bvh || context.m_traversal_cost != traversal_cost ||
+      context.m_num_bins != num_bins) {
+      context.m_skip_links_bvh = std::make_unique<ParallelBvh>(traversal_cost, num_bins);
+      context.m_traversal_cost = traversal_cost;
+      context.m_num_bins = num_bins;
+      ++alloc_count;
+    }
+    res.resize(numleafs > 0 ? 2 * numleafs - 1 : 0);
+    const int numnodes = context.m_skip_links_bvh->BuildSkipLinks(
+      scaled_leafs.data(), numleafs, res.data(), arena, max_leaf_size, primitive_order.data());
+    res.resize(numnodes);
+  } else {
+    // Build BVH in tree-like representation.
+    auto bvh = make_bvh(options);
+    bvh->Build(scaled_leafs.data(), numleafs);
+    // bvh->PrintStatistics(std::cout);
+
+    // Optionally improve the tree of the faster builders.
+    if (treelet_passes > 0) {
+      if (out_stats) {
+        unoptimized_sah_cost = calc_sah_cost(*bvh);
+      }
+      optimize_treelets(
+        *bvh, treelet_passes, treelet_leaves ? (int)treelet_leaves->AsFloat() : 7);
+    }
+
+    // Translate to linear skip-links representation.
+    RadeonRays::PlainBvhTranslator translator;
+    translator.Process(*bvh);
+
+    // Copy out the linearized nodes.
+    const auto &translator_nodes = translator.getNodes();
+    res.resize(translator_nodes.size());
+    std::transform(
+      translator_nodes.begin(), translator_nodes.end(), res.begin(),
+      [](const RadeonRays::PlainBvhTranslator::Node &node) { return node.bounds; });
+
+    // Single primitive leafs as ranges, numbered in leaf order.
+    if (max_leaf_size > 1) {
+      int leafidx = 0;
+      for (auto &node : res) {
+        if (is_leaf_node(node)) {
+          primitive_order[leafidx] = decode_index(node.pmin.w);
+          node.pmin.w = pack_leaf_range(leafidx++, 1);
+        }
+      }
+    }
+  }
+
+  if (layout_block_size > 0) {
+    reorder_bvh(res, layout_block_size, arena);
+  }
+
+  if (res.capacity() != nodes_capacity) {
+    ++alloc_count;
+  }
+  if (primitive_order.capacity() != primitive_order_capacity) {
+    ++alloc_count;
+  }
+
+  if (out_stats) {
+    const auto end_time = std::chrono::steady_clock::now();
+    out_stats->build_time_ms =
+      std::chrono::duration<double, std::milli>(end_time - start_time).count();
+    out_stats->node_count = int(res.size());
+    out_stats->leaf_count = int(std::count_if(res.begin(), res.end(), is_leaf_node));
+    out_stats->sah_cost = calc_sah_cost(res, 1.f, 1.f, max_leaf_size);
+    out_stats->unoptimized_sah_cost =
+      treelet_passes > 0 ? unoptimized_sah_cost : out_stats->sah_cost;
+    out_stats->alloc_count = alloc_count + arena.getAllocationCount();
+    out_stats->peak_bytes =
+      arena.getPeakBytes() + res.size() * sizeof(bbox) + primitive_order.size() * sizeof(int);
   }
   return res;
 }
 
+uint64_t hash_bvh_options(const BvhOptions &options, uint64_t seed) {
+  static const std::string kFloatOptions[] = {
+    kUseSplitsOption,
+    "bvh.sah.max_split_depth",
+    "bvh.sah.min_overlap",
+    kTraversalCostOption,
+    "bvh.sah.extra_node_budget",
+    kNumBinsOption,
+    "bvh.lbvh.morton_bits",
+    "bvh.hlbvh.cluster_bits",
+    "bvh.ploc.radius",
+    kTreeletPassesOption,
+    kTreeletLeavesOption,
+    kMaxLeafSizeOption,
+    kLayoutBlockSizeOption,
+  };
+  // Unset options hash apart from any value. The defaults are not covered, changing one needs a
+  // new kBvhCacheVersion.
+  auto builder = options.GetOption(kBuilderOption);
+  const std::string name = builder ? builder->AsString() : std::string();
+  const uint8_t builder_set = builder ? 1 : 0;
+  uint64_t hash = hash_bytes(&builder_set, sizeof(builder_set), seed);
+  hash = hash_bytes(name.data(), name.size(), hash);
+  for (const auto &option_name : kFloatOptions) {
+    auto option = options.GetOption(option_name);
+    const uint8_t is_set = option ? 1 : 0;
+    const float value = option ? option->AsFloat() : 0.f;
+    hash = hash_bytes(&is_set, sizeof(is_set), hash);
+    hash = hash_bytes(&value, sizeof(value), hash);
+  }
+  return hash;
+}
+
+gsl::span<const BuilderPreset> builder_presets() {
+  static const BuilderPreset kPresets[] = {
+    { "sah", "sah", {} },
+    { "sah_parallel", "sah_parallel", {} },
+    { "sah_parallel (4 per leaf)", "sah_parallel", { { "bvh.max_leaf_size", 4.f } } },
+    { "median", "median", {} },
+    { "lbvh (30 bit)", "lbvh", { { "bvh.lbvh.morton_bits", 30.f } } },
+    { "lbvh (63 bit)", "lbvh", { { "bvh.lbvh.morton_bits", 63.f } } },
+    { "hlbvh", "hlbvh", {} },
+    { "ploc", "ploc", {} },
+    { "lbvh + treelets", "lbvh", { { "bvh.treelet.passes", 3.f } } },
+    { "hlbvh + treelets", "hlbvh", { { "bvh.treelet.passes", 3.f } } },
+    { "sbvh", "sah", { { "bvh.sah.use_splits", 1.f } } },
+    { "sbvh_parallel", "sah_parallel", { { "bvh.sah.use_splits", 1.f } } },
+  };
+  return kPresets;
+}
+
+void set_builder_preset(const BuilderPreset &preset, BvhOptions &options) {
+  options.SetValue(kBuilderOption.c_str(), preset.builder);
+  for (const auto &option : preset.options) {
+    if (option.name) {
+      options.SetValue(option.name, option.value);
+    }
+  }
+}
+
+void refit_bvh(gsl::span<bbox> nodes, gsl::span<const bbox> leaf_bounds, BvhStats *out_stats) {
+  refit_bvh(nodes, leaf_bounds, {}, out_stats);
+}
+
+void refit_bvh(
+  gsl::span<bbox> nodes,
+  gsl::span<const bbox> leaf_bounds,
+  gsl::span<const int> primitive_order,
+  BvhStats *out_stats) {
+  const auto start_time = std::chrono::steady_clock::now();
+  const int num_nodes = int(nodes.size());
+
+  // Children come after their parent in the node array, so the depth of every node is known by
+  // the time the scan reaches it. The children of internal node i are i + 1 and the skip link
+  // of i + 1.
+  const auto is_leaf = [&](int i) { return is_leaf_node(nodes[i]); };
+  std::vector<int> depths(num_nodes, 0);
+  int max_depth = 0;
+  for (int i = 0; i < num_nodes; ++i) {
+    if (!is_leaf(i)) {
+      const int right = decode_index(nodes[i + 1].pmax.w);
+      depths[i + 1] = depths[right] = depths[i] + 1;
+      max_depth = std::max(max_depth, depths[i] + 1);
+    }
+  }
+
+  // Bucket the nodes by depth: level d is [level_starts[d], level_starts[d + 1]) of by_level.
+  std::vector<int> level_starts(max_depth + 2, 0);
+  for (int i = 0; i < num_nodes; ++i) {
+    ++level_starts[depths[i] + 1];
+  }
+  for (int d = 0; d <= max_depth; ++d) {
+    level_starts[d + 1] += level_starts[d];
+  }
+  std::vector<int> by_level(num_nodes);
+  {
+    std::vector<int> fill(level_starts.begin(), level_starts.end() - 1);
+    for (int i = 0; i < num_nodes; ++i) {
+      by_level[fill[depths[i]]++] = i;
+    }
+  }
+
+  // Refit bottom-up, the nodes of a level in parallel. The payloads and skip links in w stay.
+  const auto set_bounds = [](bbox &node, const bbox &bounds) {
+    node.pmin.x = bounds.pmin.x;
+    node.pmin.y = bounds.pmin.y;
+    node.pmin.z = bounds.pmin.z;
+    node.pmax.x = bounds.pmax.x;
+    node.pmax.y = bounds.pmax.y;
+    node.pmax.z = bounds.pmax.z;
+  };
+  constexpr int kRefitGrain = 4 * 1024;
+  for (int d = max_depth; d >= 0; --d) {
+    TaskPool::global().parallelFor(
+      level_starts[d], level_starts[d + 1], kRefitGrain, [&](int begin, int end) {
+        for (int j = begin; j < end; ++j) {
+          const int i = by_level[j];
+          if (is_leaf(i) && primitive_order.empty()) {
+            set_bounds(nodes[i], scale_leaf_bounds(leaf_bounds[decode_index(nodes[i].pmin.w)]));
+          } else if (is_leaf(i)) {
+            const int start = leaf_range_start(nodes[i].pmin.w);
+            const int count = leaf_range_count(nodes[i].pmin.w);
+            bbox bounds;
+            for (int k = start; k < start + count; ++k) {
+              bounds.grow(scale_leaf_bounds(leaf_bounds[primitive_order[k]]));
+            }
+            set_bounds(nodes[i], bounds);
+          } else {
+            bbox bounds = nodes[i + 1];
+            bounds.grow(nodes[decode_index(nodes[i + 1].pmax.w)]);
+            set_bounds(nodes[i], bounds);
+          }
+        }
+      });
+  }
+
+  if (out_stats) {
+    const auto end_time = std::chrono::steady_clock::now();
+    out_stats->build_time_ms =
+      std::chrono::duration<double, std::milli>(end_time - start_time).count();
+    out_stats->node_count = num_nodes;
+    out_stats->leaf_count = int(std::count_if(nodes.begin(), nodes.end(), is_leaf_node));
+    out_stats->sah_cost =
+      calc_sah_cost(nodes, 1.f, 1.f, primitive_order.empty() ? 1 : kMaxLeafSize);
+    out_stats->unoptimized_sah_cost = out_stats->sah_cost;
+  }
+}
+
+float calc_sah_cost(
+  gsl::span<const bbox> nodes, float traversal_cost, float intersection_cost, int max_leaf_size) {
+  if (nodes.empty()) {
+    return 0.f;
+  }
+  // Sum the costs weighted by the surface area of each node; normalize by the root once.
+  double cost = 0.0;
+  for (const auto &node : nodes) {
+    const bool is_leaf = is_leaf_node(node);
+    const int numprims = max_leaf_size > 1 && is_leaf ? leaf_range_count(node.pmin.w) : 1;
+    cost += double(node.surface_area()) *
+      (is_leaf ? intersection_cost * float(numprims) : traversal_cost);
+  }
+  return float(cost / nodes[0].surface_area());
+}
+
+float calc_sah_cost(const Bvh &bvh, float traversal_cost, float intersection_cost) {
+  const auto *root = BvhAccess::root(bvh);
+  if (!root) {
+    return 0.f;
+  }
+  double cost = 0.0;
+  std::vector<const BvhAccess::Node *> stack = { root };
+  while (!stack.empty()) {
+    const auto *node = stack.back();
+    stack.pop_back();
+    const bool is_leaf = node->type == BvhAccess::kLeaf;
+    cost += double(node->bounds.surface_area()) * (is_leaf ? intersection_cost : traversal_cost);
+    if (!is_leaf) {
+      stack.push_back(node->rc);
+      stack.push_back(node->lc);
+    }
+  }
+  return float(cost / root->bounds.surface_area());
+}
+
 } // namespace bvh
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
 #include <gsl/span>
 
 // RadeonRays
@@ -12,16 +16,21 @@
 #include <math/matrix.h>
 #include <math/quaternion.h>
 #include <math/ray.h>
+#include <accelerator/bvh.h>
 #include <primitive/instance.h>
 #include <primitive/mesh.h>
 #include <world/world.h>
 
+#include <bvh/build_arena.h>
 #include <bvh/mesh_view.h>
 
 namespace bvh {
 
 using bbox = RadeonRays::bbox;
 using BvhOptions = RadeonRays::Options;
+using Bvh = RadeonRays::Bvh;
+
+class ParallelBvh;
 
 // This implementation uses skip-links BVH, that is:
 // Each BVH node is a bbox consisting of the following:
@@ -33,7 +42,179 @@ using BvhOptions = RadeonRays::Options;
 //       node that has a next neighbor, or 0xFFFFFFFF for the root node
 // Non-leaf nodes are immediately followed by their first child in the node array.
 
+// Payloads and skip links are stored in the bits of the w components rather than as float
+// values, which only represent integers exactly up to 2^24.
+constexpr uint32_t kInvalidIndex = 0xFFFFFFFF;
+
+inline float encode_index(uint32_t index) {
+  float w;
+  std::memcpy(&w, &index, sizeof(w));
+  return w;
+}
+
+// -1 for kInvalidIndex.
+inline int decode_index(float w) {
+  uint32_t bits;
+  std::memcpy(&bits, &w, sizeof(bits));
+  return int(bits);
+}
+
+inline bool is_leaf_node(const bbox &node) {
+  return decode_index(node.pmin.w) != -1;
+}
+
+// Leafs of BVHs built with bvh.max_leaf_size > 1 hold up to kMaxLeafSize primitives. Their
+// payload is the range (start << 4 | count) of the primitive order, see startIdxFromW and
+// faceCountFromW in bvh.glslh. Starts are limited to kMaxLeafRangeStart to keep the payload
+// from colliding with kInvalidIndex.
+constexpr int kMaxLeafSize = 15;
+constexpr int kMaxLeafRangeStart = (1 << 28) - 2;
+
+inline float pack_leaf_range(int start, int count) {
+  return encode_index((uint32_t(start) << 4) | uint32_t(count));
+}
+
+inline int leaf_range_start(float w) {
+  return int(uint32_t(decode_index(w)) >> 4);
+}
+
+inline int leaf_range_count(float w) {
+  return decode_index(w) & 0xf;
+}
+
+// Factory method for BVH implementations. Recognized options:
+//  - bvh.builder: "sah" (RadeonRays binned SAH), "sah_parallel" (same tree as "sah", built on
+//       all cores), "lbvh" (linear BVH over Morton codes, fast to build, lower quality),
+//       "hlbvh" (LBVH clusters joined by SAH, close to "sah" quality at close to "lbvh" speed),
+//       "ploc" (bottom-up clustering in parallel passes, near "sah" quality), anything else
+//       selects the RadeonRays median split builder
+//  - bvh.lbvh.morton_bits: 30 or 63 bit Morton codes for "lbvh", "hlbvh" and "ploc"
+//  - bvh.hlbvh.cluster_bits: length of the Morton code prefix shared by an "hlbvh" cluster
+//  - bvh.ploc.radius: number of clusters searched on each side for nearest neighbors by "ploc"
+//  - bvh.sah.use_splits: use the RadeonRays spatial split builder (SBVH), or its parallel
+//       version together with "sah_parallel"
+//  - bvh.sah.*: SAH and spatial split parameters, see RadeonRays::SplitBvh
+std::unique_ptr<Bvh> make_bvh(const BvhOptions &options);
+
+// Statistics of a build_bvh call.
+struct BvhStats {
+  double build_time_ms = 0.0;
+  int node_count = 0;
+  int leaf_count = 0;
+  // See calc_sah_cost.
+  float sah_cost = 0.f;
+  // SAH cost before the treelet optimization, sah_cost if it is disabled.
+  float unoptimized_sah_cost = 0.f;
+  // Heap allocations and peak bytes of the memory owned by the BuildContext: the scratch arena,
+  // the builder and the output nodes. The node trees of the builders other than "sah_parallel"
+  // are not included.
+  int alloc_count = 0;
+  size_t peak_bytes = 0;
+};
+
+// Memory kept across build_bvh calls: the scratch arena, the builder and the output nodes.
+// Rebuilding geometry of the same size with the same context does not allocate on a single
+// thread, which is meant for animated content rebuilt every frame. Not thread-safe.
+class BuildContext {
+ public:
+  BuildContext();
+  ~BuildContext();
+
+  // Primitives in leaf order, that the leaf ranges of the last build index into. Empty when the
+  // leafs hold primitive indices, see bvh.max_leaf_size.
+  gsl::span<const int> getPrimitiveOrder() const { return m_primitive_order; }
+
+ private:
+  friend std::vector<bbox> build_bvh(gsl::span<bbox>, const BvhOptions &, BvhStats *);
+  friend gsl::span<const bbox> build_bvh(
+    gsl::span<bbox>, const BvhOptions &, BuildContext &, BvhStats *);
+
+  BuildArena m_arena;
+  std::unique_ptr<ParallelBvh> m_skip_links_bvh;
+  float m_traversal_cost = 0.f;
+  int m_num_bins = 0;
+  std::vector<bbox> m_nodes;
+  std::vector<int> m_primitive_order;
+
+  BuildContext(const BuildContext &) = delete;
+  BuildContext &operator=(const BuildContext &) = delete;
+};
+
 // Build an skip-links BVH with the supplied leaf bounding boxes.
-std::vector<bbox> build_bvh(gsl::span<bbox> leaf_bounds, const BvhOptions &options);
+// The "sah_parallel" builder writes the skip-links array directly. The others, "sah" included,
+// build a RadeonRays::Bvh node tree first and translate it.
+// Besides the make_bvh options, the built tree can be optimized with:
+//  - bvh.treelet.passes: number of treelet restructuring passes, 0 (default) disables them
+//  - bvh.treelet.leaves: leafs per treelet, 3 to 8, 7 by default
+//  - bvh.max_leaf_size: 1 (default) for leafs holding a primitive index, up to kMaxLeafSize for
+//       leafs holding packed ranges of BuildContext::getPrimitiveOrder. "sah_parallel" then
+//       makes leafs wherever SAH finds no cheaper split, the other builders keep single
+//       primitive leafs. The primitive buffers have to be reordered accordingly. Ignored above
+//       kMaxLeafRangeStart + 1 primitives.
+//  - bvh.layout.block_size: 0 (default) keeps the nodes in depth-first order, otherwise they are
+//       packed into treelet blocks of that many nodes, see reorder_bvh. kPageBlockSize suits
+//       large scenes.
+// Without a context, the primitive order is not available.
+std::vector<bbox> build_bvh(
+  gsl::span<bbox> leaf_bounds, const BvhOptions &options, BvhStats *out_stats = nullptr);
+// Same, reusing the memory of context. The returned nodes stay valid until the next build with
+// the same context.
+gsl::span<const bbox> build_bvh(
+  gsl::span<bbox> leaf_bounds,
+  const BvhOptions &options,
+  BuildContext &context,
+  BvhStats *out_stats = nullptr);
+
+// Hash of the options read by make_bvh and build_bvh, continuing from seed, for keying built
+// trees (see bvh_cache.h). Options these functions do not know are ignored.
+uint64_t hash_bvh_options(const BvhOptions &options, uint64_t seed = 0);
+
+// Builder configurations worth comparing on the same leafs, "sah" first as the reference. The
+// app logs them on its mesh with BVH_COMPARE_BUILDERS, the tests build and check every one.
+struct BuilderPreset {
+  const char *label;
+  // bvh.builder.
+  const char *builder;
+  // Further options with float values, unused ones have no name.
+  struct {
+    const char *name;
+    float value;
+  } options[2];
+};
+gsl::span<const BuilderPreset> builder_presets();
+// Set the options of preset.
+void set_builder_preset(const BuilderPreset &preset, BvhOptions &options);
+
+// Update the bounds of a skip-links BVH built by build_bvh to new leaf bounds in place, keeping
+// its topology. Much cheaper than a rebuild, but the tree degrades as the leafs move away from
+// the positions it was built for, see sah_degradation. out_stats->build_time_ms is the refit
+// time.
+void refit_bvh(
+  gsl::span<bbox> nodes, gsl::span<const bbox> leaf_bounds, BvhStats *out_stats = nullptr);
+// Same for leafs holding ranges of primitive_order, see bvh.max_leaf_size.
+void refit_bvh(
+  gsl::span<bbox> nodes,
+  gsl::span<const bbox> leaf_bounds,
+  gsl::span<const int> primitive_order,
+  BvhStats *out_stats = nullptr);
+
+// Quality loss of a refitted BVH: its SAH cost relative to the one right after the build. SAH
+// costs are relative to the root, so rigid motion and uniform scaling keep it at 1. Deforming
+// meshes should be rebuilt once it exceeds about 1.5.
+inline float sah_degradation(const BvhStats &built, const BvhStats &refitted) {
+  return built.sah_cost > 0.f ? refitted.sah_cost / built.sah_cost : 1.f;
+}
+
+// SAH cost of a skip-links BVH: the expected cost of tracing a random ray that hits the root,
+// i.e. the sum of the node costs weighted by their surface area relative to the root.
+// max_leaf_size > 1 for leafs holding primitive ranges, see bvh.max_leaf_size.
+float calc_sah_cost(
+  gsl::span<const bbox> nodes,
+  float traversal_cost = 1.f,
+  float intersection_cost = 1.f,
+  int max_leaf_size = 1);
+// Same for a built tree, before the translation to skip links.
+float calc_sah_cost(
+  const Bvh &bvh, float traversal_cost = 1.f, float intersection_cost = 1.f);
 
 } // namespace bvh
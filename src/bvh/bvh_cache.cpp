@@ -0,0 +1,103 @@
+#include <bvh/bvh_cache.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace bvh {
+
+namespace {
+constexpr size_t kSectionAlignment = 64;
+
+size_t align_section(size_t offset) {
+  return (offset + kSectionAlignment - 1) & ~(kSectionAlignment - 1);
+}
+} // namespace
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed) {
+  constexpr uint64_t m = 0xc6a4a7935bd1e995ull;
+  constexpr int r = 47;
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  uint64_t h = seed ^ (uint64_t(size) * m);
+
+  const size_t num_words = size / 8;
+  for (size_t i = 0; i < num_words; ++i) {
+    uint64_t k;
+    std::memcpy(&k, bytes + 8 * i, sizeof(k));
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  const unsigned char *tail = bytes + 8 * num_words;
+  const size_t tail_size = size & 7;
+  if (tail_size > 0) {
+    for (size_t i = 0; i < tail_size; ++i) {
+      h ^= uint64_t(tail[i]) << (8 * i);
+    }
+    h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+size_t bvh_cache_file_size(const BvhCacheContents &contents) {
+  size_t size = align_section(sizeof(BvhCacheHeader));
+  for (const auto &section : contents.sections) {
+    size = align_section(size + section.size());
+  }
+  return size;
+}
+
+void write_bvh_cache(const BvhCacheContents &contents, uint64_t key, void *dst) {
+  auto *bytes = static_cast<unsigned char *>(dst);
+  BvhCacheHeader header = {};
+  header.version = kBvhCacheVersion;
+  header.key = key;
+  header.file_size = bvh_cache_file_size(contents);
+
+  size_t offset = align_section(sizeof(BvhCacheHeader));
+  for (int i = 0; i < kBvhCacheSectionCount; ++i) {
+    const auto &section = contents.sections[i];
+    header.sections[i].offset = offset;
+    header.sections[i].size = section.size();
+    std::memcpy(bytes + offset, section.data(), section.size());
+    offset = align_section(offset + section.size());
+  }
+  std::memcpy(bytes, &header, sizeof(header));
+
+  const uint32_t magic = kBvhCacheMagic;
+  std::memcpy(bytes + offsetof(BvhCacheHeader, magic), &magic, sizeof(magic));
+}
+
+bool read_bvh_cache(const void *data, size_t size, uint64_t key, BvhCacheContents &out_contents) {
+  if (!data || size < sizeof(BvhCacheHeader)) {
+    return false;
+  }
+  BvhCacheHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  if (
+    header.magic != kBvhCacheMagic || header.version != kBvhCacheVersion || header.key != key ||
+    header.file_size != size) {
+    return false;
+  }
+
+  const auto *bytes = static_cast<const gsl::byte *>(data);
+  for (int i = 0; i < kBvhCacheSectionCount; ++i) {
+    const auto &section = header.sections[i];
+    if (
+      section.offset % kSectionAlignment != 0 || section.offset > size ||
+      section.size > size - section.offset) {
+      return false;
+    }
+    out_contents.sections[i] = { bytes + section.offset, std::ptrdiff_t(section.size) };
+  }
+  // A BVH has nodes, and nothing could be traced without them.
+  return !out_contents.sections[kBvhCacheNodes].empty();
+}
+
+} // namespace bvh
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <gsl/span>
+
+namespace bvh {
+
+// Binary file of a built BVH and the buffers it indexes, so that later launches can map it and
+// upload the buffers instead of building the BVH again.
+// The file is a BvhCacheHeader followed by the sections at 64 byte aligned offsets. Files are
+// keyed by a hash of the build inputs (see hash_bytes and hash_bvh_options), and rejected if
+// the key, the version or the sizes do not match. Sections are opaque bytes in the layout the
+// GPU reads, so the version and the key also have to cover the node format.
+constexpr uint32_t kBvhCacheMagic = 0x43485642; // "BVHC"
+// Bump on any change of the file layout or of the contents of the sections.
+constexpr uint32_t kBvhCacheVersion = 2;
+
+enum BvhCacheSection {
+  kBvhCacheNodes,
+  kBvhCacheVertices,
+  kBvhCacheIndices,
+  kBvhCacheSectionCount,
+};
+
+struct BvhCacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;
+  uint64_t file_size;
+  struct {
+    uint64_t offset;
+    uint64_t size;
+  } sections[kBvhCacheSectionCount];
+};
+
+struct BvhCacheContents {
+  gsl::span<const gsl::byte> sections[kBvhCacheSectionCount];
+};
+
+// 64-bit hash of size bytes at data, continuing from seed (MurmurHash64A by Austin Appleby),
+// which runs at several gigabytes per second.
+uint64_t hash_bytes(const void *data, size_t size, uint64_t seed = 0);
+
+// Size of the cache file of contents.
+size_t bvh_cache_file_size(const BvhCacheContents &contents);
+
+// Write the cache file of contents to dst, which holds bvh_cache_file_size(contents) bytes. The
+// magic number is written last, so that a file cut short by a crash is rejected.
+void write_bvh_cache(const BvhCacheContents &contents, uint64_t key, void *dst);
+
+// Sections of the cache file of size bytes at data, pointing into data. Returns false if it is
+// not a cache file of this version and key, if it is inconsistent, or if it has no nodes.
+bool read_bvh_cache(const void *data, size_t size, uint64_t key, BvhCacheContents &out_contents);
+
+} // namespace bvh
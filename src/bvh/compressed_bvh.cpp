@@ -0,0 +1,145 @@
+#include <bvh/compressed_bvh.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace bvh {
+
+namespace {
+constexpr int kMaxCell = 255;
+constexpr int kMinExponent = -126;
+constexpr int kMaxExponent = 127;
+
+// Coordinate of grid cell q, computed like the traversals do.
+float decode_cell(float origin, int q, float scale) {
+  return origin + float(q) * scale;
+}
+
+// Smallest exponent whose grid from origin reaches max.
+int grid_exponent(float origin, float max) {
+  int e = kMinExponent;
+  const float extent = max - origin;
+  if (extent > 0.f) {
+    int exponent;
+    std::frexp(extent / float(kMaxCell), &exponent);
+    e = std::max(exponent - 1, kMinExponent);
+  }
+  while (e < kMaxExponent && decode_cell(origin, kMaxCell, std::ldexp(1.f, e)) < max) {
+    ++e;
+  }
+  return e;
+}
+
+// Largest cell whose coordinate is not above x.
+uint8_t quantize_min(float origin, float scale, float x) {
+  const float estimate = std::floor((x - origin) / scale);
+  int q = int(std::min(std::max(estimate, 0.f), float(kMaxCell)));
+  while (q > 0 && decode_cell(origin, q, scale) > x) {
+    --q;
+  }
+  while (q < kMaxCell && decode_cell(origin, q + 1, scale) <= x) {
+    ++q;
+  }
+  return uint8_t(q);
+}
+
+// Smallest cell whose coordinate is not below x.
+uint8_t quantize_max(float origin, float scale, float x) {
+  const float estimate = std::ceil((x - origin) / scale);
+  int q = int(std::min(std::max(estimate, 0.f), float(kMaxCell)));
+  while (q < kMaxCell && decode_cell(origin, q, scale) < x) {
+    ++q;
+  }
+  while (q > 0 && decode_cell(origin, q - 1, scale) >= x) {
+    --q;
+  }
+  return uint8_t(q);
+}
+} // namespace
+
+std::vector<CompressedBvhNode> compress_bvh(gsl::span<const bbox> nodes) {
+  std::vector<CompressedBvhNode> res;
+  if (nodes.empty()) {
+    return res;
+  }
+
+  const int num_internal =
+    int(std::count_if(nodes.begin(), nodes.end(), [](const bbox &node) {
+      return !is_leaf_node(node);
+    }));
+  res.resize(1 + num_internal);
+
+  CompressedBvhHeader header = {};
+  for (int axis = 0; axis < 3; ++axis) {
+    header.origin[axis] = nodes[0].pmin[axis];
+  }
+  header.root_payload = is_leaf_node(nodes[0]) ? uint32_t(decode_index(nodes[0].pmin.w)) :
+                                                 kInvalidIndex;
+  std::memcpy(&res[0], &header, sizeof(header));
+  if (num_internal == 0) {
+    return res;
+  }
+
+  // Depth-first, so that the nodes keep the order of the skip-links array. Every entry knows the
+  // decoded bounds its grid spans and the node whose child it is.
+  struct StackEntry {
+    int node;
+    float3 origin;
+    float3 max;
+    int depth;
+    int parent;
+    int child;
+  };
+  std::vector<StackEntry> stack;
+  stack.push_back({ 0, nodes[0].pmin, nodes[0].pmax, 0, -1, 0 });
+  int nodecnt = 1;
+  while (!stack.empty()) {
+    const StackEntry entry = stack.back();
+    stack.pop_back();
+    if (entry.depth >= kCompressedBvhStackSize) {
+      res.clear();
+      return res;
+    }
+
+    const int idx = nodecnt++;
+    if (entry.parent != -1) {
+      res[entry.parent].children[entry.child] = uint32_t(idx);
+    }
+
+    CompressedBvhNode &out = res[idx];
+    out.exponents = 0;
+    float scale[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      const int e = grid_exponent(entry.origin[axis], entry.max[axis]);
+      out.exponents |= uint32_t(e + 127) << (8 * axis);
+      scale[axis] = std::ldexp(1.f, e);
+    }
+
+    const int children[2] = { entry.node + 1, decode_index(nodes[entry.node + 1].pmax.w) };
+    for (int child = 0; child < 2; ++child) {
+      const bbox &node = nodes[children[child]];
+      for (int axis = 0; axis < 3; ++axis) {
+        out.child_bounds[child][axis] =
+          quantize_min(entry.origin[axis], scale[axis], node.pmin[axis]);
+        out.child_bounds[child][3 + axis] =
+          quantize_max(entry.origin[axis], scale[axis], node.pmax[axis]);
+      }
+      if (is_leaf_node(node)) {
+        out.exponents |= kCompressedLeafChild << child;
+        out.children[child] = uint32_t(decode_index(node.pmin.w));
+      }
+    }
+
+    // Right child first so that the left one comes next.
+    for (int child = 1; child >= 0; --child) {
+      if (!(out.exponents & (kCompressedLeafChild << child))) {
+        const bbox bounds = decode_child_bounds(out, child, entry.origin);
+        stack.push_back(
+          { children[child], bounds.pmin, bounds.pmax, entry.depth + 1, idx, child });
+      }
+    }
+  }
+  return res;
+}
+
+} // namespace bvh
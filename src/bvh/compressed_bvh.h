@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <gsl/span>
+
+#include <bvh/bvh_builder.h>
+
+namespace bvh {
+
+// Compressed BVH with quantized child bounds, in the spirit of the compressed wide BVH of
+// Ylitie et al., "Efficient Incoherent Ray Traversal on GPUs Through Compressed Wide BVHs",
+// HPG 2017, for binary trees.
+// Every internal node of a skip-links BVH becomes a 24 byte node holding the bounds of both of
+// its children as 8-bit offsets on a grid local to the node. The grid starts at the decoded
+// minimum of the node's own bounds and its cell size is a power of two per axis, so decoding
+// (origin + q * 2^e) is exact up to the rounding of the addition, which the encoder accounts
+// for: decoded bounds always contain the original ones, also with fused multiply-adds. Leafs
+// are stored in their parent, leaving roughly half the nodes at three quarters of the size of
+// the skip-links ones.
+// Decoding needs the grid origin of the parent, so the traversal keeps a stack of the far
+// children and their origins (see traverse_compressed_bvh, and BVH_COMPRESSED_NODES in
+// bvh.glslh), which limits the depth of the tree to kCompressedBvhStackSize.
+struct CompressedBvhNode {
+  // Biased grid exponents (e + 127) in the three lower bytes, kCompressedLeafChild << child for
+  // leaf children in the top byte.
+  uint32_t exponents;
+  // Grid cells of the children bounds: minimum xyz, then maximum xyz for each child.
+  uint8_t child_bounds[2][6];
+  // Node index of internal children, leaf payload (see bvh_builder.h) of leaf children.
+  uint32_t children[2];
+};
+static_assert(sizeof(CompressedBvhNode) == 24, "CompressedBvhNode is read as 6 words by shaders");
+
+// Node 0 of a compressed BVH: the origin of the root grid, and the payload of the root if it is
+// a leaf or kInvalidIndex. The root node is node 1.
+struct CompressedBvhHeader {
+  float origin[3];
+  uint32_t root_payload;
+  uint32_t padding[2];
+};
+static_assert(sizeof(CompressedBvhHeader) == sizeof(CompressedBvhNode), "");
+
+constexpr uint32_t kCompressedLeafChild = 1u << 24;
+// Must match BVH_STACK_SIZE in bvh.glslh.
+constexpr int kCompressedBvhStackSize = 64;
+
+// Compress a skip-links BVH whose nodes contain their children, as all builders and refit_bvh
+// produce. Returns an empty vector if the tree is deeper than kCompressedBvhStackSize.
+std::vector<CompressedBvhNode> compress_bvh(gsl::span<const bbox> nodes);
+
+// Cell size of the grid of a node along axis.
+inline float compressed_grid_scale(uint32_t exponents, int axis) {
+  const uint32_t bits = ((exponents >> (8 * axis)) & 0xff) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return scale;
+}
+
+// Decoded bounds of a child of node, with the grid at origin.
+inline bbox decode_child_bounds(const CompressedBvhNode &node, int child, const float3 &origin) {
+  bbox res;
+  for (int axis = 0; axis < 3; ++axis) {
+    const float scale = compressed_grid_scale(node.exponents, axis);
+    res.pmin[axis] = origin[axis] + float(node.child_bounds[child][axis]) * scale;
+    res.pmax[axis] = origin[axis] + float(node.child_bounds[child][3 + axis]) * scale;
+  }
+  return res;
+}
+
+} // namespace bvh
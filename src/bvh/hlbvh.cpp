@@ -0,0 +1,150 @@
+#include <bvh/hlbvh.h>
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+namespace bvh {
+
+namespace {
+using bbox = RadeonRays::bbox;
+
+struct Cluster {
+  int first;
+  int count;
+  bbox bounds;
+  float centroid[3];
+};
+} // namespace
+
+void HlBvh::BuildImpl(bbox const *bounds, int numbounds) {
+  if (numbounds == 0) {
+    m_root = nullptr;
+    return;
+  }
+
+  const auto codes = SortByMortonCode(bounds, numbounds);
+
+  // Split the sorted primitives into clusters of equal code prefixes.
+  const int code_bits = m_morton_bits > 30 ? 63 : 30;
+  const int prefix_shift = code_bits - std::min(std::max(m_cluster_bits, 0), code_bits);
+  std::vector<Cluster> clusters;
+  for (int i = 0; i < numbounds; ++i) {
+    if (i == 0 || (codes[i] >> prefix_shift) != (codes[i - 1] >> prefix_shift)) {
+      clusters.push_back({ i, 0, bbox(), {} });
+    }
+    ++clusters.back().count;
+  }
+  const int numclusters = int(clusters.size());
+
+  // Node layout: the numclusters - 1 internal nodes of the top level tree, then the nodes of
+  // every cluster in code order.
+  InitNodeAllocator(2 * numbounds - 1);
+  std::vector<int> cluster_nodebase(numclusters);
+  {
+    int nodebase = numclusters - 1;
+    for (int i = 0; i < numclusters; ++i) {
+      cluster_nodebase[i] = nodebase;
+      nodebase += 2 * clusters[i].count - 1;
+    }
+  }
+
+  std::vector<Node *> cluster_roots(numclusters);
+  m_pool.parallelFor(0, numclusters, 1, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      auto &cluster = clusters[i];
+      cluster_roots[i] =
+        EmitRadixTree(bounds, codes.data(), cluster.first, cluster.count, cluster_nodebase[i]);
+      cluster.bounds = cluster_roots[i]->bounds;
+      const auto center = cluster.bounds.center();
+      for (int axis = 0; axis < 3; ++axis) {
+        cluster.centroid[axis] = center[axis];
+      }
+    }
+  });
+
+  // Top level: full sweep SAH over the cluster roots. Clusters are weighted by their primitive
+  // count since that is what the cost of the subtree below them scales with. The internal nodes
+  // of a subtree over n clusters take n - 1 consecutive slots in depth-first order.
+  struct SplitTask {
+    int begin;
+    int end;
+    Node **ptr;
+    int nodeidx;
+  };
+  std::vector<int> order(numclusters);
+  std::iota(order.begin(), order.end(), 0);
+  std::vector<int> sorted[3];
+  std::vector<float> right_areas(numclusters);
+  std::vector<SplitTask> stack;
+  stack.push_back({ 0, numclusters, &m_root, 0 });
+  while (!stack.empty()) {
+    const SplitTask task = stack.back();
+    stack.pop_back();
+
+    const int count = task.end - task.begin;
+    if (count == 1) {
+      *task.ptr = cluster_roots[order[task.begin]];
+      continue;
+    }
+
+    float best_cost = std::numeric_limits<float>::max();
+    int best_axis = 0;
+    int best_split = 1;
+    for (int axis = 0; axis < 3; ++axis) {
+      auto &axis_order = sorted[axis];
+      axis_order.assign(order.begin() + task.begin, order.begin() + task.end);
+      std::stable_sort(axis_order.begin(), axis_order.end(), [&](int a, int b) {
+        return clusters[a].centroid[axis] < clusters[b].centroid[axis];
+      });
+
+      bbox right_box;
+      int right_prims = 0;
+      for (int i = count - 1; i > 0; --i) {
+        right_box.grow(clusters[axis_order[i]].bounds);
+        right_prims += clusters[axis_order[i]].count;
+        right_areas[i] = right_box.surface_area() * right_prims;
+      }
+      bbox left_box;
+      int left_prims = 0;
+      for (int i = 1; i < count; ++i) {
+        left_box.grow(clusters[axis_order[i - 1]].bounds);
+        left_prims += clusters[axis_order[i - 1]].count;
+        const float cost = left_box.surface_area() * left_prims + right_areas[i];
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_split = i;
+        }
+      }
+    }
+
+    // Reorder the range along the best axis; sorted[] is rebuilt for every task.
+    {
+      auto &axis_order = sorted[best_axis];
+      axis_order.assign(order.begin() + task.begin, order.begin() + task.end);
+      std::stable_sort(axis_order.begin(), axis_order.end(), [&](int a, int b) {
+        return clusters[a].centroid[best_axis] < clusters[b].centroid[best_axis];
+      });
+      std::copy(axis_order.begin(), axis_order.end(), order.begin() + task.begin);
+    }
+
+    Node &node = m_nodes[task.nodeidx];
+    node.type = kInternal;
+    node.index = task.nodeidx;
+    node.bounds = bbox();
+    for (int i = task.begin; i < task.end; ++i) {
+      node.bounds.grow(clusters[order[i]].bounds);
+    }
+    *task.ptr = &node;
+
+    const int mid = task.begin + best_split;
+    stack.push_back({ mid, task.end, &node.rc, task.nodeidx + best_split });
+    stack.push_back({ task.begin, mid, &node.lc, task.nodeidx + 1 });
+  }
+
+  m_nodecnt = 2 * numbounds - 1;
+  m_packed_indices = m_indices;
+}
+
+} // namespace bvh
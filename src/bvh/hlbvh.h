@@ -0,0 +1,30 @@
+#pragma once
+
+#include <bvh/linear_bvh.h>
+
+namespace bvh {
+
+// Hierarchical LBVH builder.
+// Primitives are sorted by Morton code like in LinearBvh and grouped into clusters sharing the
+// top cluster_bits bits of their code. Clusters are emitted as radix trees in parallel, then
+// the top of the hierarchy is built over the cluster roots with a full sweep SAH, where most of
+// the trace cost of an LBVH comes from (Pantaleoni and Luebke, "HLBVH: Hierarchical LBVH
+// Construction for Real-Time Ray Tracing of Dynamic Geometry", HPG 2010).
+class HlBvh : public LinearBvh {
+ public:
+  HlBvh(
+    float traversal_cost,
+    int morton_bits,
+    int cluster_bits,
+    TaskPool &pool = TaskPool::global())
+    : LinearBvh(traversal_cost, morton_bits, pool)
+    , m_cluster_bits(cluster_bits) {}
+
+ protected:
+  void BuildImpl(bbox const *bounds, int numbounds) override;
+
+ private:
+  int m_cluster_bits;
+};
+
+} // namespace bvh
@@ -0,0 +1,157 @@
+#include <bvh/linear_bvh.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include <bvh/morton.h>
+
+namespace bvh {
+
+namespace {
+using bbox = RadeonRays::bbox;
+using float3 = RadeonRays::float3;
+} // namespace
+
+void LinearBvh::BuildImpl(bbox const *bounds, int numbounds) {
+  if (numbounds == 0) {
+    m_root = nullptr;
+    return;
+  }
+
+  const auto codes = SortByMortonCode(bounds, numbounds);
+
+  InitNodeAllocator(2 * numbounds - 1);
+  m_root = EmitRadixTree(bounds, codes.data(), 0, numbounds, 0);
+  m_nodecnt = 2 * numbounds - 1;
+  m_packed_indices = m_indices;
+}
+
+std::vector<uint64_t> LinearBvh::SortByMortonCode(bbox const *bounds, int numbounds) {
+  // Codes are computed relative to the centroid bounds to use all the available bits.
+  bbox centroid_bounds;
+  std::mutex centroid_bounds_mutex;
+  m_pool.parallelFor(0, numbounds, kParallelForGrain, [&](int begin, int end) {
+    bbox local_bounds;
+    for (int i = begin; i < end; ++i) {
+      local_bounds.grow(bounds[i].center());
+    }
+    std::lock_guard<std::mutex> lock(centroid_bounds_mutex);
+    centroid_bounds.grow(local_bounds);
+  });
+
+  std::vector<uint64_t> codes(numbounds);
+  std::vector<uint32_t> primindices(numbounds);
+  const bool use_63_bits = m_morton_bits > 30;
+  m_pool.parallelFor(0, numbounds, kParallelForGrain, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      const auto centroid = bounds[i].center();
+      codes[i] = use_63_bits ? morton_code_63(centroid, centroid_bounds) :
+                               morton_code_30(centroid, centroid_bounds);
+      primindices[i] = uint32_t(i);
+    }
+  });
+
+  radix_sort_pairs(codes, primindices, use_63_bits ? 63 : 30, m_pool);
+
+  m_indices.assign(primindices.begin(), primindices.end());
+  return codes;
+}
+
+LinearBvh::Node *LinearBvh::EmitRadixTree(
+  bbox const *bounds, uint64_t const *codes, int first, int count, int nodebase) {
+  Node *internal_nodes = &m_nodes[nodebase];
+  Node *leaf_nodes = &m_nodes[nodebase + count - 1];
+
+  for (int i = 0; i < count; ++i) {
+    Node &leaf = leaf_nodes[i];
+    leaf.type = kLeaf;
+    leaf.index = nodebase + count - 1 + i;
+    leaf.startidx = first + i;
+    leaf.numprims = 1;
+    leaf.bounds = bounds[m_indices[first + i]];
+  }
+  if (count == 1) {
+    return leaf_nodes;
+  }
+
+  // Length of the common prefix of the codes of sorted primitives i and j, -1 outside of the
+  // range. Equal codes are told apart by their position, so every prefix is unique.
+  const uint64_t *range_codes = codes + first;
+  const auto delta = [range_codes, count](int i, int j) -> int {
+    if (j < 0 || j >= count) {
+      return -1;
+    }
+    const uint64_t x = range_codes[i] ^ range_codes[j];
+    return x != 0 ? count_leading_zeros(x) : 64 + count_leading_zeros(uint64_t(i ^ j));
+  };
+
+  // Parents of the internal (first count - 1 entries) and leaf nodes, for the bottom-up pass.
+  std::vector<int> parents(2 * count - 1);
+  parents[0] = -1;
+
+  m_pool.parallelFor(0, count - 1, kParallelForGrain, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      // Direction of the range covered by node i.
+      const int d = delta(i, i + 1) - delta(i, i - 1) > 0 ? 1 : -1;
+
+      // Find the other end of the range with an exponential then a binary search.
+      const int delta_min = delta(i, i - d);
+      int lmax = 2;
+      while (delta(i, i + lmax * d) > delta_min) {
+        lmax *= 2;
+      }
+      int l = 0;
+      for (int t = lmax / 2; t >= 1; t /= 2) {
+        if (delta(i, i + (l + t) * d) > delta_min) {
+          l += t;
+        }
+      }
+      const int j = i + l * d;
+
+      // Find the split position: the last primitive sharing more than delta_node bits with i.
+      const int delta_node = delta(i, j);
+      int s = 0;
+      int t = l;
+      do {
+        t = (t + 1) / 2;
+        if (delta(i, i + (s + t) * d) > delta_node) {
+          s += t;
+        }
+      } while (t > 1);
+      const int gamma = i + s * d + std::min(d, 0);
+
+      Node &node = internal_nodes[i];
+      node.type = kInternal;
+      node.index = nodebase + i;
+      const int left = std::min(i, j) == gamma ? count - 1 + gamma : gamma;
+      const int right = std::max(i, j) == gamma + 1 ? count - 1 + gamma + 1 : gamma + 1;
+      node.lc = internal_nodes + left;
+      node.rc = internal_nodes + right;
+      parents[left] = i;
+      parents[right] = i;
+    }
+  });
+
+  // Compute the internal bounds bottom-up. The second child to arrive at a node sees both
+  // children done and continues upwards, so every node is computed exactly once.
+  std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[count - 1]);
+  for (int i = 0; i < count - 1; ++i) {
+    visits[i] = 0;
+  }
+  m_pool.parallelFor(0, count, kParallelForGrain, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      int parent = parents[count - 1 + i];
+      while (parent != -1 && visits[parent].fetch_add(1, std::memory_order_acq_rel) == 1) {
+        Node &node = internal_nodes[parent];
+        node.bounds = node.lc->bounds;
+        node.bounds.grow(node.rc->bounds);
+        parent = parents[parent];
+      }
+    }
+  });
+
+  return internal_nodes;
+}
+
+} // namespace bvh
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// RadeonRays
+#include <accelerator/bvh.h>
+
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+// Linear BVH builder (LBVH).
+// Primitives are sorted along the Morton curve of their centroids with a parallel radix sort,
+// and the hierarchy is the binary radix tree over the sorted codes, emitted in linear time with
+// every internal node computed independently (Karras, "Maximizing Parallelism in the
+// Construction of BVHs, Octrees, and k-d Trees", HPG 2012). Builds are an order of magnitude
+// faster than SAH, at the cost of trace performance. Meant for frequently rebuilt geometry.
+class LinearBvh : public RadeonRays::Bvh {
+ public:
+  // morton_bits: 30 or 63 bit Morton codes. 63 bits keep large scenes from collapsing many
+  // primitives onto the same code.
+  LinearBvh(float traversal_cost, int morton_bits, TaskPool &pool = TaskPool::global())
+    : Bvh(traversal_cost)
+    , m_pool(pool)
+    , m_morton_bits(morton_bits) {}
+
+ protected:
+  using bbox = RadeonRays::bbox;
+
+  void BuildImpl(bbox const *bounds, int numbounds) override;
+
+  // Sort the primitives along the Morton curve of their centroids: fills m_indices with the
+  // sorted primitive indices and returns their codes.
+  std::vector<uint64_t> SortByMortonCode(bbox const *bounds, int numbounds);
+
+  // Emit the radix tree over the sorted primitives [first, first + count) into
+  // m_nodes[nodebase, nodebase + 2 * count - 1) and return its root. Internal nodes are placed
+  // first, leafs reference their slot in m_indices.
+  Node *EmitRadixTree(
+    bbox const *bounds, uint64_t const *codes, int first, int count, int nodebase);
+
+  TaskPool &m_pool;
+  int m_morton_bits;
+};
+
+} // namespace bvh
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// RadeonRays
+#include <math/bbox.h>
+#include <math/float3.h>
+
+#include <bvh/task_pool.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace bvh {
+
+// Number of leading zero bits of x, 64 for x == 0.
+inline int count_leading_zeros(uint64_t x) {
+  if (x == 0) {
+    return 64;
+  }
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanReverse64(&idx, x);
+  return 63 - int(idx);
+#else
+  return __builtin_clzll(x);
+#endif
+}
+
+// Spread the lower 10 bits of x so that there are two zero bits between each of them.
+inline uint32_t morton_expand_bits_10(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+// Spread the lower 21 bits of x so that there are two zero bits between each of them.
+inline uint64_t morton_expand_bits_21(uint64_t x) {
+  x &= 0x1fffff;
+  x = (x | (x << 32)) & 0x001f00000000ffffull;
+  x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+  x = (x | (x << 8)) & 0x100f00f00f00f00full;
+  x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+  x = (x | (x << 2)) & 0x1249249249249249ull;
+  return x;
+}
+
+// Position of p inside bounds, in [0, 1]^3. Flat axes map to 0.
+inline RadeonRays::float3 morton_normalize(
+  const RadeonRays::float3 &p, const RadeonRays::bbox &bounds) {
+  const auto extents = bounds.extents();
+  RadeonRays::float3 res;
+  for (int axis = 0; axis < 3; ++axis) {
+    res[axis] = extents[axis] > 0.f ? (p[axis] - bounds.pmin[axis]) / extents[axis] : 0.f;
+  }
+  return res;
+}
+
+// 30-bit Morton code of a point inside bounds.
+inline uint32_t morton_code_30(const RadeonRays::float3 &p, const RadeonRays::bbox &bounds) {
+  const auto n = morton_normalize(p, bounds);
+  const auto quantize = [](float x) {
+    return uint32_t(std::min(std::max(x * 1024.f, 0.f), 1023.f));
+  };
+  return (morton_expand_bits_10(quantize(n.x)) << 2) |
+    (morton_expand_bits_10(quantize(n.y)) << 1) | morton_expand_bits_10(quantize(n.z));
+}
+
+// 63-bit Morton code of a point inside bounds.
+inline uint64_t morton_code_63(const RadeonRays::float3 &p, const RadeonRays::bbox &bounds) {
+  const auto n = morton_normalize(p, bounds);
+  const auto quantize = [](float x) {
+    return uint64_t(std::min(std::max(double(x) * 2097152.0, 0.0), 2097151.0));
+  };
+  return (morton_expand_bits_21(quantize(n.x)) << 2) |
+    (morton_expand_bits_21(quantize(n.y)) << 1) | morton_expand_bits_21(quantize(n.z));
+}
+
+// Stable LSD radix sort of (key, value) pairs with 8-bit digits, only sorting the lower
+// key_bits bits of the keys. Every pass histograms fixed chunks of the input in parallel and
+// scatters them in chunk order, so the result does not depend on the number of threads.
+template <typename Key>
+void radix_sort_pairs(
+  std::vector<Key> &keys,
+  std::vector<uint32_t> &values,
+  int key_bits,
+  TaskPool &pool = TaskPool::global()) {
+  constexpr int kDigitBits = 8;
+  constexpr int kNumDigits = 1 << kDigitBits;
+  constexpr int kChunkSize = 64 * 1024;
+
+  const int count = int(keys.size());
+  const int num_chunks = std::max(1, (count + kChunkSize - 1) / kChunkSize);
+  std::vector<Key> keys_tmp(count);
+  std::vector<uint32_t> values_tmp(count);
+  std::vector<uint32_t> offsets(size_t(num_chunks) * kNumDigits);
+
+  for (int shift = 0; shift < key_bits; shift += kDigitBits) {
+    const auto digit = [shift](Key key) { return uint32_t(key >> shift) & (kNumDigits - 1); };
+
+    // Per-chunk digit histograms.
+    pool.parallelFor(0, num_chunks, 1, [&](int chunk_begin, int chunk_end) {
+      for (int chunk = chunk_begin; chunk < chunk_end; ++chunk) {
+        uint32_t *histogram = &offsets[size_t(chunk) * kNumDigits];
+        std::fill(histogram, histogram + kNumDigits, 0);
+        const int end = std::min(count, (chunk + 1) * kChunkSize);
+        for (int i = chunk * kChunkSize; i < end; ++i) {
+          ++histogram[digit(keys[i])];
+        }
+      }
+    });
+
+    // Exclusive scan in (digit, chunk) order turns the histograms into scatter offsets.
+    uint32_t sum = 0;
+    for (int d = 0; d < kNumDigits; ++d) {
+      for (int chunk = 0; chunk < num_chunks; ++chunk) {
+        auto &offset = offsets[size_t(chunk) * kNumDigits + d];
+        const uint32_t chunk_count = offset;
+        offset = sum;
+        sum += chunk_count;
+      }
+    }
+
+    pool.parallelFor(0, num_chunks, 1, [&](int chunk_begin, int chunk_end) {
+      for (int chunk = chunk_begin; chunk < chunk_end; ++chunk) {
+        uint32_t *offset = &offsets[size_t(chunk) * kNumDigits];
+        const int end = std::min(count, (chunk + 1) * kChunkSize);
+        for (int i = chunk * kChunkSize; i < end; ++i) {
+          const uint32_t dst = offset[digit(keys[i])]++;
+          keys_tmp[dst] = keys[i];
+          values_tmp[dst] = values[i];
+        }
+      }
+    });
+
+    keys.swap(keys_tmp);
+    values.swap(values_tmp);
+  }
+}
+
+} // namespace bvh
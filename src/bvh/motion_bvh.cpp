@@ -0,0 +1,52 @@
+#include <bvh/motion_bvh.h>
+
+#include <chrono>
+
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+std::vector<bbox> build_motion_bvh(
+  gsl::span<const bbox> leaf_bounds,
+  int num_time_steps,
+  const BvhOptions &options,
+  BuildContext &context,
+  BvhStats *out_stats) {
+  const auto start_time = std::chrono::steady_clock::now();
+  num_time_steps = std::max(num_time_steps, 1);
+  const int numleafs = int(leaf_bounds.size()) / num_time_steps;
+  const auto get_step = [&](int step) {
+    return leaf_bounds.subspan(std::ptrdiff_t(step) * numleafs, numleafs);
+  };
+
+  // Bounds in the middle of the interval, between the middle time steps for even counts.
+  std::vector<bbox> mid_bounds(numleafs);
+  const auto mid0 = get_step((num_time_steps - 1) / 2);
+  const auto mid1 = get_step(num_time_steps / 2);
+  TaskPool::global().parallelFor(0, numleafs, kParallelForGrain, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      mid_bounds[i].pmin = (mid0[i].pmin + mid1[i].pmin) * 0.5f;
+      mid_bounds[i].pmax = (mid0[i].pmax + mid1[i].pmax) * 0.5f;
+    }
+  });
+  const auto built = build_bvh(mid_bounds, options, context, out_stats);
+  const int numnodes = int(built.size());
+
+  std::vector<bbox> res(size_t(numnodes) * num_time_steps);
+  std::vector<bbox> step_nodes(built.begin(), built.end());
+  for (int step = 0; step < num_time_steps; ++step) {
+    refit_bvh(step_nodes, get_step(step), context.getPrimitiveOrder());
+    for (int i = 0; i < numnodes; ++i) {
+      res[size_t(i) * num_time_steps + step] = step_nodes[i];
+    }
+  }
+
+  if (out_stats) {
+    const auto end_time = std::chrono::steady_clock::now();
+    out_stats->build_time_ms =
+      std::chrono::duration<double, std::milli>(end_time - start_time).count();
+  }
+  return res;
+}
+
+} // namespace bvh
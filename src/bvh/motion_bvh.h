@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <gsl/span>
+
+#include <bvh/bvh_builder.h>
+
+namespace bvh {
+
+// Skip-links BVH of moving geometry, whose nodes hold their bounds at num_time_steps times
+// spread evenly over the shutter interval, 2 for its open and close. Traversals interpolate the
+// bounds linearly to the time of the ray (d.w in bvh.glslh, see BVH_MOTION_STEPS), so that rays
+// at any time see tight bounds, without a build per time or bounds swept over the interval.
+// Primitives are expected to move linearly between the time steps. Bounds interpolated that way
+// then contain them, as do those of the nodes, which are interpolated like their children.
+// The tree is built once over the bounds at the middle of the interval, and refitted to the
+// other times, so it degrades like a refitted tree as the primitives move apart.
+// Node i at time step s is nodes[i * num_time_steps + s]. Payloads and skip links count nodes,
+// not time steps, and are repeated at every step.
+
+// Build a motion BVH over leaf_bounds, num_time_steps arrays of the leaf bounds one after the
+// other, with the build_bvh options. Leafs holding ranges index context.getPrimitiveOrder(). The
+// stats are the ones of the tree in the middle of the interval, including the refits in the
+// build time.
+std::vector<bbox> build_motion_bvh(
+  gsl::span<const bbox> leaf_bounds,
+  int num_time_steps,
+  const BvhOptions &options,
+  BuildContext &context,
+  BvhStats *out_stats = nullptr);
+
+// Bounds of a node at time, from 0 at the first time step to 1 at the last one. The payload and
+// the skip link stay in w.
+inline bbox motion_node_bounds(
+  gsl::span<const bbox> nodes, int num_time_steps, int node, float time) {
+  if (num_time_steps < 2) {
+    return nodes[node];
+  }
+  const float steps = std::min(std::max(time, 0.f), 1.f) * float(num_time_steps - 1);
+  const int step = std::min(int(steps), num_time_steps - 2);
+  const float weight = steps - float(step);
+  const bbox &b0 = nodes[node * num_time_steps + step];
+  const bbox &b1 = nodes[node * num_time_steps + step + 1];
+  // As mix() in bvh.glslh. Unlike b0 + (b1 - b0) * weight, this rounds monotonically in b0 and
+  // b1, so that interpolated nodes still contain their interpolated children.
+  const float keep = 1.f - weight;
+  bbox res = b0;
+  for (int axis = 0; axis < 3; ++axis) {
+    res.pmin[axis] = b0.pmin[axis] * keep + b1.pmin[axis] * weight;
+    res.pmax[axis] = b0.pmax[axis] * keep + b1.pmax[axis] * weight;
+  }
+  return res;
+}
+
+} // namespace bvh
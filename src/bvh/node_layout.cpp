@@ -0,0 +1,100 @@
+#include <bvh/node_layout.h>
+
+#include <algorithm>
+#include <cstdint>
+
+namespace bvh {
+
+namespace {
+// Subtrees of up to 8 leafs stay in depth-first order, which pairs the nodes of their cache lines
+// best.
+constexpr int kDepthFirstSubtreeSize = 15;
+} // namespace
+
+void reorder_bvh(gsl::span<bbox> nodes, int block_size) {
+  BuildArena arena;
+  reorder_bvh(nodes, block_size, arena);
+}
+
+void reorder_bvh(gsl::span<bbox> nodes, int block_size, BuildArena &arena) {
+  const int num_nodes = int(nodes.size());
+  if (num_nodes == 0 || block_size < 1) {
+    return;
+  }
+  auto old_nodes = arena.allocate<bbox>(num_nodes);
+  std::copy(nodes.begin(), nodes.end(), old_nodes.begin());
+  auto new_index = arena.allocate<int>(num_nodes);
+
+  // Children come after their parent, so subtree sizes are known bottom-up.
+  auto subtree_sizes = arena.allocate<int>(num_nodes);
+  for (int i = num_nodes - 1; i >= 0; --i) {
+    subtree_sizes[i] = 1;
+    if (!is_leaf_node(old_nodes[i])) {
+      const int second = decode_index(old_nodes[i + 1].pmax.w);
+      subtree_sizes[i] += subtree_sizes[i + 1] + subtree_sizes[second];
+    }
+  }
+
+  // Heads of first-child chains: the root and the second children. The candidates of the
+  // current block form a max-heap by surface area, the roots of later blocks a stack. Small
+  // subtrees go depth-first right after the chain they branch off, where skip links lead after a
+  // leaf, instead of competing for the block.
+  struct Candidate {
+    float area;
+    int node;
+    bool operator<(const Candidate &other) const { return area < other.area; }
+  };
+  auto heap = arena.allocate<Candidate>(num_nodes);
+  auto block_roots = arena.allocate<int>(num_nodes);
+  auto small_subtrees = arena.allocate<int>(num_nodes);
+  int heap_size = 0;
+  int num_block_roots = 0;
+  int num_small_subtrees = 0;
+  block_roots[num_block_roots++] = 0;
+
+  int nodecnt = 0;
+  while (num_block_roots > 0) {
+    const int root = block_roots[--num_block_roots];
+    const int block_end = (nodecnt / block_size + 1) * block_size;
+    heap[heap_size++] = { old_nodes[root].surface_area(), root };
+    while (heap_size > 0 && nodecnt < block_end) {
+      std::pop_heap(heap.begin(), heap.begin() + heap_size);
+      int node = heap[--heap_size].node;
+      while (true) {
+        new_index[node] = nodecnt++;
+        if (is_leaf_node(old_nodes[node])) {
+          if (num_small_subtrees == 0) {
+            break;
+          }
+          node = small_subtrees[--num_small_subtrees];
+          continue;
+        }
+        const int second = decode_index(old_nodes[node + 1].pmax.w);
+        if (subtree_sizes[second] <= kDepthFirstSubtreeSize) {
+          small_subtrees[num_small_subtrees++] = second;
+        } else {
+          heap[heap_size++] = { old_nodes[second].surface_area(), second };
+          std::push_heap(heap.begin(), heap.begin() + heap_size);
+        }
+        ++node;
+      }
+    }
+
+    // The rest of the treelet frontier starts new blocks, the largest subtree first.
+    std::sort_heap(heap.begin(), heap.begin() + heap_size);
+    for (int i = 0; i < heap_size; ++i) {
+      block_roots[num_block_roots++] = heap[i].node;
+    }
+    heap_size = 0;
+  }
+
+  // The tree is the same, so the skip links only need renumbering.
+  for (int i = 0; i < num_nodes; ++i) {
+    bbox node = old_nodes[i];
+    const int next = decode_index(node.pmax.w);
+    node.pmax.w = encode_index(next == -1 ? kInvalidIndex : uint32_t(new_index[next]));
+    nodes[new_index[i]] = node;
+  }
+}
+
+} // namespace bvh
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <gsl/span>
+
+#include <bvh/build_arena.h>
+#include <bvh/bvh_builder.h>
+
+namespace bvh {
+
+// Nodes of a 4 KB page.
+constexpr int kPageBlockSize = 4096 / sizeof(bbox);
+
+// Cache-aware layout of a skip-links BVH, in the spirit of Yoon and Manocha, "Cache-Efficient
+// Layouts of Bounding Volume Hierarchies", Eurographics 2006.
+// Depth-first order keeps small subtrees together, but spreads the top of the tree over the
+// whole array. This pass packs the nodes into blocks of block_size nodes, each holding a treelet
+// grown from its root by the nodes most likely to be hit (the largest surface area) first. The
+// subtrees left over are the roots of the next blocks, visited depth-first.
+// The first child of an internal node has to follow it, so treelets grow by whole first-child
+// chains, which can run into the next block. Small subtrees stay depth-first, which already
+// pairs the nodes of a cache line well. Children keep their order, so traversals visit the same
+// nodes, and they still come after their parent, which refit_bvh relies on.
+// With page-sized blocks, random rays touch 10 to 25% fewer pages, and so take fewer TLB misses,
+// and about as many cache lines as in depth-first order (see node_layout_benchmark).
+void reorder_bvh(gsl::span<bbox> nodes, int block_size = kPageBlockSize);
+// Same, with scratch memory from arena.
+void reorder_bvh(gsl::span<bbox> nodes, int block_size, BuildArena &arena);
+
+} // namespace bvh
@@ -0,0 +1,438 @@
+#include <bvh/parallel_bvh.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+
+namespace bvh {
+
+namespace {
+using bbox = RadeonRays::bbox;
+using float3 = RadeonRays::float3;
+
+// Below these sizes the overhead of a task outweighs the work it would offload.
+constexpr int kMinParallelSubtreePrims = 4 * 1024;
+constexpr int kMinParallelBinningPrims = 64 * 1024;
+constexpr int kBinningGrain = 16 * 1024;
+constexpr int kMaxStackBins = 64;
+
+struct Bin {
+  bbox bounds;
+  int count = 0;
+};
+
+// Bins of the three axes, on the stack for the usual bin counts so that splitting a node does
+// not allocate.
+class BinStorage {
+ public:
+  explicit BinStorage(int num_bins) {
+    if (num_bins > kMaxStackBins) {
+      m_heap_bins.resize(3 * num_bins);
+      m_bins = m_heap_bins.data();
+    }
+  }
+  Bin &operator[](int idx) { return m_bins[idx]; }
+
+ private:
+  Bin m_stack_bins[3 * kMaxStackBins];
+  std::vector<Bin> m_heap_bins;
+  Bin *m_bins = m_stack_bins;
+};
+
+void atomic_max(std::atomic<int> &value, int x) {
+  int prev = value.load(std::memory_order_relaxed);
+  while (prev < x && !value.compare_exchange_weak(prev, x, std::memory_order_relaxed)) {
+  }
+}
+
+// Partition [startidx, startidx + numprims) by centroid along axis, exactly like
+// RadeonRays::Bvh::BuildNode does, growing the child bounds along the way.
+// Returns the index of the first primitive of the right child.
+int partition_prims(
+  int startidx,
+  int numprims,
+  int axis,
+  float border,
+  bbox const *bounds,
+  float3 const *centroids,
+  int *primindices,
+  bbox &leftbounds,
+  bbox &leftcentroid_bounds,
+  bbox &rightbounds,
+  bbox &rightcentroid_bounds) {
+  // RadeonRays alternates the side the scan starts from; keep it to produce the same order.
+  const bool near2far = (numprims + startidx) & 0x1;
+  const auto goes_left = [&](int idx) {
+    const float c = centroids[primindices[idx]][axis];
+    return near2far ? c < border : c >= border;
+  };
+  const auto grow_left = [&](int idx) {
+    leftbounds.grow(bounds[primindices[idx]]);
+    leftcentroid_bounds.grow(centroids[primindices[idx]]);
+  };
+  const auto grow_right = [&](int idx) {
+    rightbounds.grow(bounds[primindices[idx]]);
+    rightcentroid_bounds.grow(centroids[primindices[idx]]);
+  };
+
+  int first = startidx;
+  int last = startidx + numprims;
+  while (true) {
+    while (first != last && goes_left(first)) {
+      grow_left(first);
+      ++first;
+    }
+    if (first == last--) {
+      break;
+    }
+    grow_right(first);
+    while (first != last && !goes_left(last)) {
+      grow_right(last);
+      --last;
+    }
+    if (first == last) {
+      break;
+    }
+    grow_left(last);
+    std::swap(primindices[first++], primindices[last]);
+  }
+  return first;
+}
+
+// Remove the slots left unused by multi-primitive leafs. Nodes keep their depth-first order, so
+// every skip link just moves to the new position of its target. Returns the node count.
+int compact_skip_links(bbox *nodes, int num_slots, BuildArena &arena) {
+  const auto slot_size = [nodes](int slot) {
+    return is_leaf_node(nodes[slot]) ? 2 * leaf_range_count(nodes[slot].pmin.w) - 1 : 1;
+  };
+
+  auto newidx = arena.allocate<int>(num_slots);
+  int numnodes = 0;
+  for (int slot = 0; slot < num_slots; slot += slot_size(slot)) {
+    newidx[slot] = numnodes++;
+  }
+  for (int slot = 0; slot < num_slots; slot += slot_size(slot)) {
+    bbox &node = nodes[newidx[slot]];
+    node = nodes[slot];
+    const int skipidx = decode_index(node.pmax.w);
+    node.pmax.w = encode_index(skipidx != -1 ? uint32_t(newidx[skipidx]) : kInvalidIndex);
+  }
+  return numnodes;
+}
+} // namespace
+
+void ParallelBvh::BuildImpl(bbox const *bounds, int numbounds) {
+  if (numbounds == 0) {
+    m_root = nullptr;
+    return;
+  }
+
+  InitNodeAllocator(2 * numbounds - 1);
+
+  m_indices.resize(numbounds);
+  std::vector<float3> centroids(numbounds);
+  const bbox centroid_bounds =
+    ComputeCentroids(bounds, numbounds, centroids.data(), m_indices.data());
+
+  TaskPool::TaskGroup group;
+  BuildInput input = {
+    bounds, centroids.data(), m_indices.data(), nullptr, 2 * numbounds - 1, 1, &group, { 0 }
+  };
+  SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1 };
+  BuildSubtree(input, init, 0, m_stack);
+  m_pool.wait(group);
+
+  // Every leaf references its own slot of the partitioned index array.
+  m_packed_indices = m_indices;
+  m_nodecnt = 2 * numbounds - 1;
+  m_height = input.height.load();
+  m_root = &m_nodes[0];
+}
+
+int ParallelBvh::BuildSkipLinks(
+  bbox const *bounds,
+  int numbounds,
+  bbox *out_nodes,
+  BuildArena &arena,
+  int max_leaf_size,
+  int *out_primitive_order) {
+  m_root = nullptr;
+  m_nodes.clear();
+  m_indices.clear();
+  m_packed_indices.clear();
+  m_nodecnt = 0;
+  m_height = 0;
+  if (numbounds == 0) {
+    return 0;
+  }
+
+  // Bvh::Build is bypassed, compute the root bounds it would have.
+  std::mutex bounds_mutex;
+  m_bounds = bbox();
+  m_pool.parallelFor(0, numbounds, kBinningGrain, [&](int begin, int end) {
+    bbox local_bounds;
+    for (int i = begin; i < end; ++i) {
+      local_bounds.grow(bounds[i]);
+    }
+    std::lock_guard<std::mutex> lock(bounds_mutex);
+    m_bounds.grow(local_bounds);
+  });
+
+  auto centroids = arena.allocate<float3>(numbounds);
+  int *primindices =
+    out_primitive_order ? out_primitive_order : arena.allocate<int>(numbounds).data();
+  const bbox centroid_bounds = ComputeCentroids(bounds, numbounds, centroids.data(), primindices);
+
+  max_leaf_size = std::min(std::max(max_leaf_size, 1), kMaxLeafSize);
+  TaskPool::TaskGroup group;
+  BuildInput input = { bounds,        centroids.data(), primindices, out_nodes,
+                       2 * numbounds - 1, max_leaf_size, &group,     { 0 } };
+  SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1 };
+  BuildSubtree(input, init, 0, m_stack);
+  m_pool.wait(group);
+
+  m_height = input.height.load();
+  return max_leaf_size > 1 ? compact_skip_links(out_nodes, 2 * numbounds - 1, arena) :
+                             2 * numbounds - 1;
+}
+
+bbox ParallelBvh::ComputeCentroids(
+  bbox const *bounds, int numbounds, float3 *centroids, int *primindices) {
+  bbox centroid_bounds;
+  std::mutex centroid_bounds_mutex;
+  m_pool.parallelFor(0, numbounds, kBinningGrain, [&](int begin, int end) {
+    bbox local_bounds;
+    for (int i = begin; i < end; ++i) {
+      primindices[i] = i;
+      centroids[i] = bounds[i].center();
+      local_bounds.grow(centroids[i]);
+    }
+    std::lock_guard<std::mutex> lock(centroid_bounds_mutex);
+    centroid_bounds.grow(local_bounds);
+  });
+  return centroid_bounds;
+}
+
+void ParallelBvh::BuildSubtree(
+  BuildInput &input,
+  SplitRequest const &root_req,
+  int root_nodeidx,
+  std::vector<StackEntry> &stack) {
+  stack.clear();
+  stack.push_back({ root_req, root_nodeidx });
+
+  while (!stack.empty()) {
+    const SplitRequest req = stack.back().req;
+    const int nodeidx = stack.back().nodeidx;
+    stack.pop_back();
+
+    atomic_max(input.height, req.level);
+
+    // Single primitive leafs, see the class comment. Larger ones only where splitting does not
+    // pay off, with the SAH cost of RadeonRays relative to a unit intersection cost. Equal
+    // centroids can not be split by SAH at all.
+    bool is_leaf = req.numprims < 2;
+    SahSplit ss;
+    if (!is_leaf) {
+      ss = FindSahSplitParallel(input, req);
+      is_leaf = req.numprims <= input.max_leaf_size &&
+        (std::isnan(ss.split) || float(req.numprims) <= ss.sah);
+    }
+
+    if (input.skip_nodes) {
+      // The subtree takes at most the next 2 * numprims - 1 slots, the skip link points right
+      // after them. Multi-primitive leafs leave slots unused, compact_skip_links removes them.
+      // Leaf ranges are final: only the partitions of their ancestors moved them.
+      const int nextidx = nodeidx + 2 * req.numprims - 1;
+      bbox &node = input.skip_nodes[nodeidx];
+      node = req.bounds;
+      if (!is_leaf) {
+        node.pmin.w = encode_index(kInvalidIndex);
+      } else if (input.max_leaf_size > 1) {
+        node.pmin.w = pack_leaf_range(req.startidx, req.numprims);
+      } else {
+        node.pmin.w = encode_index(uint32_t(input.primindices[req.startidx]));
+      }
+      node.pmax.w = encode_index(nextidx < input.num_nodes ? uint32_t(nextidx) : kInvalidIndex);
+    } else {
+      Node &node = m_nodes[nodeidx];
+      node.bounds = req.bounds;
+      node.index = req.index;
+      if (is_leaf) {
+        node.type = kLeaf;
+        node.startidx = req.startidx;
+        node.numprims = req.numprims;
+      }
+    }
+
+    if (is_leaf) {
+      continue;
+    }
+
+    // Choose the maximum extent, unless SAH finds a better split.
+    int axis = req.centroid_bounds.maxdim();
+    float border = req.centroid_bounds.center()[axis];
+    if (!std::isnan(ss.split)) {
+      axis = ss.dim;
+      border = ss.split;
+    }
+
+    bbox leftbounds, rightbounds, leftcentroid_bounds, rightcentroid_bounds;
+    int splitidx = req.startidx;
+    if (req.centroid_bounds.extents()[axis] > 0.f) {
+      splitidx = partition_prims(
+        req.startidx, req.numprims, axis, border, input.bounds, input.centroids,
+        input.primindices, leftbounds, leftcentroid_bounds, rightbounds, rightcentroid_bounds);
+    }
+
+    // Fall back to a median split if all the centroids ended up on the same side. The bounds
+    // grown by the partition are kept, as RadeonRays does.
+    if (splitidx == req.startidx || splitidx == req.startidx + req.numprims) {
+      splitidx = req.startidx + (req.numprims >> 1);
+      for (int i = req.startidx; i < splitidx; ++i) {
+        leftbounds.grow(input.bounds[input.primindices[i]]);
+        leftcentroid_bounds.grow(input.centroids[input.primindices[i]]);
+      }
+      for (int i = splitidx; i < req.startidx + req.numprims; ++i) {
+        rightbounds.grow(input.bounds[input.primindices[i]]);
+        rightcentroid_bounds.grow(input.centroids[input.primindices[i]]);
+      }
+    }
+
+    const int numleft = splitidx - req.startidx;
+    const int leftidx = nodeidx + 1;
+    const int rightidx = nodeidx + 2 * numleft;
+    if (!input.skip_nodes) {
+      Node &node = m_nodes[nodeidx];
+      node.type = kInternal;
+      node.lc = &m_nodes[leftidx];
+      node.rc = &m_nodes[rightidx];
+    }
+
+    const SplitRequest leftrequest = { req.startidx,     numleft,   nullptr,         leftbounds,
+                                       leftcentroid_bounds, req.level + 1, req.index << 1 };
+    const SplitRequest rightrequest = { splitidx,
+                                        req.numprims - numleft,
+                                        nullptr,
+                                        rightbounds,
+                                        rightcentroid_bounds,
+                                        req.level + 1,
+                                        (req.index << 1) + 1 };
+
+    if (rightrequest.numprims >= kMinParallelSubtreePrims && m_pool.getThreadCount() > 1) {
+      m_pool.run(*input.group, [this, &input, rightrequest, rightidx] {
+        std::vector<StackEntry> stack;
+        BuildSubtree(input, rightrequest, rightidx, stack);
+      });
+    } else {
+      stack.push_back({ rightrequest, rightidx });
+    }
+    stack.push_back({ leftrequest, leftidx });
+  }
+}
+
+ParallelBvh::SahSplit ParallelBvh::FindSahSplitParallel(
+  BuildInput &input, SplitRequest const &req) const {
+  SahSplit split;
+  split.dim = 0;
+  split.split = std::numeric_limits<float>::quiet_NaN();
+
+  const float3 centroid_extents = req.centroid_bounds.extents();
+  if (centroid_extents.sqnorm() == 0.f) {
+    return split;
+  }
+
+  const int num_bins = m_num_bins;
+  const float3 rootmin = req.centroid_bounds.pmin;
+  float3 invcentroid_rng;
+  for (int axis = 0; axis < 3; ++axis) {
+    invcentroid_rng[axis] = centroid_extents[axis] == 0.f ? 0.f : 1.f / centroid_extents[axis];
+  }
+
+  // Bin all three axes in one sweep over the primitives. Bins only accumulate counts and
+  // min/max bounds, so the merged result does not depend on how the range was chunked.
+  BinStorage bins(num_bins);
+  const auto bin_range = [&](int begin, int end, BinStorage &out_bins) {
+    for (int i = begin; i < end; ++i) {
+      const int idx = input.primindices[i];
+      const float3 &centroid = input.centroids[idx];
+      for (int axis = 0; axis < 3; ++axis) {
+        if (centroid_extents[axis] == 0.f) {
+          continue;
+        }
+        const int binidx = (int)std::min<float>(
+          static_cast<float>(num_bins) * ((centroid[axis] - rootmin[axis]) * invcentroid_rng[axis]),
+          static_cast<float>(num_bins - 1));
+        auto &bin = out_bins[axis * num_bins + binidx];
+        ++bin.count;
+        bin.bounds.grow(input.bounds[idx]);
+      }
+    }
+  };
+
+  const int begin = req.startidx;
+  const int end = req.startidx + req.numprims;
+  if (req.numprims < kMinParallelBinningPrims) {
+    bin_range(begin, end, bins);
+  } else {
+    std::mutex bins_mutex;
+    m_pool.parallelFor(begin, end, kBinningGrain, [&](int chunk_begin, int chunk_end) {
+      BinStorage local_bins(num_bins);
+      bin_range(chunk_begin, chunk_end, local_bins);
+      std::lock_guard<std::mutex> lock(bins_mutex);
+      for (int i = 0; i < 3 * num_bins; ++i) {
+        bins[i].count += local_bins[i].count;
+        bins[i].bounds.grow(local_bins[i].bounds);
+      }
+    });
+  }
+
+  // Sweep the bins and evaluate SAH with the same arithmetic as Bvh::FindSahSplit.
+  const float invarea = 1.f / req.bounds.surface_area();
+  float sah = std::numeric_limits<float>::max();
+  int splitidx = -1;
+  // Suffix bounds of the bins, also on the stack for the usual bin counts.
+  bbox stack_rightbounds[kMaxStackBins];
+  std::vector<bbox> heap_rightbounds(num_bins > kMaxStackBins ? num_bins - 1 : 0);
+  bbox *rightbounds = num_bins > kMaxStackBins ? heap_rightbounds.data() : stack_rightbounds;
+  for (int axis = 0; axis < 3; ++axis) {
+    if (centroid_extents[axis] == 0.f) {
+      continue;
+    }
+    const Bin *axis_bins = &bins[axis * num_bins];
+
+    bbox rightbox;
+    for (int i = num_bins - 1; i > 0; --i) {
+      rightbox.grow(axis_bins[i].bounds);
+      rightbounds[i - 1] = rightbox;
+    }
+
+    bbox leftbox;
+    int leftcount = 0;
+    int rightcount = req.numprims;
+    for (int i = 0; i < num_bins - 1; ++i) {
+      leftbox.grow(axis_bins[i].bounds);
+      leftcount += axis_bins[i].count;
+      rightcount -= axis_bins[i].count;
+
+      const float sahtmp = m_traversal_cost +
+        (leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area()) * invarea;
+      if (sahtmp < sah) {
+        split.dim = axis;
+        splitidx = i;
+        split.sah = sah = sahtmp;
+      }
+    }
+  }
+
+  if (splitidx != -1) {
+    split.split = rootmin[split.dim] + (splitidx + 1) * (centroid_extents[split.dim] / num_bins);
+  }
+  return split;
+}
+
+} // namespace bvh
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+// RadeonRays
+#include <accelerator/bvh.h>
+
+#include <bvh/build_arena.h>
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+// Binned SAH builder that produces exactly the tree of RadeonRays::Bvh with SAH enabled, with the
+// per-node binning and the subtree recursion spread over the work-stealing TaskPool.
+//
+// Leafs hold a single primitive like in RadeonRays, so a subtree over n primitives always takes
+// 2n - 1 nodes. Each split can therefore place its children in m_nodes in depth-first order
+// without synchronizing with other tasks, and the node array is the same for any thread count.
+// The depth-first slots are also the final positions in the skip-links representation, which
+// BuildSkipLinks writes directly.
+class ParallelBvh : public RadeonRays::Bvh {
+ public:
+  ParallelBvh(float traversal_cost, int num_bins, TaskPool &pool = TaskPool::global())
+    : Bvh(traversal_cost, num_bins, true)
+    , m_pool(pool) {}
+
+  // Build the same tree straight into the skip-links node array of bvh_builder.h, out_nodes
+  // holding 2 * numbounds - 1 entries: every node is written once with its skip link and
+  // payload, no Node tree is allocated and nothing needs translating. The Node tree accessors
+  // are empty afterwards. The scratch memory comes from arena, and rebuilding with the same
+  // ParallelBvh does not allocate on a single thread.
+  // With max_leaf_size > 1, nodes of up to that many primitives become leafs where the SAH cost
+  // of splitting them is higher, and leafs hold ranges of out_primitive_order (numbounds
+  // entries) packed by pack_leaf_range. Returns the number of nodes.
+  int BuildSkipLinks(
+    RadeonRays::bbox const *bounds,
+    int numbounds,
+    RadeonRays::bbox *out_nodes,
+    BuildArena &arena,
+    int max_leaf_size = 1,
+    int *out_primitive_order = nullptr);
+
+ protected:
+  void BuildImpl(RadeonRays::bbox const *bounds, int numbounds) override;
+
+ private:
+  using bbox = RadeonRays::bbox;
+  using float3 = RadeonRays::float3;
+
+  struct BuildInput {
+    bbox const *bounds;
+    float3 const *centroids;
+    int *primindices;
+    // Skip-links output of BuildSkipLinks, m_nodes is written otherwise.
+    bbox *skip_nodes;
+    int num_nodes;
+    int max_leaf_size;
+    TaskPool::TaskGroup *group;
+    std::atomic<int> height;
+  };
+
+  struct StackEntry {
+    SplitRequest req;
+    int nodeidx;
+  };
+
+  // Centroids of the primitives and their bounds; resets primindices to the identity.
+  bbox ComputeCentroids(bbox const *bounds, int numbounds, float3 *centroids, int *primindices);
+
+  // Build the subtree of req into m_nodes starting at nodeidx. Large right subtrees are handed
+  // to the pool, the rest is processed with an explicit stack so deep trees do not recurse.
+  void BuildSubtree(
+    BuildInput &input, SplitRequest const &req, int nodeidx, std::vector<StackEntry> &stack);
+  // Same result as Bvh::FindSahSplit, with the primitives binned in parallel for large nodes.
+  SahSplit FindSahSplitParallel(BuildInput &input, SplitRequest const &req) const;
+
+  TaskPool &m_pool;
+  // Stack of the calling thread, kept across builds.
+  std::vector<StackEntry> m_stack;
+};
+
+} // namespace bvh
@@ -0,0 +1,422 @@
+#include <bvh/parallel_split_bvh.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+
+namespace bvh {
+
+namespace {
+using bbox = RadeonRays::bbox;
+using float3 = RadeonRays::float3;
+
+// Below these sizes the overhead of a task outweighs the work it would offload.
+constexpr int kMinParallelSubtreeRefs = 4 * 1024;
+constexpr int kMinParallelBinningRefs = 64 * 1024;
+constexpr int kBinningGrain = 16 * 1024;
+
+struct ObjectBin {
+  bbox bounds;
+  int count = 0;
+};
+
+struct SpatialBin {
+  bbox bounds;
+  int entries = 0;
+  int exits = 0;
+};
+
+void atomic_max(std::atomic<int> &value, int x) {
+  int prev = value.load(std::memory_order_relaxed);
+  while (prev < x && !value.compare_exchange_weak(prev, x, std::memory_order_relaxed)) {
+  }
+}
+
+float overlap_area(bbox const &a, bbox const &b) {
+  float3 extents;
+  for (int axis = 0; axis < 3; ++axis) {
+    const float overlap =
+      std::min(a.pmax[axis], b.pmax[axis]) - std::max(a.pmin[axis], b.pmin[axis]);
+    extents[axis] = std::max(overlap, 0.f);
+  }
+  return 2.f * (extents.x * extents.y + extents.x * extents.z + extents.y * extents.z);
+}
+
+// Maps coordinates along one axis of a box to num_bins equal bins.
+struct Binner {
+  Binner(float min, float extent, int num_bins)
+    : min(min)
+    , extent(extent)
+    , scale(extent > 0.f ? num_bins / extent : 0.f)
+    , num_bins(num_bins) {}
+
+  int bin(float x) const { return std::min(std::max(int((x - min) * scale), 0), num_bins - 1); }
+  // Lower plane of bin i; the upper plane of the last bin is the end of the box exactly.
+  float plane(int i) const { return i == num_bins ? min + extent : min + i * (extent / num_bins); }
+
+  float min;
+  float extent;
+  float scale;
+  int num_bins;
+};
+} // namespace
+
+void ParallelSplitBvh::BuildImpl(bbox const *bounds, int numbounds) {
+  if (numbounds == 0) {
+    m_root = nullptr;
+    return;
+  }
+
+  const int budget = std::max(int(numbounds * m_extra_node_budget), 0);
+  const int capacity = numbounds + budget;
+  InitNodeAllocator(2 * capacity - 1);
+
+  BuildInput input;
+  input.refs.resize(capacity);
+  input.root_area = m_bounds.surface_area();
+  input.height = 0;
+
+  bbox centroid_bounds;
+  std::mutex centroid_bounds_mutex;
+  m_pool.parallelFor(0, numbounds, kBinningGrain, [&](int begin, int end) {
+    bbox local_bounds;
+    for (int i = begin; i < end; ++i) {
+      input.refs[i] = { bounds[i], i };
+      local_bounds.grow(bounds[i].center());
+    }
+    std::lock_guard<std::mutex> lock(centroid_bounds_mutex);
+    centroid_bounds.grow(local_bounds);
+  });
+
+  TaskPool::TaskGroup group;
+  input.group = &group;
+  BuildSubtree(input, { 0, numbounds, budget, 0, m_bounds, centroid_bounds, 0 });
+  m_pool.wait(group);
+
+  // Subtrees that did not use up their budget leave gaps in the reference array. Pack the leaf
+  // references in depth-first order, which is also the order of the translated nodes.
+  m_packed_indices.clear();
+  int nodecnt = 0;
+  std::vector<Node *> stack = { &m_nodes[0] };
+  while (!stack.empty()) {
+    Node *node = stack.back();
+    stack.pop_back();
+    ++nodecnt;
+    if (node->type == kLeaf) {
+      const int startidx = int(m_packed_indices.size());
+      for (int i = 0; i < node->numprims; ++i) {
+        m_packed_indices.push_back(input.refs[node->startidx + i].primidx);
+      }
+      node->startidx = startidx;
+    } else {
+      stack.push_back(node->rc);
+      stack.push_back(node->lc);
+    }
+  }
+  m_indices = m_packed_indices;
+  m_nodecnt = nodecnt;
+  m_height = input.height.load();
+  m_root = &m_nodes[0];
+}
+
+void ParallelSplitBvh::BuildSubtree(BuildInput &input, Request const &root_req) {
+  std::vector<Request> stack = { root_req };
+  while (!stack.empty()) {
+    const Request req = stack.back();
+    stack.pop_back();
+
+    atomic_max(input.height, req.level);
+
+    Node &node = m_nodes[req.nodeidx];
+    node.bounds = req.bounds;
+    node.index = req.nodeidx;
+
+    if (req.numrefs < 2) {
+      node.type = kLeaf;
+      node.startidx = req.refidx;
+      node.numprims = req.numrefs;
+      continue;
+    }
+
+    // Spatial splits are only tried where the children of the best object split overlap
+    // significantly, relative to the whole scene.
+    Split split = FindObjectSplit(input, req);
+    const bool try_spatial = req.level < m_max_split_depth && req.budget > 0 &&
+      split.overlap > m_min_overlap * input.root_area;
+    if (try_spatial) {
+      const Split spatial = FindSpatialSplit(input, req);
+      if (spatial.sah < split.sah) {
+        split = spatial;
+      }
+    }
+
+    Request left, right;
+    PerformSplit(input, req, split, left, right);
+
+    node.type = kInternal;
+    node.lc = &m_nodes[left.nodeidx];
+    node.rc = &m_nodes[right.nodeidx];
+
+    if (right.numrefs >= kMinParallelSubtreeRefs && m_pool.getThreadCount() > 1) {
+      m_pool.run(*input.group, [this, &input, right] { BuildSubtree(input, right); });
+    } else {
+      stack.push_back(right);
+    }
+    stack.push_back(left);
+  }
+}
+
+ParallelSplitBvh::Split
+ParallelSplitBvh::FindObjectSplit(BuildInput &input, Request const &req) const {
+  // Without a valid split, PerformSplit falls back to halving the references.
+  Split split = { Split::kObject, -1, 0, std::numeric_limits<float>::max(), 0.f };
+
+  const int num_bins = m_num_bins;
+  const float3 centroid_extents = req.centroid_bounds.extents();
+  std::vector<ObjectBin> bins(3 * num_bins);
+  const auto bin_range = [&](int begin, int end, std::vector<ObjectBin> &out_bins) {
+    for (int i = begin; i < end; ++i) {
+      const PrimRef &ref = input.refs[i];
+      const float3 centroid = ref.bounds.center();
+      for (int axis = 0; axis < 3; ++axis) {
+        if (centroid_extents[axis] == 0.f) {
+          continue;
+        }
+        const Binner binner(req.centroid_bounds.pmin[axis], centroid_extents[axis], num_bins);
+        auto &bin = out_bins[axis * num_bins + binner.bin(centroid[axis])];
+        ++bin.count;
+        bin.bounds.grow(ref.bounds);
+      }
+    }
+  };
+
+  // Bins only accumulate counts and min/max bounds, so merging chunks in any order gives the
+  // same bins.
+  const int begin = req.refidx;
+  const int end = req.refidx + req.numrefs;
+  if (req.numrefs < kMinParallelBinningRefs) {
+    bin_range(begin, end, bins);
+  } else {
+    std::mutex bins_mutex;
+    m_pool.parallelFor(begin, end, kBinningGrain, [&](int chunk_begin, int chunk_end) {
+      std::vector<ObjectBin> local_bins(3 * num_bins);
+      bin_range(chunk_begin, chunk_end, local_bins);
+      std::lock_guard<std::mutex> lock(bins_mutex);
+      for (size_t i = 0; i < bins.size(); ++i) {
+        bins[i].count += local_bins[i].count;
+        bins[i].bounds.grow(local_bins[i].bounds);
+      }
+    });
+  }
+
+  std::vector<bbox> rightbounds(num_bins - 1);
+  for (int axis = 0; axis < 3; ++axis) {
+    if (centroid_extents[axis] == 0.f) {
+      continue;
+    }
+    const ObjectBin *axis_bins = &bins[axis * num_bins];
+
+    bbox rightbox;
+    for (int i = num_bins - 1; i > 0; --i) {
+      rightbox.grow(axis_bins[i].bounds);
+      rightbounds[i - 1] = rightbox;
+    }
+
+    bbox leftbox;
+    int leftcount = 0;
+    int rightcount = req.numrefs;
+    for (int i = 0; i < num_bins - 1; ++i) {
+      leftbox.grow(axis_bins[i].bounds);
+      leftcount += axis_bins[i].count;
+      rightcount -= axis_bins[i].count;
+      if (leftcount == 0 || rightcount == 0) {
+        continue;
+      }
+      const float sah =
+        leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area();
+      if (sah < split.sah) {
+        split = { Split::kObject, axis, i, sah, overlap_area(leftbox, rightbounds[i]) };
+      }
+    }
+  }
+  return split;
+}
+
+ParallelSplitBvh::Split
+ParallelSplitBvh::FindSpatialSplit(BuildInput &input, Request const &req) const {
+  Split split = { Split::kSpatial, -1, 0, std::numeric_limits<float>::max(), 0.f };
+
+  const int num_bins = m_num_bins;
+  const float3 extents = req.bounds.extents();
+  std::vector<SpatialBin> bins(3 * num_bins);
+  // Every reference enters the bin of its lower bound and exits the bin of its upper bound, and
+  // its bounds clipped to each bin in between grow that bin.
+  const auto bin_range = [&](int begin, int end, std::vector<SpatialBin> &out_bins) {
+    for (int i = begin; i < end; ++i) {
+      const PrimRef &ref = input.refs[i];
+      for (int axis = 0; axis < 3; ++axis) {
+        if (extents[axis] == 0.f) {
+          continue;
+        }
+        const Binner binner(req.bounds.pmin[axis], extents[axis], num_bins);
+        const int first = binner.bin(ref.bounds.pmin[axis]);
+        const int last = binner.bin(ref.bounds.pmax[axis]);
+        SpatialBin *axis_bins = &out_bins[axis * num_bins];
+        ++axis_bins[first].entries;
+        ++axis_bins[last].exits;
+        for (int j = first; j <= last; ++j) {
+          bbox clipped = ref.bounds;
+          clipped.pmin[axis] = std::max(clipped.pmin[axis], binner.plane(j));
+          clipped.pmax[axis] = std::min(clipped.pmax[axis], binner.plane(j + 1));
+          axis_bins[j].bounds.grow(clipped);
+        }
+      }
+    }
+  };
+
+  const int begin = req.refidx;
+  const int end = req.refidx + req.numrefs;
+  if (req.numrefs < kMinParallelBinningRefs) {
+    bin_range(begin, end, bins);
+  } else {
+    std::mutex bins_mutex;
+    m_pool.parallelFor(begin, end, kBinningGrain, [&](int chunk_begin, int chunk_end) {
+      std::vector<SpatialBin> local_bins(3 * num_bins);
+      bin_range(chunk_begin, chunk_end, local_bins);
+      std::lock_guard<std::mutex> lock(bins_mutex);
+      for (size_t i = 0; i < bins.size(); ++i) {
+        bins[i].entries += local_bins[i].entries;
+        bins[i].exits += local_bins[i].exits;
+        bins[i].bounds.grow(local_bins[i].bounds);
+      }
+    });
+  }
+
+  std::vector<bbox> rightbounds(num_bins - 1);
+  for (int axis = 0; axis < 3; ++axis) {
+    if (extents[axis] == 0.f) {
+      continue;
+    }
+    const SpatialBin *axis_bins = &bins[axis * num_bins];
+
+    bbox rightbox;
+    for (int i = num_bins - 1; i > 0; --i) {
+      rightbox.grow(axis_bins[i].bounds);
+      rightbounds[i - 1] = rightbox;
+    }
+
+    bbox leftbox;
+    int leftcount = 0;
+    int rightcount = req.numrefs;
+    for (int i = 0; i < num_bins - 1; ++i) {
+      leftbox.grow(axis_bins[i].bounds);
+      leftcount += axis_bins[i].entries;
+      rightcount -= axis_bins[i].exits;
+      // Only splits that fit into the remaining budget of this subtree are considered.
+      const int duplicates = leftcount + rightcount - req.numrefs;
+      if (leftcount == 0 || rightcount == 0 || duplicates > req.budget) {
+        continue;
+      }
+      const float sah =
+        leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area();
+      if (sah < split.sah) {
+        split = { Split::kSpatial, axis, i, sah, 0.f };
+      }
+    }
+  }
+  return split;
+}
+
+void ParallelSplitBvh::PerformSplit(
+  BuildInput &input, Request const &req, Split const &split, Request &left, Request &right) {
+  PrimRef *refs = &input.refs[req.refidx];
+  bbox leftbounds, rightbounds, leftcentroid_bounds, rightcentroid_bounds;
+  const auto grow_left = [&](PrimRef const &ref) {
+    leftbounds.grow(ref.bounds);
+    leftcentroid_bounds.grow(ref.bounds.center());
+  };
+  const auto grow_right = [&](PrimRef const &ref) {
+    rightbounds.grow(ref.bounds);
+    rightcentroid_bounds.grow(ref.bounds.center());
+  };
+
+  int numleft = 0;
+  int numright = 0;
+  std::vector<PrimRef> rightrefs;
+  if (split.dim == -1) {
+    // Coincident centroids: halve the range.
+    numleft = req.numrefs / 2;
+    numright = req.numrefs - numleft;
+  } else if (split.type == Split::kObject) {
+    const int axis = split.dim;
+    const Binner binner(
+      req.centroid_bounds.pmin[axis], req.centroid_bounds.extents()[axis], m_num_bins);
+    numleft = int(std::partition(refs, refs + req.numrefs, [&](PrimRef const &ref) {
+                    return binner.bin(ref.bounds.center()[axis]) <= split.bin;
+                  }) -
+                  refs);
+    numright = req.numrefs - numleft;
+  } else {
+    // References straddling the plane are clipped into both children. The left ones are packed
+    // in place, the right ones go through a temporary array since there can be more references
+    // than fit behind them.
+    const int axis = split.dim;
+    const Binner binner(req.bounds.pmin[axis], req.bounds.extents()[axis], m_num_bins);
+    const float plane = binner.plane(split.bin + 1);
+    for (int i = 0; i < req.numrefs; ++i) {
+      const PrimRef ref = refs[i];
+      const int first = binner.bin(ref.bounds.pmin[axis]);
+      const int last = binner.bin(ref.bounds.pmax[axis]);
+      if (last <= split.bin) {
+        refs[numleft++] = ref;
+      } else if (first > split.bin) {
+        rightrefs.push_back(ref);
+      } else {
+        PrimRef leftref = ref;
+        leftref.bounds.pmax[axis] = std::min(leftref.bounds.pmax[axis], plane);
+        refs[numleft++] = leftref;
+        PrimRef rightref = ref;
+        rightref.bounds.pmin[axis] = std::max(rightref.bounds.pmin[axis], plane);
+        rightrefs.push_back(rightref);
+      }
+    }
+    numright = int(rightrefs.size());
+  }
+
+  // Share the budget left after this split between the children, by reference count.
+  const int duplicates = numleft + numright - req.numrefs;
+  const int budget = req.budget - duplicates;
+  const int leftbudget = int(int64_t(budget) * numleft / (numleft + numright));
+  const int rightrefidx = req.refidx + numleft + leftbudget;
+  if (split.type == Split::kSpatial) {
+    std::copy(rightrefs.begin(), rightrefs.end(), input.refs.begin() + rightrefidx);
+  } else {
+    std::move_backward(
+      refs + numleft, refs + req.numrefs, input.refs.begin() + rightrefidx + numright);
+  }
+
+  for (int i = req.refidx; i < req.refidx + numleft; ++i) {
+    grow_left(input.refs[i]);
+  }
+  for (int i = rightrefidx; i < rightrefidx + numright; ++i) {
+    grow_right(input.refs[i]);
+  }
+
+  left = { req.refidx,
+           numleft,
+           leftbudget,
+           req.nodeidx + 1,
+           leftbounds,
+           leftcentroid_bounds,
+           req.level + 1 };
+  right = { rightrefidx,
+            numright,
+            budget - leftbudget,
+            req.nodeidx + 2 * (numleft + leftbudget),
+            rightbounds,
+            rightcentroid_bounds,
+            req.level + 1 };
+}
+
+} // namespace bvh
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+// RadeonRays
+#include <accelerator/bvh.h>
+
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+// Spatial split SAH builder (SBVH, Stich et al., "Spatial Splits in Bounding Volume
+// Hierarchies", HPG 2009) with the subtrees built in parallel on the TaskPool.
+// Like RadeonRays::SplitBvh it only sees primitive bounds, so a spatial split clips the bounds
+// of the straddling references to the split plane.
+//
+// Leafs hold a single reference, so a subtree over n references that may still create b
+// duplicates takes at most n + b reference slots and 2 (n + b) - 1 nodes. Every split hands
+// the remaining budget of its node to the children in proportion to their reference counts,
+// together with disjoint reference and node ranges. The extra_node_budget is thus respected
+// for the whole tree without a shared counter, and a subtree only depends on its own input, so
+// the result is the same for any thread count.
+class ParallelSplitBvh : public RadeonRays::Bvh {
+ public:
+  ParallelSplitBvh(
+    float traversal_cost,
+    int num_bins,
+    int max_split_depth,
+    float min_overlap,
+    float extra_node_budget,
+    TaskPool &pool = TaskPool::global())
+    : Bvh(traversal_cost, num_bins, true)
+    , m_max_split_depth(max_split_depth)
+    , m_min_overlap(min_overlap)
+    , m_extra_node_budget(extra_node_budget)
+    , m_pool(pool) {}
+
+ protected:
+  void BuildImpl(RadeonRays::bbox const *bounds, int numbounds) override;
+
+ private:
+  using bbox = RadeonRays::bbox;
+  using float3 = RadeonRays::float3;
+
+  // Primitive reference, with the bounds clipped by the spatial splits above it.
+  struct PrimRef {
+    bbox bounds;
+    int primidx;
+  };
+
+  // Split between bin and bin + 1 along dim, dim == -1 for no valid split.
+  struct Split {
+    enum Type { kObject, kSpatial } type;
+    int dim;
+    int bin;
+    // SAH cost without the constant factors: sum of child surface area * reference count.
+    float sah;
+    // Surface area of the intersection of the child bounds, for object splits.
+    float overlap;
+  };
+
+  // Subtree to build: references [refidx, refidx + numrefs) in the reference array, with room
+  // for budget duplicates behind them, emitted into the nodes from nodeidx on.
+  struct Request {
+    int refidx;
+    int numrefs;
+    int budget;
+    int nodeidx;
+    bbox bounds;
+    bbox centroid_bounds;
+    int level;
+  };
+
+  struct BuildInput {
+    std::vector<PrimRef> refs;
+    float root_area;
+    TaskPool::TaskGroup *group;
+    std::atomic<int> height;
+  };
+
+  void BuildSubtree(BuildInput &input, Request const &req);
+  Split FindObjectSplit(BuildInput &input, Request const &req) const;
+  Split FindSpatialSplit(BuildInput &input, Request const &req) const;
+  // Partition the references of req by split into the reference ranges of the two children.
+  void PerformSplit(
+    BuildInput &input, Request const &req, Split const &split, Request &left, Request &right);
+
+  int m_max_split_depth;
+  float m_min_overlap;
+  float m_extra_node_budget;
+  TaskPool &m_pool;
+};
+
+} // namespace bvh
@@ -0,0 +1,143 @@
+#include <bvh/ploc_bvh.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace bvh {
+
+namespace {
+using bbox = RadeonRays::bbox;
+
+// Fixed chunks for the compaction scans, so the node layout does not depend on the number of
+// threads.
+constexpr int kChunkSize = 16 * 1024;
+} // namespace
+
+void PlocBvh::BuildImpl(bbox const *bounds, int numbounds) {
+  if (numbounds == 0) {
+    m_root = nullptr;
+    return;
+  }
+
+  SortByMortonCode(bounds, numbounds);
+
+  // Leafs take the last numbounds slots in Morton order. Internal nodes are allocated downwards
+  // from slot numbounds - 2 as clusters get merged, so the root ends up in slot 0.
+  InitNodeAllocator(2 * numbounds - 1);
+  const int leafbase = numbounds - 1;
+  std::vector<int> clusters(numbounds);
+  std::vector<bbox> cluster_bounds(numbounds);
+  m_pool.parallelFor(0, numbounds, kChunkSize, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      Node &leaf = m_nodes[leafbase + i];
+      leaf.type = kLeaf;
+      leaf.index = leafbase + i;
+      leaf.startidx = i;
+      leaf.numprims = 1;
+      leaf.bounds = bounds[m_indices[i]];
+      clusters[i] = leafbase + i;
+      cluster_bounds[i] = leaf.bounds;
+    }
+  });
+
+  const int radius = std::max(m_radius, 1);
+  std::vector<int> neighbors(numbounds);
+  std::vector<int> next_clusters(numbounds);
+  std::vector<bbox> next_cluster_bounds(numbounds);
+  std::vector<int> chunk_merges;
+  std::vector<int> chunk_survivors;
+  int numclusters = numbounds;
+  int next_internal = numbounds - 2;
+  while (numclusters > 1) {
+    // Nearest neighbor search. Ties go to the lower index, which makes the pair of clusters with
+    // the smallest distance always mutual nearest neighbors, so every pass merges something.
+    m_pool.parallelFor(0, numclusters, kChunkSize, [&](int begin, int end) {
+      for (int i = begin; i < end; ++i) {
+        float best_distance = std::numeric_limits<float>::max();
+        int best_neighbor = -1;
+        const int first = std::max(i - radius, 0);
+        const int last = std::min(i + radius, numclusters - 1);
+        for (int j = first; j <= last; ++j) {
+          if (j == i) {
+            continue;
+          }
+          bbox merged = cluster_bounds[i];
+          merged.grow(cluster_bounds[j]);
+          const float distance = merged.surface_area();
+          if (distance < best_distance) {
+            best_distance = distance;
+            best_neighbor = j;
+          }
+        }
+        neighbors[i] = best_neighbor;
+      }
+    });
+
+    // The lower cluster of a mutual pair creates the merged node at its position, the upper one
+    // disappears. Count both per chunk to find where each chunk writes its output.
+    const auto is_mutual = [&](int i) { return neighbors[neighbors[i]] == i; };
+    const int num_chunks = (numclusters + kChunkSize - 1) / kChunkSize;
+    chunk_merges.assign(num_chunks, 0);
+    chunk_survivors.assign(num_chunks, 0);
+    m_pool.parallelFor(0, num_chunks, 1, [&](int chunk_begin, int chunk_end) {
+      for (int chunk = chunk_begin; chunk < chunk_end; ++chunk) {
+        const int end = std::min(numclusters, (chunk + 1) * kChunkSize);
+        for (int i = chunk * kChunkSize; i < end; ++i) {
+          const bool mutual = is_mutual(i);
+          chunk_merges[chunk] += mutual && i < neighbors[i];
+          chunk_survivors[chunk] += !mutual || i < neighbors[i];
+        }
+      }
+    });
+    int num_merges = 0;
+    int num_survivors = 0;
+    for (int chunk = 0; chunk < num_chunks; ++chunk) {
+      const int merges = chunk_merges[chunk];
+      const int survivors = chunk_survivors[chunk];
+      chunk_merges[chunk] = num_merges;
+      chunk_survivors[chunk] = num_survivors;
+      num_merges += merges;
+      num_survivors += survivors;
+    }
+
+    m_pool.parallelFor(0, num_chunks, 1, [&](int chunk_begin, int chunk_end) {
+      for (int chunk = chunk_begin; chunk < chunk_end; ++chunk) {
+        int merge = chunk_merges[chunk];
+        int survivor = chunk_survivors[chunk];
+        const int end = std::min(numclusters, (chunk + 1) * kChunkSize);
+        for (int i = chunk * kChunkSize; i < end; ++i) {
+          const int neighbor = neighbors[i];
+          if (!is_mutual(i)) {
+            next_clusters[survivor] = clusters[i];
+            next_cluster_bounds[survivor] = cluster_bounds[i];
+            ++survivor;
+          } else if (i < neighbor) {
+            const int nodeidx = next_internal - merge;
+            Node &node = m_nodes[nodeidx];
+            node.type = kInternal;
+            node.index = nodeidx;
+            node.lc = &m_nodes[clusters[i]];
+            node.rc = &m_nodes[clusters[neighbor]];
+            node.bounds = cluster_bounds[i];
+            node.bounds.grow(cluster_bounds[neighbor]);
+            next_clusters[survivor] = nodeidx;
+            next_cluster_bounds[survivor] = node.bounds;
+            ++merge;
+            ++survivor;
+          }
+        }
+      }
+    });
+
+    next_internal -= num_merges;
+    numclusters = num_survivors;
+    clusters.swap(next_clusters);
+    cluster_bounds.swap(next_cluster_bounds);
+  }
+
+  m_root = &m_nodes[clusters[0]];
+  m_nodecnt = 2 * numbounds - 1;
+  m_packed_indices = m_indices;
+}
+
+} // namespace bvh
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <bvh/linear_bvh.h>
+
+namespace bvh {
+
+// Bottom-up builder by parallel locally-ordered clustering (PLOC).
+// Primitives are sorted by Morton code like in LinearBvh and every primitive starts as its own
+// cluster. Each pass finds the nearest neighbor of every cluster among the radius clusters on
+// either side of it in the sorted sequence, the distance being the surface area of the merged
+// bounds. Mutual nearest neighbors are merged and the sequence is compacted, until one cluster
+// is left (Meister and Bittner, "Parallel Locally-Ordered Clustering for Bounding Volume
+// Hierarchy Construction", TVCG 2018). Every step of a pass is data parallel, and the quality is
+// close to top-down SAH.
+class PlocBvh : public LinearBvh {
+ public:
+  PlocBvh(
+    float traversal_cost, int morton_bits, int radius, TaskPool &pool = TaskPool::global())
+    : LinearBvh(traversal_cost, morton_bits, pool)
+    , m_radius(radius) {}
+
+ protected:
+  void BuildImpl(bbox const *bounds, int numbounds) override;
+
+ private:
+  int m_radius;
+};
+
+} // namespace bvh
@@ -0,0 +1,235 @@
+#include <bvh/presplit.h>
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+namespace bvh {
+
+namespace {
+// Grid levels searched for split planes, and splits of a triangle nested at most.
+constexpr int kMaxGridLevel = 24;
+constexpr int kMaxSplitDepth = 32;
+
+struct Triangle {
+  float3 v[3];
+};
+
+// Coarsest grid plane strictly inside bounds along axis, where the grid divides the scene
+// bounds into 2^level slabs. Returns the level, kMaxGridLevel + 1 and the center if there is
+// none.
+int find_split_plane(const bbox &bounds, int axis, const bbox &scene, float &out_pos) {
+  const float scene_min = scene.pmin[axis];
+  const float scene_extent = scene.pmax[axis] - scene_min;
+  if (scene_extent > 0.f) {
+    const float u0 = (bounds.pmin[axis] - scene_min) / scene_extent;
+    const float u1 = (bounds.pmax[axis] - scene_min) / scene_extent;
+    float scale = 2.f;
+    for (int level = 1; level <= kMaxGridLevel; ++level, scale *= 2.f) {
+      const float plane = std::floor(u0 * scale) + 1.f;
+      if (plane < u1 * scale) {
+        out_pos = scene_min + plane / scale * scene_extent;
+        return level;
+      }
+    }
+  }
+  out_pos = 0.5f * (bounds.pmin[axis] + bounds.pmax[axis]);
+  return kMaxGridLevel + 1;
+}
+
+// Axis and position of the most important split plane of bounds: the coarsest one, along the
+// largest extent on ties. Returns the level of the plane.
+int choose_split(const bbox &bounds, const bbox &scene, int &out_axis, float &out_pos) {
+  const auto extents = bounds.extents();
+  int best_level = kMaxGridLevel + 2;
+  for (int axis = 0; axis < 3; ++axis) {
+    if (!(extents[axis] > 0.f)) {
+      continue;
+    }
+    float pos;
+    const int level = find_split_plane(bounds, axis, scene, pos);
+    if (level < best_level || (level == best_level && extents[axis] > extents[out_axis])) {
+      best_level = level;
+      out_axis = axis;
+      out_pos = pos;
+    }
+  }
+  return best_level;
+}
+
+// Surface area of the union of the bounds of the pieces, as the triangle is split ever finer.
+float ideal_area(const Triangle &tri) {
+  const auto n = cross(tri.v[1] - tri.v[0], tri.v[2] - tri.v[0]);
+  return std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+}
+
+// Bounds of the parts of tri on both sides of the plane at pos along axis.
+void clip_triangle(const Triangle &tri, int axis, float pos, bbox &out_left, bbox &out_right) {
+  out_left = bbox();
+  out_right = bbox();
+  for (int i = 0; i < 3; ++i) {
+    const auto &v0 = tri.v[i];
+    const auto &v1 = tri.v[(i + 1) % 3];
+    const float d0 = v0[axis] - pos;
+    const float d1 = v1[axis] - pos;
+    if (d0 <= 0.f) {
+      out_left.grow(v0);
+    }
+    if (d0 >= 0.f) {
+      out_right.grow(v0);
+    }
+    if ((d0 < 0.f && d1 > 0.f) || (d0 > 0.f && d1 < 0.f)) {
+      auto p = v0 + (v1 - v0) * (d0 / (d0 - d1));
+      p[axis] = pos;
+      out_left.grow(p);
+      out_right.grow(p);
+    }
+  }
+}
+
+bool is_empty(const bbox &bounds) {
+  return !(bounds.pmin.x <= bounds.pmax.x) || !(bounds.pmin.y <= bounds.pmax.y) ||
+    !(bounds.pmin.z <= bounds.pmax.z);
+}
+
+// Split bounds of tri into up to count references written to out_bounds. Returns the number
+// written.
+int split_triangle(
+  const Triangle &tri,
+  const bbox &bounds,
+  int count,
+  const bbox &scene,
+  int depth,
+  bbox *out_bounds) {
+  int axis = 0;
+  float pos = 0.f;
+  if (
+    count <= 1 || depth >= kMaxSplitDepth ||
+    choose_split(bounds, scene, axis, pos) > kMaxGridLevel + 1) {
+    out_bounds[0] = bounds;
+    return 1;
+  }
+  bbox left, right;
+  clip_triangle(tri, axis, pos, left, right);
+  left = intersection(left, bounds);
+  right = intersection(right, bounds);
+  left.pmax[axis] = std::min(left.pmax[axis], pos);
+  right.pmin[axis] = std::max(right.pmin[axis], pos);
+  if (is_empty(left) || is_empty(right)) {
+    // The bounds of the piece were loose, the triangle is on one side.
+    return split_triangle(tri, is_empty(left) ? right : left, count, scene, depth + 1, out_bounds);
+  }
+
+  // References go where the bounds are larger.
+  const float left_area = left.surface_area();
+  const float area = left_area + right.surface_area();
+  const int left_count = std::min(
+    std::max(area > 0.f ? int(std::lround(count * left_area / area)) : count / 2, 1), count - 1);
+  const int numleft = split_triangle(tri, left, left_count, scene, depth + 1, out_bounds);
+  return numleft +
+    split_triangle(tri, right, count - left_count, scene, depth + 1, out_bounds + numleft);
+}
+} // namespace
+
+PresplitTriangles presplit_triangles(
+  gsl::span<const float> vertices, gsl::span<const int> indices, float budget, TaskPool &pool) {
+  const int numtris = int(indices.size() / 3);
+  const auto get_triangle = [&](int i) {
+    Triangle tri;
+    for (int j = 0; j < 3; ++j) {
+      const float *v = &vertices[3 * indices[3 * i + j]];
+      tri.v[j] = float3(v[0], v[1], v[2]);
+    }
+    return tri;
+  };
+
+  bbox scene;
+  std::mutex scene_mutex;
+  pool.parallelFor(0, numtris, kParallelForGrain, [&](int begin, int end) {
+    bbox local_bounds;
+    for (int i = begin; i < end; ++i) {
+      const auto tri = get_triangle(i);
+      for (const auto &v : tri.v) {
+        local_bounds.grow(v);
+      }
+    }
+    std::lock_guard<std::mutex> lock(scene_mutex);
+    scene.grow(local_bounds);
+  });
+
+  // Priority of splitting a triangle: the cube root of the area its bounds waste, weighted by
+  // the importance of the plane that would split them, as proposed by Karras and Aila.
+  std::vector<float> priorities(numtris);
+  double priority_sum = 0.0;
+  std::mutex sum_mutex;
+  pool.parallelFor(0, numtris, kParallelForGrain, [&](int begin, int end) {
+    double local_sum = 0.0;
+    for (int i = begin; i < end; ++i) {
+      const auto tri = get_triangle(i);
+      bbox bounds;
+      for (const auto &v : tri.v) {
+        bounds.grow(v);
+      }
+      int axis = 0;
+      float pos = 0.f;
+      const int level = choose_split(bounds, scene, axis, pos);
+      const float excess = std::max(bounds.surface_area() - ideal_area(tri), 0.f);
+      priorities[i] = level > kMaxGridLevel ? 0.f : std::cbrt(std::ldexp(excess, -level));
+      local_sum += priorities[i];
+    }
+    std::lock_guard<std::mutex> lock(sum_mutex);
+    priority_sum += local_sum;
+  });
+
+  // References per triangle, and their offsets. The fractions left over are carried on, so
+  // that the budget is used up.
+  const double extra_refs = std::floor(std::max(budget, 0.f) * numtris);
+  const double refs_per_priority = priority_sum > 0.0 ? extra_refs / priority_sum : 0.0;
+  std::vector<int> offsets(numtris + 1);
+  offsets[0] = 0;
+  double carry = 0.0;
+  for (int i = 0; i < numtris; ++i) {
+    const double refs = priorities[i] * refs_per_priority + carry;
+    const int extra = int(refs);
+    carry = refs - extra;
+    offsets[i + 1] = offsets[i] + 1 + extra;
+  }
+
+  PresplitTriangles res;
+  res.bounds.resize(offsets[numtris]);
+  std::vector<int> counts(numtris);
+  pool.parallelFor(0, numtris, kParallelForGrain, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      const auto tri = get_triangle(i);
+      bbox bounds;
+      for (const auto &v : tri.v) {
+        bounds.grow(v);
+      }
+      counts[i] = split_triangle(
+        tri, bounds, offsets[i + 1] - offsets[i], scene, 0, &res.bounds[offsets[i]]);
+    }
+  });
+
+  // Splits can make fewer references than planned, close the gaps.
+  res.triangles.resize(res.bounds.size());
+  int numrefs = 0;
+  for (int i = 0; i < numtris; ++i) {
+    for (int j = 0; j < counts[i]; ++j) {
+      res.bounds[numrefs] = res.bounds[offsets[i] + j];
+      res.triangles[numrefs++] = i;
+    }
+  }
+  res.bounds.resize(numrefs);
+  res.triangles.resize(numrefs);
+  return res;
+}
+
+void remap_leaf_triangles(gsl::span<bbox> nodes, gsl::span<const int> triangles) {
+  for (auto &node : nodes) {
+    if (is_leaf_node(node)) {
+      node.pmin.w = encode_index(uint32_t(triangles[decode_index(node.pmin.w)]));
+    }
+  }
+}
+
+} // namespace bvh
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+
+#include <gsl/span>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+// Triangle references made by presplit_triangles.
+struct PresplitTriangles {
+  // Bounds of the references, the leaf bounds to build the BVH over.
+  std::vector<bbox> bounds;
+  // Triangle of each reference.
+  std::vector<int> triangles;
+};
+
+// Early split clipping (Ernst and Greiner, "Early Split Clipping for Bounding Volume
+// Hierarchies", RT 2007) with the priorities and split planes of Karras and Aila, "Fast Parallel
+// Construction of High-Quality Bounding Volume Hierarchies", HPG 2013.
+// Large triangles that are not aligned to the axes fill little of their bounds, which inflates
+// every node above them. This pass splits their bounds into several references clipped to the
+// triangle, before any builder runs, so that the fast builders get most of the traversal gain
+// of spatial splits. Up to budget extra references per triangle are made in total, handed out
+// by the surface area the bounds exceed the triangle by. Bounds are cut at the coarsest planes of
+// a grid over the scene bounds, where the top-level splits of the builders are most likely.
+// vertices holds xyz triples, indices three vertices per triangle.
+// Leafs hold references, so a triangle can be found in several leafs. The leaf payloads of a
+// built BVH are reference indices, see remap_leaf_triangles. Refitting needs the references
+// split again.
+PresplitTriangles presplit_triangles(
+  gsl::span<const float> vertices,
+  gsl::span<const int> indices,
+  float budget,
+  TaskPool &pool = TaskPool::global());
+
+// Replace the reference indices of single primitive leafs by the triangles they reference.
+void remap_leaf_triangles(gsl::span<bbox> nodes, gsl::span<const int> triangles);
+
+} // namespace bvh
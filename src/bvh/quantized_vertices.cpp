@@ -0,0 +1,106 @@
+#include <bvh/quantized_vertices.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+namespace {
+constexpr int kHeaderWords = 4;
+constexpr int kClusterWords = 8;
+constexpr float kMaxQuantized = 65535.f;
+
+uint32_t float_bits(float value) {
+  uint32_t res;
+  std::memcpy(&res, &value, sizeof(res));
+  return res;
+}
+
+float bits_float(uint32_t bits) {
+  float res;
+  std::memcpy(&res, &bits, sizeof(res));
+  return res;
+}
+} // namespace
+
+std::vector<uint32_t> quantize_vertices(gsl::span<float> vertices, gsl::span<int> indices) {
+  const int numverts = int(vertices.size() / 3);
+  const int numclusters = (numverts + kVertexClusterSize - 1) / kVertexClusterSize;
+
+  // Vertices in the order of their first use, the unused ones last.
+  std::vector<int> new_index(numverts, -1);
+  int count = 0;
+  for (auto &index : indices) {
+    if (new_index[index] == -1) {
+      new_index[index] = count++;
+    }
+    index = new_index[index];
+  }
+  std::vector<float> original(vertices.begin(), vertices.end());
+  for (int i = 0; i < numverts; ++i) {
+    if (new_index[i] == -1) {
+      new_index[i] = count++;
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+      vertices[3 * new_index[i] + axis] = original[3 * i + axis];
+    }
+  }
+
+  const int positions = kHeaderWords + kClusterWords * numclusters;
+  std::vector<uint32_t> res(positions + (3 * numverts + 1) / 2, 0);
+  res[0] = uint32_t(numclusters);
+  TaskPool::global().parallelFor(0, numclusters, 64, [&](int begin, int end) {
+    for (int cluster = begin; cluster < end; ++cluster) {
+      const int first = cluster * kVertexClusterSize;
+      const int last = std::min(first + kVertexClusterSize, numverts);
+      const auto get_position = [&](int i, int axis) { return vertices[3 * i + axis]; };
+
+      float origin[3];
+      float step[3];
+      for (int axis = 0; axis < 3; ++axis) {
+        float lo = get_position(first, axis);
+        float hi = lo;
+        for (int i = first + 1; i < last; ++i) {
+          lo = std::min(lo, get_position(i, axis));
+          hi = std::max(hi, get_position(i, axis));
+        }
+        origin[axis] = lo;
+        step[axis] = (hi - lo) / kMaxQuantized;
+      }
+      uint32_t *table = &res[kHeaderWords + kClusterWords * cluster];
+      for (int axis = 0; axis < 3; ++axis) {
+        table[axis] = float_bits(origin[axis]);
+        table[4 + axis] = float_bits(step[axis]);
+      }
+
+      for (int i = first; i < last; ++i) {
+        for (int axis = 0; axis < 3; ++axis) {
+          const float scaled =
+            step[axis] > 0.f ? (get_position(i, axis) - origin[axis]) / step[axis] : 0.f;
+          const uint32_t q = uint32_t(std::min(std::max(std::round(scaled), 0.f), kMaxQuantized));
+          const int half = 3 * i + axis;
+          res[positions + half / 2] |= q << (16 * (half & 1));
+        }
+      }
+    }
+  });
+  return res;
+}
+
+float3 vertex_quantization_error(gsl::span<const uint32_t> quantized, int index) {
+  const int table = kHeaderWords + kClusterWords * (index / kVertexClusterSize);
+  float3 res;
+  for (int axis = 0; axis < 3; ++axis) {
+    const float origin = bits_float(quantized[table + axis]);
+    const float step = bits_float(quantized[table + 4 + axis]);
+    // Half a step of rounding, and a few ulps of the decoded value for the float arithmetic.
+    const float magnitude = std::abs(origin) + step * kMaxQuantized;
+    res[axis] = 0.5f * step + magnitude * 4.f * std::numeric_limits<float>::epsilon();
+  }
+  return res;
+}
+
+} // namespace bvh
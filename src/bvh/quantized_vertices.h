@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <gsl/span>
+
+#include <bvh/bvh_builder.h>
+
+namespace bvh {
+
+// Vertex positions quantized to 16 bits per axis within the bounds of their cluster, half the
+// size of float positions (see BVH_QUANTIZED_VERTICES in bvh.glslh).
+// Clusters are runs of kVertexClusterSize vertices, so vertices are renumbered in the order the
+// triangles first use them, which keeps the clusters of a mesh in leaf order compact. Positions
+// are rounded to the nearest step of the cluster grid. Every vertex has a single quantized
+// position that all its triangles decode alike, so edges shared by triangles stay shared and the
+// watertight triangle test stays watertight. The triangles move by up to
+// vertex_quantization_error, which the leaf bounds have to be grown by.
+// The buffer holds 32-bit words: the number of clusters padded to 4 words, then the origin and
+// the step of every cluster as two float4, then three 16-bit positions per vertex, two per word,
+// low half first.
+constexpr int kVertexClusterSize = 256;
+static_assert(kVertexClusterSize % 2 == 0, "Clusters start at word boundaries");
+
+// Quantize vertices, xyz triples. The vertices are reordered in place in the order of the
+// quantized buffer and indices are renumbered to match, so that both stay usable alongside it.
+std::vector<uint32_t> quantize_vertices(gsl::span<float> vertices, gsl::span<int> indices);
+
+// Decoded position of vertex index, like get_vertex in bvh.glslh.
+inline float3 decode_vertex(gsl::span<const uint32_t> quantized, int index) {
+  const auto to_float = [](uint32_t bits) {
+    float res;
+    std::memcpy(&res, &bits, sizeof(res));
+    return res;
+  };
+  const int table = 4 + 8 * (index / kVertexClusterSize);
+  const int positions = 4 + 8 * int(quantized[0]);
+  float3 res;
+  for (int axis = 0; axis < 3; ++axis) {
+    const int half = 3 * index + axis;
+    const uint32_t q = (quantized[positions + half / 2] >> (16 * (half & 1))) & 0xffff;
+    const float origin = to_float(quantized[table + axis]);
+    res[axis] = origin + float(q) * to_float(quantized[table + 4 + axis]);
+  }
+  return res;
+}
+
+// Bound of the distance between the decoded and the original position of vertex index per axis,
+// including the rounding of decoders that fuse the multiply and the add.
+float3 vertex_quantization_error(gsl::span<const uint32_t> quantized, int index);
+
+} // namespace bvh
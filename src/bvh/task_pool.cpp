@@ -0,0 +1,145 @@
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+namespace {
+// Index of the pool queue owned by the current thread, -1 for threads outside of any pool.
+thread_local int tls_worker_idx = -1;
+thread_local const TaskPool *tls_pool = nullptr;
+} // namespace
+
+TaskPool::TaskPool(int num_threads) {
+  if (num_threads <= 0) {
+    num_threads = std::max(1, int(std::thread::hardware_concurrency()));
+  }
+  m_num_threads = num_threads;
+
+  const int num_workers = num_threads - 1;
+  for (int i = 0; i < num_workers + 1; ++i) {
+    m_queues.push_back(std::make_unique<Queue>());
+  }
+  for (int i = 0; i < num_workers; ++i) {
+    m_threads.emplace_back([this, i] { workerMain(i); });
+  }
+}
+
+TaskPool::~TaskPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_sleep_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (auto &thread : m_threads) {
+    thread.join();
+  }
+}
+
+TaskPool &TaskPool::global() {
+  static TaskPool pool;
+  return pool;
+}
+
+TaskPool::Queue &TaskPool::localQueue() {
+  if (tls_pool == this && tls_worker_idx >= 0) {
+    return *m_queues[tls_worker_idx];
+  }
+  return *m_queues.back();
+}
+
+void TaskPool::run(TaskGroup &group, Task task) {
+  group.m_pending.fetch_add(1, std::memory_order_relaxed);
+  auto wrapped = [this, &group, task = std::move(task)] {
+    task();
+    if (group.m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      // The last task of the group wakes its waiter. The group can be gone by now, only the
+      // pool is touched.
+      std::lock_guard<std::mutex> lock(m_sleep_mutex);
+      m_wake.notify_all();
+    }
+  };
+
+  if (m_threads.empty()) {
+    // Single-threaded pool: there is nobody to steal the task, run it right away.
+    wrapped();
+    return;
+  }
+
+  {
+    auto &queue = localQueue();
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.push_back(std::move(wrapped));
+  }
+  m_queued.fetch_add(1, std::memory_order_release);
+  {
+    // Pairs with the predicate check in workerMain so the wake-up cannot be lost.
+    std::lock_guard<std::mutex> lock(m_sleep_mutex);
+  }
+  m_wake.notify_one();
+}
+
+bool TaskPool::tryRunOne() {
+  Task task;
+
+  // Own queue first, newest task first.
+  {
+    auto &queue = localQueue();
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    }
+  }
+
+  // Then steal the oldest task of somebody else.
+  if (!task) {
+    const int num_queues = int(m_queues.size());
+    const int first = tls_pool == this && tls_worker_idx >= 0 ? tls_worker_idx + 1 : 0;
+    for (int i = 0; i < num_queues && !task; ++i) {
+      auto &queue = *m_queues[(first + i) % num_queues];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.tasks.empty()) {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+    }
+  }
+
+  if (!task) {
+    return false;
+  }
+  m_queued.fetch_sub(1, std::memory_order_relaxed);
+  task();
+  return true;
+}
+
+void TaskPool::wait(TaskGroup &group) {
+  while (group.m_pending.load(std::memory_order_acquire) > 0) {
+    if (tryRunOne()) {
+      continue;
+    }
+    // Nothing to help with: sleep until a task is queued or the group finishes, like the idle
+    // workers do.
+    std::unique_lock<std::mutex> lock(m_sleep_mutex);
+    m_wake.wait(lock, [this, &group] {
+      return group.m_pending.load(std::memory_order_acquire) == 0 ||
+             m_queued.load(std::memory_order_acquire) > 0;
+    });
+  }
+}
+
+void TaskPool::workerMain(int worker_idx) {
+  tls_worker_idx = worker_idx;
+  tls_pool = this;
+  for (;;) {
+    if (tryRunOne()) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(m_sleep_mutex);
+    m_wake.wait(lock, [this] { return m_stop || m_queued.load(std::memory_order_acquire) > 0; });
+    if (m_stop) {
+      return;
+    }
+  }
+}
+
+} // namespace bvh
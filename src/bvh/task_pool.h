@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bvh {
+
+// Grain of the parallelFor loops over primitives, vertices or faces: items whose work takes a
+// few nanoseconds each, which a chunk of this many outweighs the cost of a task by far.
+constexpr int kParallelForGrain = 16 * 1024;
+
+// Work-stealing thread pool used by the parallel BVH builders.
+// Every worker owns a task deque: it pushes and pops its own tasks at the back (depth-first, so
+// subtrees stay hot in cache) and steals from the front of the others when it runs dry (so
+// thieves take the oldest, largest chunks of work). Threads that are not part of the pool push
+// into a shared injection deque.
+class TaskPool {
+ public:
+  using Task = std::function<void()>;
+
+  // Counts the outstanding tasks of a fork-join scope.
+  class TaskGroup {
+   public:
+    TaskGroup() = default;
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+   private:
+    friend class TaskPool;
+    std::atomic<int> m_pending{ 0 };
+  };
+
+  // num_threads == 0 selects the number of hardware threads. The thread calling wait() takes
+  // part in the work, so only num_threads - 1 worker threads are spawned.
+  explicit TaskPool(int num_threads = 0);
+  ~TaskPool();
+
+  int getThreadCount() const { return m_num_threads; }
+
+  // Schedule a task as part of group.
+  void run(TaskGroup &group, Task task);
+  // Execute pending tasks until every task of the group has finished. Waiters and idle workers
+  // sleep on a condition variable rather than spin, so an idle pool takes no CPU time.
+  void wait(TaskGroup &group);
+
+  // Call fn(begin, end) for consecutive chunks of [begin, end) that are at least grain long.
+  template <typename Fn>
+  void parallelFor(int begin, int end, int grain, Fn &&fn);
+
+  // Pool shared by all builders, sized to the machine.
+  static TaskPool &global();
+
+ private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void workerMain(int worker_idx);
+  bool tryRunOne();
+  Queue &localQueue();
+
+  int m_num_threads = 1;
+  // One queue per worker thread plus the injection queue for external threads at the end.
+  std::vector<std::unique_ptr<Queue>> m_queues;
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_sleep_mutex;
+  std::condition_variable m_wake;
+  std::atomic<int> m_queued{ 0 };
+  bool m_stop = false;
+
+  TaskPool(const TaskPool &) = delete;
+  TaskPool &operator=(const TaskPool &) = delete;
+};
+
+template <typename Fn>
+void TaskPool::parallelFor(int begin, int end, int grain, Fn &&fn) {
+  const int count = end - begin;
+  if (count <= 0) {
+    return;
+  }
+  grain = std::max(grain, 1);
+  // A few chunks per thread keeps the load balanced without drowning in tiny tasks.
+  const int max_chunks = 4 * m_num_threads;
+  const int num_chunks = std::max(1, std::min(max_chunks, count / grain));
+  if (num_chunks == 1) {
+    fn(begin, end);
+    return;
+  }
+
+  TaskGroup group;
+  for (int chunk = 1; chunk < num_chunks; ++chunk) {
+    const int chunk_begin = begin + int(int64_t(count) * chunk / num_chunks);
+    const int chunk_end = begin + int(int64_t(count) * (chunk + 1) / num_chunks);
+    run(group, [&fn, chunk_begin, chunk_end] { fn(chunk_begin, chunk_end); });
+  }
+  fn(begin, begin + int(int64_t(count) / num_chunks));
+  wait(group);
+}
+
+} // namespace bvh
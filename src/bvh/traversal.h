@@ -0,0 +1,295 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <gsl/span>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/compressed_bvh.h>
+#include <bvh/motion_bvh.h>
+#include <bvh/wide_bvh.h>
+
+namespace bvh {
+
+// CPU traversals of the node formats, mirroring the ones of bvh.glslh. Meant for validation and
+// for comparing formats, not for rendering.
+
+struct TraversalStats {
+  // Nodes fetched and the bytes they take.
+  int64_t nodes = 0;
+  int64_t node_bytes = 0;
+  // Distinct 64 byte cache lines and 4 KB pages of the nodes fetched, summed over the rays: the
+  // cache and TLB misses of rays that start cold and keep what they fetched cached.
+  int64_t lines = 0;
+  int64_t pages = 0;
+  // Leafs whose bounds the ray hits.
+  int64_t leafs = 0;
+
+  // Cache lines fetched by the current ray.
+  std::vector<uintptr_t> ray_lines;
+};
+
+namespace detail {
+inline void count_fetch(TraversalStats *stats, const void *node, size_t size) {
+  if (!stats) {
+    return;
+  }
+  const uintptr_t line = reinterpret_cast<uintptr_t>(node) >> 6;
+  ++stats->nodes;
+  stats->node_bytes += size;
+  if (stats->ray_lines.empty() || stats->ray_lines.back() != line) {
+    stats->ray_lines.push_back(line);
+  }
+}
+
+// Count the lines and pages of a ray at the end of its traversal.
+inline void count_ray(TraversalStats *stats) {
+  if (!stats) {
+    return;
+  }
+  auto &lines = stats->ray_lines;
+  std::sort(lines.begin(), lines.end());
+  lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+  stats->lines += int64_t(lines.size());
+  for (auto &line : lines) {
+    line >>= 6;
+  }
+  stats->pages += std::unique(lines.begin(), lines.end()) - lines.begin();
+  lines.clear();
+}
+
+// Slab test of IntersectBox in bvh.glslh, also returning the entry distance.
+inline bool intersect_box(
+  const bbox &box, const float3 &o, const float3 &invdir, float maxt, float &tentry) {
+  float t0 = 0.f;
+  float t1 = maxt;
+  for (int axis = 0; axis < 3; ++axis) {
+    const float f = (box.pmax[axis] - o[axis]) * invdir[axis];
+    const float n = (box.pmin[axis] - o[axis]) * invdir[axis];
+    t0 = std::max(t0, std::min(f, n));
+    t1 = std::min(t1, std::max(f, n));
+  }
+  tentry = t0;
+  return t1 >= t0;
+}
+} // namespace detail
+
+// Closest hit traversal of a skip-links BVH on the CPU. intersect_leaf(payload, tmax) intersects
+// the primitives of a leaf and lowers tmax to the closest hit. Returns the distance of the
+// closest hit, tmax if there is none.
+template <typename IntersectLeaf>
+float traverse_bvh(
+  gsl::span<const bbox> nodes,
+  const float3 &o,
+  const float3 &d,
+  float tmax,
+  IntersectLeaf &&intersect_leaf,
+  TraversalStats *stats = nullptr) {
+  const float3 invdir(1.f / d.x, 1.f / d.y, 1.f / d.z);
+  int idx = nodes.empty() ? -1 : 0;
+  while (idx != -1) {
+    const auto &node = nodes[idx];
+    detail::count_fetch(stats, &node, sizeof(node));
+    float tentry;
+    if (!detail::intersect_box(node, o, invdir, tmax, tentry)) {
+      idx = decode_index(node.pmax.w);
+    } else if (is_leaf_node(node)) {
+      if (stats) {
+        ++stats->leafs;
+      }
+      intersect_leaf(uint32_t(decode_index(node.pmin.w)), tmax);
+      idx = decode_index(node.pmax.w);
+    } else {
+      ++idx;
+    }
+  }
+  detail::count_ray(stats);
+  return tmax;
+}
+
+// Same for a motion BVH, with the bounds at time.
+template <typename IntersectLeaf>
+float traverse_motion_bvh(
+  gsl::span<const bbox> nodes,
+  int num_time_steps,
+  const float3 &o,
+  const float3 &d,
+  float time,
+  float tmax,
+  IntersectLeaf &&intersect_leaf,
+  TraversalStats *stats = nullptr) {
+  const int steps = std::max(num_time_steps, 1);
+  const float3 invdir(1.f / d.x, 1.f / d.y, 1.f / d.z);
+  int idx = nodes.empty() ? -1 : 0;
+  while (idx != -1) {
+    const auto node = motion_node_bounds(nodes, steps, idx, time);
+    detail::count_fetch(stats, &nodes[idx * steps], sizeof(bbox) * steps);
+    float tentry;
+    if (!detail::intersect_box(node, o, invdir, tmax, tentry)) {
+      idx = decode_index(node.pmax.w);
+    } else if (is_leaf_node(node)) {
+      if (stats) {
+        ++stats->leafs;
+      }
+      intersect_leaf(uint32_t(decode_index(node.pmin.w)), tmax);
+      idx = decode_index(node.pmax.w);
+    } else {
+      ++idx;
+    }
+  }
+  detail::count_ray(stats);
+  return tmax;
+}
+
+// Same for a compressed BVH: the nearer child first, the farther one on the stack.
+template <typename IntersectLeaf>
+float traverse_compressed_bvh(
+  gsl::span<const CompressedBvhNode> nodes,
+  const float3 &o,
+  const float3 &d,
+  float tmax,
+  IntersectLeaf &&intersect_leaf,
+  TraversalStats *stats = nullptr) {
+  if (nodes.empty()) {
+    return tmax;
+  }
+  CompressedBvhHeader header;
+  std::memcpy(&header, &nodes[0], sizeof(header));
+  if (header.root_payload != kInvalidIndex) {
+    if (stats) {
+      ++stats->leafs;
+    }
+    intersect_leaf(header.root_payload, tmax);
+    return tmax;
+  }
+
+  struct StackEntry {
+    int idx;
+    float3 origin;
+  };
+  StackEntry stack[kCompressedBvhStackSize];
+  int stack_size = 0;
+
+  const float3 invdir(1.f / d.x, 1.f / d.y, 1.f / d.z);
+  float3 origin(header.origin[0], header.origin[1], header.origin[2]);
+  int idx = 1;
+  while (idx != -1) {
+    const auto &node = nodes[idx];
+    detail::count_fetch(stats, &node, sizeof(node));
+    bbox bounds[2];
+    float tentry[2];
+    bool hit[2];
+    for (int child = 0; child < 2; ++child) {
+      bounds[child] = decode_child_bounds(node, child, origin);
+      hit[child] = detail::intersect_box(bounds[child], o, invdir, tmax, tentry[child]);
+      if (hit[child] && (node.exponents & (kCompressedLeafChild << child))) {
+        if (stats) {
+          ++stats->leafs;
+        }
+        intersect_leaf(node.children[child], tmax);
+        hit[child] = false;
+      }
+    }
+
+    if (hit[0] && hit[1]) {
+      const int near = tentry[1] < tentry[0] ? 1 : 0;
+      stack[stack_size++] = { int(node.children[1 - near]), bounds[1 - near].pmin };
+      idx = int(node.children[near]);
+      origin = bounds[near].pmin;
+    } else if (hit[0] || hit[1]) {
+      const int child = hit[0] ? 0 : 1;
+      idx = int(node.children[child]);
+      origin = bounds[child].pmin;
+    } else if (stack_size > 0) {
+      --stack_size;
+      idx = stack[stack_size].idx;
+      origin = stack[stack_size].origin;
+    } else {
+      idx = -1;
+    }
+  }
+  detail::count_ray(stats);
+  return tmax;
+}
+
+// Same for a wide BVH: the children whose bounds the ray hits are visited nearest first, leafs
+// right away and internal nodes from the stack. Callers name the width, as in
+// traverse_wide_bvh<4>(nodes, ...).
+template <int Width, typename IntersectLeaf>
+float traverse_wide_bvh(
+  gsl::span<const WideBvhNode<Width>> nodes,
+  const float3 &o,
+  const float3 &d,
+  float tmax,
+  IntersectLeaf &&intersect_leaf,
+  TraversalStats *stats = nullptr) {
+  if (nodes.empty()) {
+    return tmax;
+  }
+  uint32_t stack[kWideBvhStackSize<Width>];
+  int stack_size = 0;
+  stack[stack_size++] = 0;
+
+  const float3 invdir(1.f / d.x, 1.f / d.y, 1.f / d.z);
+  while (stack_size > 0) {
+    const auto &node = nodes[stack[--stack_size]];
+    detail::count_fetch(stats, &node, sizeof(node));
+
+    // Slab tests of all children at once, laid out for vectorization.
+    float t0[Width];
+    float t1[Width];
+    for (int i = 0; i < Width; ++i) {
+      t0[i] = 0.f;
+      t1[i] = tmax;
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+      for (int i = 0; i < Width; ++i) {
+        const float f = (node.pmax[axis][i] - o[axis]) * invdir[axis];
+        const float n = (node.pmin[axis][i] - o[axis]) * invdir[axis];
+        t0[i] = std::max(t0[i], std::min(f, n));
+        t1[i] = std::min(t1[i], std::max(f, n));
+      }
+    }
+
+    // Hit children sorted by entry distance.
+    int hits[Width];
+    int num_hits = 0;
+    for (int i = 0; i < int(node.num_children); ++i) {
+      if (t1[i] >= t0[i]) {
+        int j = num_hits++;
+        for (; j > 0 && t0[hits[j - 1]] > t0[i]; --j) {
+          hits[j] = hits[j - 1];
+        }
+        hits[j] = i;
+      }
+    }
+
+    // Leafs nearest first, as they shorten the ray; internal children farthest first on the
+    // stack, so that the nearest one is popped next.
+    int internal[Width];
+    int num_internal = 0;
+    for (int j = 0; j < num_hits; ++j) {
+      const int i = hits[j];
+      if (!(node.leaf_mask & (1u << i))) {
+        internal[num_internal++] = i;
+      } else if (t0[i] <= tmax) {
+        if (stats) {
+          ++stats->leafs;
+        }
+        intersect_leaf(node.children[i], tmax);
+      }
+    }
+    for (int j = num_internal - 1; j >= 0; --j) {
+      if (t0[internal[j]] <= tmax) {
+        stack[stack_size++] = node.children[internal[j]];
+      }
+    }
+  }
+  detail::count_ray(stats);
+  return tmax;
+}
+
+} // namespace bvh
@@ -0,0 +1,231 @@
+#include <bvh/treelet_optimizer.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <bvh/bvh_access.h>
+
+namespace bvh {
+
+namespace {
+using bbox = RadeonRays::bbox;
+using Node = BvhAccess::Node;
+
+constexpr int kMaxTreeletLeaves = 8;
+// Below this size the overhead of a task outweighs the work it would offload.
+constexpr int kMinParallelSubtreeLeaves = 4 * 1024;
+
+int lowest_bit_index(uint32_t x) {
+  int idx = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    ++idx;
+  }
+  return idx;
+}
+
+class TreeletOptimizer {
+ public:
+  TreeletOptimizer(std::vector<Node> &nodes, int treelet_leaves, TaskPool &pool)
+    : m_nodes(nodes)
+    , m_leaf_counts(nodes.size())
+    , m_treelet_leaves(std::min(std::max(treelet_leaves, 3), kMaxTreeletLeaves))
+    , m_pool(pool) {}
+
+  void countLeaves(Node *root);
+  // Restructure the treelets of the nodes of the subtree with at least min_leaves leafs.
+  void optimizeSubtree(Node *root, int min_leaves);
+
+ private:
+  int &leafCount(const Node *node) { return m_leaf_counts[node - m_nodes.data()]; }
+  void restructure(Node *root);
+
+  std::vector<Node> &m_nodes;
+  // Number of leafs below each node, by position in m_nodes. Only used to decide which subtrees
+  // are worth a task.
+  std::vector<int> m_leaf_counts;
+  int m_treelet_leaves;
+  TaskPool &m_pool;
+};
+
+void TreeletOptimizer::countLeaves(Node *root) {
+  std::vector<std::pair<Node *, bool>> stack = { { root, false } };
+  while (!stack.empty()) {
+    const auto entry = stack.back();
+    stack.pop_back();
+    Node *node = entry.first;
+    if (node->type == BvhAccess::kLeaf) {
+      leafCount(node) = 1;
+    } else if (!entry.second) {
+      stack.push_back({ node, true });
+      stack.push_back({ node->rc, false });
+      stack.push_back({ node->lc, false });
+    } else {
+      leafCount(node) = leafCount(node->lc) + leafCount(node->rc);
+    }
+  }
+}
+
+void TreeletOptimizer::optimizeSubtree(Node *root, int min_leaves) {
+  if (leafCount(root) < min_leaves) {
+    return;
+  }
+
+  // Large subtrees fork, their halves are disjoint.
+  if (leafCount(root) >= kMinParallelSubtreeLeaves && m_pool.getThreadCount() > 1) {
+    TaskPool::TaskGroup group;
+    Node *right = root->rc;
+    m_pool.run(group, [this, right, min_leaves] { optimizeSubtree(right, min_leaves); });
+    optimizeSubtree(root->lc, min_leaves);
+    m_pool.wait(group);
+    restructure(root);
+    return;
+  }
+
+  // Post-order with an explicit stack, deep trees do not recurse.
+  std::vector<std::pair<Node *, bool>> stack = { { root, false } };
+  while (!stack.empty()) {
+    const auto entry = stack.back();
+    stack.pop_back();
+    Node *node = entry.first;
+    if (leafCount(node) < min_leaves) {
+      continue;
+    }
+    if (!entry.second) {
+      stack.push_back({ node, true });
+      stack.push_back({ node->rc, false });
+      stack.push_back({ node->lc, false });
+    } else {
+      restructure(node);
+    }
+  }
+}
+
+void TreeletOptimizer::restructure(Node *root) {
+  // Grow the treelet by turning its largest internal leaf into an internal node.
+  Node *leaves[kMaxTreeletLeaves] = { root->lc, root->rc };
+  Node *internals[kMaxTreeletLeaves - 1] = { root };
+  int numleaves = 2;
+  int numinternals = 1;
+  while (numleaves < m_treelet_leaves) {
+    int expand = -1;
+    float expand_area = -1.f;
+    for (int i = 0; i < numleaves; ++i) {
+      const float area = leaves[i]->bounds.surface_area();
+      if (leaves[i]->type == BvhAccess::kInternal && area > expand_area) {
+        expand = i;
+        expand_area = area;
+      }
+    }
+    if (expand == -1) {
+      break;
+    }
+    Node *node = leaves[expand];
+    internals[numinternals++] = node;
+    leaves[expand] = node->lc;
+    leaves[numleaves++] = node->rc;
+  }
+  if (numleaves < 3) {
+    return;
+  }
+
+  // With the leafs fixed, the SAH cost of the treelet only depends on the surface area of its
+  // internal nodes.
+  float current_cost = 0.f;
+  for (int i = 0; i < numinternals; ++i) {
+    current_cost += internals[i]->bounds.surface_area();
+  }
+
+  // Optimal cost of every subset of the leafs, built up from the smaller subsets. Partitions are
+  // enumerated with the lowest leaf of the subset on the left to visit each one once.
+  const uint32_t full = (1u << numleaves) - 1;
+  bbox bounds[1 << kMaxTreeletLeaves];
+  float cost[1 << kMaxTreeletLeaves];
+  int counts[1 << kMaxTreeletLeaves];
+  uint32_t partition[1 << kMaxTreeletLeaves];
+  for (uint32_t s = 1; s <= full; ++s) {
+    const uint32_t low = s & (~s + 1);
+    const uint32_t rest = s ^ low;
+    if (rest == 0) {
+      const Node *leaf = leaves[lowest_bit_index(s)];
+      bounds[s] = leaf->bounds;
+      cost[s] = 0.f;
+      counts[s] = leafCount(leaf);
+      continue;
+    }
+    bounds[s] = bounds[rest];
+    bounds[s].grow(bounds[low]);
+    counts[s] = counts[rest] + counts[low];
+
+    float best_cost = std::numeric_limits<float>::max();
+    uint32_t best_partition = low;
+    for (uint32_t sub = (rest - 1) & rest;; sub = (sub - 1) & rest) {
+      const uint32_t left = sub | low;
+      const float partition_cost = cost[left] + cost[s ^ left];
+      if (partition_cost < best_cost) {
+        best_cost = partition_cost;
+        best_partition = left;
+      }
+      if (sub == 0) {
+        break;
+      }
+    }
+    cost[s] = bounds[s].surface_area() + best_cost;
+    partition[s] = best_partition;
+  }
+
+  // The current topology is one of the candidates, ignore rounding level gains.
+  if (!(cost[full] < current_cost * (1.f - 1e-6f))) {
+    return;
+  }
+
+  // Rebuild the treelet from the chosen partitions, reusing its internal nodes. The root keeps
+  // its place, so the parent needs no update.
+  std::pair<uint32_t, Node *> stack[kMaxTreeletLeaves];
+  int stacksize = 0;
+  int nextinternal = 1;
+  stack[stacksize++] = { full, root };
+  while (stacksize > 0) {
+    const auto entry = stack[--stacksize];
+    const uint32_t s = entry.first;
+    Node *node = entry.second;
+    node->bounds = bounds[s];
+    leafCount(node) = counts[s];
+
+    const uint32_t subsets[2] = { partition[s], s ^ partition[s] };
+    Node *children[2];
+    for (int i = 0; i < 2; ++i) {
+      if ((subsets[i] & (subsets[i] - 1)) == 0) {
+        children[i] = leaves[lowest_bit_index(subsets[i])];
+      } else {
+        children[i] = internals[nextinternal++];
+        stack[stacksize++] = { subsets[i], children[i] };
+      }
+    }
+    node->lc = children[0];
+    node->rc = children[1];
+  }
+}
+} // namespace
+
+void optimize_treelets(RadeonRays::Bvh &bvh, int passes, int treelet_leaves, TaskPool &pool) {
+  Node *root = BvhAccess::root(bvh);
+  if (!root || passes <= 0) {
+    return;
+  }
+
+  TreeletOptimizer optimizer(BvhAccess::nodes(bvh), treelet_leaves, pool);
+  optimizer.countLeaves(root);
+  // Small subtrees gain little from more passes; like Karras and Aila, every pass only visits
+  // the nodes with twice as many leafs as the previous one.
+  int min_leaves = std::min(std::max(treelet_leaves, 3), kMaxTreeletLeaves);
+  for (int pass = 0; pass < passes; ++pass) {
+    optimizer.optimizeSubtree(root, min_leaves);
+    min_leaves = min_leaves < (1 << 24) ? 2 * min_leaves : min_leaves;
+  }
+}
+
+} // namespace bvh
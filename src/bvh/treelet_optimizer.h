@@ -0,0 +1,23 @@
+#pragma once
+
+// RadeonRays
+#include <accelerator/bvh.h>
+
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+// Treelet restructuring (Karras and Aila, "Fast Parallel Construction of High-Quality Bounding
+// Volume Hierarchies", HPG 2013).
+// A treelet is grown from an internal node by repeatedly expanding its largest leaf, up to
+// treelet_leaves leafs. Dynamic programming over all subsets of the leafs finds the topology
+// of the treelet with the lowest SAH cost, which replaces the current one if it is cheaper. Every
+// pass visits the nodes bottom-up, so each treelet sees already optimized subtrees below it, and
+// runs disjoint subtrees in parallel. Only internal nodes are rearranged: the leafs, the node
+// count and the root bounds stay the same.
+//
+// Meant to recover the trace performance of the fast builders (lbvh, hlbvh, ploc).
+void optimize_treelets(
+  RadeonRays::Bvh &bvh, int passes, int treelet_leaves = 7, TaskPool &pool = TaskPool::global());
+
+} // namespace bvh
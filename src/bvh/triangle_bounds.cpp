@@ -0,0 +1,294 @@
+#include <bvh/triangle_bounds.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BVH_X86_SIMD 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define BVH_X86_SIMD 0
+#endif
+
+namespace bvh {
+
+namespace {
+template <typename Index>
+int load_index(const IndexStream &indices, int triangle, int corner) {
+  const char *face = static_cast<const char *>(indices.data) + triangle * indices.stride;
+  Index res;
+  std::memcpy(&res, face + corner * sizeof(Index), sizeof(Index));
+  return int(res);
+}
+
+const float *vertex_data(const VertexStream &vertices, int index) {
+  return reinterpret_cast<const float *>(
+    reinterpret_cast<const char *>(vertices.data) + index * vertices.stride);
+}
+
+#if BVH_X86_SIMD
+#ifdef __GNUC__
+#define BVH_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define BVH_TARGET_AVX2
+#endif
+
+bool has_avx2() {
+#ifdef __GNUC__
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  // The OS has to save the AVX registers.
+  __cpuid(info, 1);
+  const bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28));
+  if (!avx || (_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#endif
+}
+
+// xyz of a vertex with w 0. Strides of 12 bytes can not read 16, the last vertex would overrun
+// the buffer.
+inline __m128 load_vertex(const VertexStream &vertices, int index) {
+  const float *p = vertex_data(vertices, index);
+  if (vertices.stride >= 4 * sizeof(float)) {
+    return _mm_and_ps(_mm_loadu_ps(p), _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0)));
+  }
+  const __m128 xy = _mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double *>(p)));
+  return _mm_movelh_ps(xy, _mm_load_ss(p + 2));
+}
+
+// Columns of transform with w 0, so that transformed points keep w 0.
+struct SseTransform {
+  __m128 columns[4];
+};
+
+inline SseTransform load_transform(const RadeonRays::matrix &m) {
+  SseTransform res;
+  for (int j = 0; j < 4; ++j) {
+    res.columns[j] = _mm_setr_ps(m.m[0][j], m.m[1][j], m.m[2][j], 0.f);
+  }
+  return res;
+}
+
+inline __m128 transform_vertex(const SseTransform &m, __m128 p) {
+  const __m128 x = _mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0));
+  const __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1));
+  const __m128 z = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2));
+  return _mm_add_ps(
+    _mm_add_ps(_mm_add_ps(_mm_mul_ps(m.columns[0], x), _mm_mul_ps(m.columns[1], y)),
+               _mm_mul_ps(m.columns[2], z)),
+    m.columns[3]);
+}
+
+// Centroid bounds are accumulated as pmin + pmax and halved at the end.
+struct SseBounds {
+  __m128 lo = _mm_set1_ps(std::numeric_limits<float>::max());
+  __m128 hi = _mm_set1_ps(-std::numeric_limits<float>::max());
+  __m128 centroid_lo = lo;
+  __m128 centroid_hi = hi;
+};
+
+template <typename Index>
+void triangle_bounds_sse(
+  const VertexStream &vertices,
+  const IndexStream &indices,
+  const RadeonRays::matrix *transform,
+  int begin,
+  int end,
+  bbox *out_bounds,
+  SseBounds &bounds) {
+  const SseTransform m = load_transform(transform ? *transform : RadeonRays::matrix());
+  for (int i = begin; i < end; ++i) {
+    __m128 v[3];
+    for (int corner = 0; corner < 3; ++corner) {
+      v[corner] = load_vertex(vertices, load_index<Index>(indices, i, corner));
+      if (transform) {
+        v[corner] = transform_vertex(m, v[corner]);
+      }
+    }
+    const __m128 pmin = _mm_min_ps(_mm_min_ps(v[0], v[1]), v[2]);
+    const __m128 pmax = _mm_max_ps(_mm_max_ps(v[0], v[1]), v[2]);
+    _mm_storeu_ps(&out_bounds[i].pmin.x, pmin);
+    _mm_storeu_ps(&out_bounds[i].pmax.x, pmax);
+    const __m128 centroid = _mm_add_ps(pmin, pmax);
+    bounds.lo = _mm_min_ps(bounds.lo, pmin);
+    bounds.hi = _mm_max_ps(bounds.hi, pmax);
+    bounds.centroid_lo = _mm_min_ps(bounds.centroid_lo, centroid);
+    bounds.centroid_hi = _mm_max_ps(bounds.centroid_hi, centroid);
+  }
+}
+
+// Lower and upper half of x folded by min or max.
+BVH_TARGET_AVX2 inline __m128 min_halves(__m256 x) {
+  return _mm_min_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+}
+BVH_TARGET_AVX2 inline __m128 max_halves(__m256 x) {
+  return _mm_max_ps(_mm256_castps256_ps128(x), _mm256_extractf128_ps(x, 1));
+}
+
+// Two triangles at a time, one per 128-bit half. Gathering the vertices of 8 triangles per axis
+// instead is slower than SSE: the gathers cost more than the loads they replace.
+template <typename Index>
+BVH_TARGET_AVX2 void triangle_bounds_avx2(
+  const VertexStream &vertices,
+  const IndexStream &indices,
+  const RadeonRays::matrix *transform,
+  int begin,
+  int end,
+  bbox *out_bounds,
+  SseBounds &bounds) {
+  const SseTransform m = load_transform(transform ? *transform : RadeonRays::matrix());
+  __m256 columns[4];
+  for (int j = 0; j < 4; ++j) {
+    columns[j] = _mm256_broadcast_ps(&m.columns[j]);
+  }
+  __m256 lo = _mm256_set1_ps(std::numeric_limits<float>::max());
+  __m256 hi = _mm256_set1_ps(-std::numeric_limits<float>::max());
+  __m256 centroid_lo = lo;
+  __m256 centroid_hi = hi;
+
+  int i = begin;
+  for (; i + 2 <= end; i += 2) {
+    __m256 v[3];
+    for (int corner = 0; corner < 3; ++corner) {
+      v[corner] = _mm256_set_m128(
+        load_vertex(vertices, load_index<Index>(indices, i + 1, corner)),
+        load_vertex(vertices, load_index<Index>(indices, i, corner)));
+      if (transform) {
+        const __m256 x = _mm256_permute_ps(v[corner], _MM_SHUFFLE(0, 0, 0, 0));
+        const __m256 y = _mm256_permute_ps(v[corner], _MM_SHUFFLE(1, 1, 1, 1));
+        const __m256 z = _mm256_permute_ps(v[corner], _MM_SHUFFLE(2, 2, 2, 2));
+        v[corner] = _mm256_add_ps(
+          _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(columns[0], x), _mm256_mul_ps(columns[1], y)),
+            _mm256_mul_ps(columns[2], z)),
+          columns[3]);
+      }
+    }
+    const __m256 pmin = _mm256_min_ps(_mm256_min_ps(v[0], v[1]), v[2]);
+    const __m256 pmax = _mm256_max_ps(_mm256_max_ps(v[0], v[1]), v[2]);
+    _mm_storeu_ps(&out_bounds[i].pmin.x, _mm256_castps256_ps128(pmin));
+    _mm_storeu_ps(&out_bounds[i].pmax.x, _mm256_castps256_ps128(pmax));
+    _mm_storeu_ps(&out_bounds[i + 1].pmin.x, _mm256_extractf128_ps(pmin, 1));
+    _mm_storeu_ps(&out_bounds[i + 1].pmax.x, _mm256_extractf128_ps(pmax, 1));
+    const __m256 centroid = _mm256_add_ps(pmin, pmax);
+    lo = _mm256_min_ps(lo, pmin);
+    hi = _mm256_max_ps(hi, pmax);
+    centroid_lo = _mm256_min_ps(centroid_lo, centroid);
+    centroid_hi = _mm256_max_ps(centroid_hi, centroid);
+  }
+
+  // The SSE accumulators take the last triangle.
+  bounds.lo = _mm_min_ps(bounds.lo, min_halves(lo));
+  bounds.hi = _mm_max_ps(bounds.hi, max_halves(hi));
+  bounds.centroid_lo = _mm_min_ps(bounds.centroid_lo, min_halves(centroid_lo));
+  bounds.centroid_hi = _mm_max_ps(bounds.centroid_hi, max_halves(centroid_hi));
+  triangle_bounds_sse<Index>(vertices, indices, transform, i, end, out_bounds, bounds);
+}
+
+template <typename Index>
+void triangle_bounds_chunk(
+  const VertexStream &vertices,
+  const IndexStream &indices,
+  const RadeonRays::matrix *transform,
+  int begin,
+  int end,
+  bbox *out_bounds,
+  bool use_avx2,
+  TriangleBounds &out_result) {
+  SseBounds bounds;
+  if (use_avx2) {
+    triangle_bounds_avx2<Index>(vertices, indices, transform, begin, end, out_bounds, bounds);
+  } else {
+    triangle_bounds_sse<Index>(vertices, indices, transform, begin, end, out_bounds, bounds);
+  }
+  const auto to_float3 = [](__m128 x, float scale) {
+    alignas(16) float res[4];
+    _mm_store_ps(res, _mm_mul_ps(x, _mm_set1_ps(scale)));
+    return float3(res[0], res[1], res[2]);
+  };
+  out_result.bounds.pmin = to_float3(bounds.lo, 1.f);
+  out_result.bounds.pmax = to_float3(bounds.hi, 1.f);
+  out_result.centroid_bounds.pmin = to_float3(bounds.centroid_lo, 0.5f);
+  out_result.centroid_bounds.pmax = to_float3(bounds.centroid_hi, 0.5f);
+}
+#else
+template <typename Index>
+void triangle_bounds_chunk(
+  const VertexStream &vertices,
+  const IndexStream &indices,
+  const RadeonRays::matrix *transform,
+  int begin,
+  int end,
+  bbox *out_bounds,
+  bool /*use_avx2*/,
+  TriangleBounds &out_result) {
+  for (int i = begin; i < end; ++i) {
+    bbox box;
+    for (int corner = 0; corner < 3; ++corner) {
+      const float *p = vertex_data(vertices, load_index<Index>(indices, i, corner));
+      const float3 vertex(p[0], p[1], p[2]);
+      box.grow(transform ? transform_point(vertex, *transform) : vertex);
+    }
+    out_bounds[i] = box;
+    out_result.bounds.grow(box);
+    out_result.centroid_bounds.grow(box.center());
+  }
+}
+#endif
+} // namespace
+
+bool has_triangle_bounds_simd(TriangleBoundsSimd simd) {
+#if BVH_X86_SIMD
+  static const bool cpu_avx2 = has_avx2();
+  return simd != kTriangleBoundsAvx2 || cpu_avx2;
+#else
+  return simd == kTriangleBoundsBest;
+#endif
+}
+
+TriangleBounds compute_triangle_bounds(
+  const VertexStream &vertices,
+  const IndexStream &indices,
+  int num_triangles,
+  gsl::span<bbox> out_bounds,
+  const RadeonRays::matrix *transform,
+  TaskPool &pool,
+  TriangleBoundsSimd simd) {
+  assert(has_triangle_bounds_simd(simd));
+  const bool use_avx2 = simd == kTriangleBoundsAvx2 ||
+    (simd == kTriangleBoundsBest && has_triangle_bounds_simd(kTriangleBoundsAvx2));
+  TriangleBounds res;
+  std::mutex res_mutex;
+  pool.parallelFor(0, num_triangles, kParallelForGrain, [&](int begin, int end) {
+    TriangleBounds local;
+    if (indices.index_size == 2) {
+      triangle_bounds_chunk<uint16_t>(
+        vertices, indices, transform, begin, end, out_bounds.data(), use_avx2, local);
+    } else {
+      triangle_bounds_chunk<uint32_t>(
+        vertices, indices, transform, begin, end, out_bounds.data(), use_avx2, local);
+    }
+    std::lock_guard<std::mutex> lock(res_mutex);
+    res.bounds.grow(local.bounds);
+    res.centroid_bounds.grow(local.centroid_bounds);
+  });
+  return res;
+}
+
+} // namespace bvh
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+
+#include <gsl/span>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+// Vertex positions: xyz floats at the start of every stride bytes.
+struct VertexStream {
+  const float *data;
+  size_t stride;
+};
+
+// Triangles: three vertex indices of index_size bytes (2 or 4) at the start of every stride
+// bytes, so that 16-bit and 32-bit index buffers and RadeonRays::Mesh::Face are read in place.
+struct IndexStream {
+  const void *data;
+  int index_size;
+  size_t stride;
+};
+
+// Bounds of a set of triangles and of their centroids (bounds centers).
+struct TriangleBounds {
+  bbox bounds;
+  bbox centroid_bounds;
+};
+
+// Instruction sets of compute_triangle_bounds. Other than x86 CPUs only have the best one, a
+// scalar loop.
+enum TriangleBoundsSimd {
+  // AVX2 on CPUs that have it, else SSE.
+  kTriangleBoundsBest,
+  kTriangleBoundsSse,
+  kTriangleBoundsAvx2,
+};
+
+// Whether compute_triangle_bounds can run simd on this CPU.
+bool has_triangle_bounds_simd(TriangleBoundsSimd simd);
+
+// Bounds of num_triangles triangles into out_bounds, the leaf bounds of a BVH over them, of the
+// vertices transformed by transform if it is not null. Chunks of triangles run in parallel, two
+// triangles per AVX2 register on CPUs that have AVX2, else one per SSE register, picked at run
+// time unless simd says otherwise. Bounds are exact, the minimum and maximum of the
+// (transformed) vertices, with w 0.
+// @pre has_triangle_bounds_simd(simd)
+TriangleBounds compute_triangle_bounds(
+  const VertexStream &vertices,
+  const IndexStream &indices,
+  int num_triangles,
+  gsl::span<bbox> out_bounds,
+  const RadeonRays::matrix *transform = nullptr,
+  TaskPool &pool = TaskPool::global(),
+  TriangleBoundsSimd simd = kTriangleBoundsBest);
+
+} // namespace bvh
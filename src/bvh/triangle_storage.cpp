@@ -0,0 +1,73 @@
+#include <bvh/triangle_storage.h>
+
+#include <cmath>
+
+#include <bvh/task_pool.h>
+
+namespace bvh {
+
+namespace {
+struct double3 {
+  double x, y, z;
+};
+
+double3 sub(const double3 &a, const double3 &b) {
+  return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+double3 cross(const double3 &a, const double3 &b) {
+  return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x };
+}
+
+double dot(const double3 &a, const double3 &b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+// Rows of the inverse of the matrix with the columns e1, e2 and n, which maps v0 + e1 to x = 1,
+// v0 + e2 to y = 1 and the plane of the triangle to z = 0, in double precision for thin
+// triangles. Degenerate triangles get rows that no ray hits.
+void woop_transform(const double3 v[3], float3 out_rows[3]) {
+  const double3 e1 = sub(v[1], v[0]);
+  const double3 e2 = sub(v[2], v[0]);
+  const double3 n = cross(e1, e2);
+  const double det = dot(e1, cross(e2, n));
+  if (!(std::abs(det) > 0.0)) {
+    for (int i = 0; i < 3; ++i) {
+      out_rows[i] = float3(0.f, 0.f, 0.f, -1.f);
+    }
+    return;
+  }
+  // The rows of the inverse are the cross products of the other columns over the determinant.
+  const double3 rows[3] = { cross(e2, n), cross(n, e1), cross(e1, e2) };
+  for (int i = 0; i < 3; ++i) {
+    const double3 r = { rows[i].x / det, rows[i].y / det, rows[i].z / det };
+    out_rows[i] = float3(float(r.x), float(r.y), float(r.z), float(-dot(r, v[0])));
+  }
+}
+} // namespace
+
+std::vector<float3> pack_triangles(
+  gsl::span<const float> vertices, gsl::span<const int> indices, TriangleFormat format) {
+  const int numtris = int(indices.size() / 3);
+  std::vector<float3> res(size_t(numtris) * kPackedTriangleSize);
+  TaskPool::global().parallelFor(0, numtris, kParallelForGrain, [&](int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+      double3 v[3];
+      for (int j = 0; j < 3; ++j) {
+        const float *p = &vertices[3 * indices[3 * i + j]];
+        v[j] = { p[0], p[1], p[2] };
+      }
+      float3 *out = &res[size_t(i) * kPackedTriangleSize];
+      if (format == kTrianglesWoop) {
+        woop_transform(v, out);
+      } else {
+        for (int j = 0; j < 3; ++j) {
+          out[j] = float3(float(v[j].x), float(v[j].y), float(v[j].z), 0.f);
+        }
+      }
+    }
+  });
+  return res;
+}
+
+} // namespace bvh
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <gsl/span>
+
+#include <bvh/bvh_builder.h>
+
+namespace bvh {
+
+// Storage of the triangles the leafs reference, BVH_TRIANGLE_FORMAT in bvh.glslh.
+// The indexed format is an index triple per triangle into a shared vertex array, the smallest
+// for meshes whose vertices are shared by about six triangles, as usual. A leaf test then
+// fetches three indices and nine floats from wherever the vertices are. The other formats store
+// every triangle as kPackedTriangleSize float4 in leaf order, so the triangles of a leaf are a
+// single contiguous run. They take about twice the memory of an indexed mesh.
+enum TriangleFormat {
+  kTrianglesIndexed,
+  // The three vertices, tested by the watertight test like the indexed format.
+  kTrianglesInline,
+  // The rows of the affine transform to the unit triangle (Woop, "A Ray Tracing Hardware
+  // Architecture for Dynamic Scenes", 2004): the hit distance comes from the last row, and most
+  // misses are rejected before the other two are loaded. Not watertight.
+  kTrianglesWoop,
+};
+
+// float4 per triangle of the packed formats.
+constexpr int kPackedTriangleSize = 3;
+
+// Pack the triangles of indices (three per triangle, in leaf order) into vertices (xyz triples)
+// in format, which is not kTrianglesIndexed. The w components are 0 for the inline vertices.
+std::vector<float3> pack_triangles(
+  gsl::span<const float> vertices, gsl::span<const int> indices, TriangleFormat format);
+
+// Bytes taken by num_triangles triangles over num_vertices vertices in format.
+inline size_t triangle_storage_bytes(
+  TriangleFormat format, size_t num_triangles, size_t num_vertices) {
+  if (format == kTrianglesIndexed) {
+    return num_triangles * 3 * sizeof(int) + num_vertices * 3 * sizeof(float);
+  }
+  return num_triangles * kPackedTriangleSize * sizeof(float3);
+}
+
+// Intersection test of a triangle in the Woop format, like IntersectTriangleWoop in bvh.glslh.
+// On a hit closer than tmax, lowers tmax to it and returns the barycentric coordinates of the
+// second and third vertex.
+inline bool intersect_woop_triangle(
+  const float3 *triangle, const float3 &o, const float3 &d, float &tmax, float &u, float &v) {
+  const auto row = [](const float3 &m, const float3 &p) {
+    return m.x * p.x + m.y * p.y + m.z * p.z + m.w;
+  };
+  const auto &m2 = triangle[2];
+  const float dz = m2.x * d.x + m2.y * d.y + m2.z * d.z;
+  const float t = -row(m2, o) / dz;
+  if (!(t > 0.f && t < tmax)) {
+    return false;
+  }
+  const float3 p(o.x + t * d.x, o.y + t * d.y, o.z + t * d.z);
+  const float hit_u = row(triangle[0], p);
+  if (hit_u < 0.f || hit_u > 1.f) {
+    return false;
+  }
+  const float hit_v = row(triangle[1], p);
+  if (hit_v < 0.f || hit_u + hit_v > 1.f) {
+    return false;
+  }
+  tmax = t;
+  u = hit_u;
+  v = hit_v;
+  return true;
+}
+
+} // namespace bvh
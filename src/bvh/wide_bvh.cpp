@@ -0,0 +1,180 @@
+#include <bvh/wide_bvh.h>
+
+#include "bvh_access.h"
+
+namespace bvh {
+
+namespace {
+// The binary trees collapse_bvh reads, as handles to their nodes.
+struct RadeonRaysTree {
+  using Ref = const BvhAccess::Node *;
+
+  const int *indices;
+
+  bool isLeaf(Ref node) const { return node->type == BvhAccess::kLeaf; }
+  const bbox &bounds(Ref node) const { return node->bounds; }
+  Ref left(Ref node) const { return node->lc; }
+  Ref right(Ref node) const { return node->rc; }
+  uint32_t payload(Ref node) const { return uint32_t(indices[node->startidx]); }
+};
+
+struct SkipLinksTree {
+  using Ref = int;
+
+  gsl::span<const bbox> nodes;
+
+  bool isLeaf(Ref node) const { return is_leaf_node(nodes[node]); }
+  const bbox &bounds(Ref node) const { return nodes[node]; }
+  Ref left(Ref node) const { return node + 1; }
+  Ref right(Ref node) const { return decode_index(nodes[node + 1].pmax.w); }
+  uint32_t payload(Ref node) const { return uint32_t(decode_index(nodes[node].pmin.w)); }
+};
+
+template <int Width, typename Tree>
+std::vector<WideBvhNode<Width>> collapse(const Tree &tree, typename Tree::Ref root) {
+  using Ref = typename Tree::Ref;
+  std::vector<WideBvhNode<Width>> res;
+
+  // Depth-first with an explicit stack. Every entry knows the slot of its parent that references
+  // it, and how many stack entries the traversal can have below it.
+  struct StackEntry {
+    Ref node;
+    int parent;
+    int slot;
+    int pending;
+  };
+  std::vector<StackEntry> stack = { { root, -1, 0, 0 } };
+  while (!stack.empty()) {
+    const StackEntry entry = stack.back();
+    stack.pop_back();
+
+    // Open the internal child with the largest surface area until the slots are full. The
+    // children stay in tree order.
+    Ref children[Width];
+    int count = 0;
+    if (tree.isLeaf(entry.node)) {
+      children[count++] = entry.node;
+    } else {
+      children[count++] = tree.left(entry.node);
+      children[count++] = tree.right(entry.node);
+    }
+    while (count < Width) {
+      int best = -1;
+      float best_area = -1.f;
+      for (int i = 0; i < count; ++i) {
+        const float area = tree.bounds(children[i]).surface_area();
+        if (!tree.isLeaf(children[i]) && area > best_area) {
+          best = i;
+          best_area = area;
+        }
+      }
+      if (best == -1) {
+        break;
+      }
+      const Ref opened = children[best];
+      for (int i = count; i > best + 1; --i) {
+        children[i] = children[i - 1];
+      }
+      children[best] = tree.left(opened);
+      children[best + 1] = tree.right(opened);
+      ++count;
+    }
+
+    const int idx = int(res.size());
+    if (entry.parent != -1) {
+      res[entry.parent].children[entry.slot] = uint32_t(idx);
+    }
+    res.emplace_back();
+    auto &out = res.back();
+    out.num_children = uint32_t(count);
+    int num_internal = 0;
+    for (int i = 0; i < Width; ++i) {
+      out.children[i] = kInvalidIndex;
+    }
+    for (int i = 0; i < count; ++i) {
+      const bbox &bounds = tree.bounds(children[i]);
+      for (int axis = 0; axis < 3; ++axis) {
+        out.pmin[axis][i] = bounds.pmin[axis];
+        out.pmax[axis][i] = bounds.pmax[axis];
+      }
+      if (tree.isLeaf(children[i])) {
+        out.leaf_mask |= 1u << i;
+        out.children[i] = tree.payload(children[i]);
+      } else {
+        ++num_internal;
+      }
+    }
+
+    // The traversal pushes all internal children before taking the nearest one.
+    if (entry.pending + num_internal > kWideBvhStackSize<Width>) {
+      res.clear();
+      return res;
+    }
+    // Last child first so that the first one comes next.
+    for (int i = count - 1; i >= 0; --i) {
+      if (!(out.leaf_mask & (1u << i))) {
+        stack.push_back({ children[i], idx, i, entry.pending + num_internal - 1 });
+      }
+    }
+  }
+  return res;
+}
+} // namespace
+
+template <int Width>
+std::vector<WideBvhNode<Width>> collapse_bvh(const Bvh &bvh) {
+  const auto *root = BvhAccess::root(bvh);
+  if (!root) {
+    return {};
+  }
+  return collapse<Width>(RadeonRaysTree{ bvh.GetIndices() }, root);
+}
+
+template <int Width>
+std::vector<WideBvhNode<Width>> collapse_bvh(gsl::span<const bbox> nodes) {
+  if (nodes.empty()) {
+    return {};
+  }
+  return collapse<Width>(SkipLinksTree{ nodes }, 0);
+}
+
+template <int Width>
+float calc_sah_cost(
+  gsl::span<const WideBvhNode<Width>> nodes,
+  float traversal_cost,
+  float intersection_cost,
+  int max_leaf_size) {
+  if (nodes.empty()) {
+    return 0.f;
+  }
+  // Every node costs the area of the binary node it was collapsed from, the union of its
+  // children.
+  double cost = 0.0;
+  double root_area = 0.0;
+  for (const auto &node : nodes) {
+    bbox bounds;
+    for (int i = 0; i < int(node.num_children); ++i) {
+      const bbox child = child_bounds(node, i);
+      bounds.grow(child);
+      if (node.leaf_mask & (1u << i)) {
+        const int numprims =
+          max_leaf_size > 1 ? leaf_range_count(encode_index(node.children[i])) : 1;
+        cost += double(child.surface_area()) * intersection_cost * float(numprims);
+      }
+    }
+    cost += double(bounds.surface_area()) * traversal_cost;
+    if (&node == &nodes[0]) {
+      root_area = bounds.surface_area();
+    }
+  }
+  return float(cost / root_area);
+}
+
+template std::vector<WideBvhNode<4>> collapse_bvh<4>(const Bvh &);
+template std::vector<WideBvhNode<8>> collapse_bvh<8>(const Bvh &);
+template std::vector<WideBvhNode<4>> collapse_bvh<4>(gsl::span<const bbox>);
+template std::vector<WideBvhNode<8>> collapse_bvh<8>(gsl::span<const bbox>);
+template float calc_sah_cost<4>(gsl::span<const WideBvhNode<4>>, float, float, int);
+template float calc_sah_cost<8>(gsl::span<const WideBvhNode<8>>, float, float, int);
+
+} // namespace bvh
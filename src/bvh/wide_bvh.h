@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <gsl/span>
+
+#include <bvh/bvh_builder.h>
+
+namespace bvh {
+
+// Wide BVH whose nodes hold the bounds of up to Width children, collapsed from a binary tree in
+// the spirit of Wald et al., "Getting Rid of Packets", RT 2008: a node is opened into its parent
+// as long as the parent has free child slots, the one with the largest surface area first, as
+// it is the most likely to be hit and so saves the most traversal steps by the SAH.
+// The child bounds are stored per axis (structure of arrays), so that a ray is tested against
+// all of them with SIMD instructions, or as vec4 on GPUs for Width 4 (see BVH_WIDE_NODES in
+// bvh.glslh). Nodes are in depth-first order, the first internal child right after its parent.
+// The traversal keeps a stack of the children still to visit (see traverse_wide_bvh), which
+// limits the tree to kWideBvhStackSize<Width> pending children.
+template <int Width>
+struct alignas(64) WideBvhNode {
+  static_assert(Width >= 2 && Width <= 32, "leaf_mask has a bit per child");
+
+  // Bounds of the children, slots from num_children on are zero.
+  float pmin[3][Width];
+  float pmax[3][Width];
+  // Node index of internal children, leaf payload (see bvh_builder.h) of leaf children,
+  // kInvalidIndex for unused slots.
+  uint32_t children[Width];
+  // Bit i set for leaf children.
+  uint32_t leaf_mask;
+  uint32_t num_children;
+};
+static_assert(sizeof(WideBvhNode<4>) == 128, "WideBvhNode<4> is read as 8 vec4 by shaders");
+static_assert(sizeof(WideBvhNode<8>) == 256, "");
+
+// Stack entries of the traversal, 64 for Width 4, which must match BVH_STACK_SIZE in bvh.glslh.
+template <int Width>
+constexpr int kWideBvhStackSize = 16 * Width;
+
+// Collapse the tree of a built RadeonRays::Bvh. Leaf payloads are primitive indices, as in the
+// skip-links BVH translated from it. The root is node 0, a root leaf becomes the only child of
+// node 0. Returns an empty vector for an empty tree, or if the traversal could need more than
+// kWideBvhStackSize<Width> stack entries.
+template <int Width>
+std::vector<WideBvhNode<Width>> collapse_bvh(const Bvh &bvh);
+
+// Same for a skip-links BVH built by build_bvh, keeping its leaf payloads, which can be ranges
+// of primitives.
+template <int Width>
+std::vector<WideBvhNode<Width>> collapse_bvh(gsl::span<const bbox> nodes);
+
+// SAH cost of a wide BVH, normalized like the one of skip-links BVHs: traversal_cost per node
+// visited, intersection_cost per leaf child. max_leaf_size > 1 for leafs holding primitive
+// ranges.
+template <int Width>
+float calc_sah_cost(
+  gsl::span<const WideBvhNode<Width>> nodes,
+  float traversal_cost = 1.f,
+  float intersection_cost = 1.f,
+  int max_leaf_size = 1);
+
+// Bounds of a child of node.
+template <int Width>
+inline bbox child_bounds(const WideBvhNode<Width> &node, int child) {
+  bbox res;
+  for (int axis = 0; axis < 3; ++axis) {
+    res.pmin[axis] = node.pmin[axis][child];
+    res.pmax[axis] = node.pmax[axis][child];
+  }
+  return res;
+}
+
+} // namespace bvh
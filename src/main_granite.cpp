@@ -1,10 +1,13 @@
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <unordered_map>
 
 #include <algorithm>
+#include <chrono>
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
@@ -14,7 +17,15 @@
 
 #include <tiny_obj_loader.h>
 
+#include <bvh/RadeonRays/intersector_skip_links.h>
 #include <bvh/bvh_builder.h>
+#include <bvh/bvh_cache.h>
+#include <bvh/compressed_bvh.h>
+#include <bvh/presplit.h>
+#include <bvh/quantized_vertices.h>
+#include <bvh/triangle_bounds.h>
+#include <bvh/triangle_storage.h>
+#include <bvh/wide_bvh.h>
 
 #ifndef NOMINMAX
 #define NOMINMAX
@@ -108,11 +119,181 @@ struct GlobalData {
 
 struct BvhData {
   std::vector<bvh::bbox> bvh_nodes;
+  // Uploaded instead of bvh_nodes with BVH_COMPRESSED_NODES.
+  std::vector<bvh::CompressedBvhNode> bvh_compressed_nodes;
+  // Uploaded instead of bvh_nodes with BVH_WIDE_NODES.
+  std::vector<bvh::WideBvhNode<4>> bvh_wide_nodes;
+  // Trees too deep for the stack of the compressed or wide node traversal upload bvh_nodes, and
+  // the shaders are built with BVH_COMPRESSED_NODES and BVH_WIDE_NODES off. Such BVHs are not
+  // cached.
+  bool binary_nodes = false;
+  // Meshes with more triangles than leaf ranges can address get single triangle leafs, and the
+  // shaders are built with BVH_MAX_LEAF_SIZE 1. Such BVHs are not cached either.
+  bool single_triangle_leafs = false;
   std::vector<float> bvh_vtx;
   std::vector<int> bvh_idx;
+  // Uploaded instead of bvh_idx with short_indices, padded to whole uints.
+  std::vector<uint16_t> bvh_short_idx;
+  // Faces as 16-bit indices, see BVH_SHORT_INDICES in bvh.glslh.
+  bool short_indices = false;
+  // Uploaded instead of bvh_vtx and bvh_idx with a packed BVH_TRIANGLE_FORMAT.
+  std::vector<bvh::float3> bvh_triangles;
+  // Uploaded instead of bvh_vtx with BVH_QUANTIZED_VERTICES.
+  std::vector<uint32_t> bvh_quantized_vtx;
+  // Mapped cache file the buffers are uploaded from when the BVH was not built, see
+  // load_bvh_cache. The vectors above are empty then.
+  std::unique_ptr<File> cache_file;
+  bvh::BvhCacheContents cache_contents;
 };
 
+// Buffers uploaded by init_device_data: the nodes in the format the shaders read, the vertices
+// and the triangle indices, or the packed triangles and no indices.
+bvh::BvhCacheContents get_bvh_buffers(const BvhData &bvh) {
+  if (bvh.cache_file) {
+    return bvh.cache_contents;
+  }
+  bvh::BvhCacheContents res;
+#if BVH_COMPRESSED_NODES
+  res.sections[bvh::kBvhCacheNodes] = bvh.binary_nodes
+                                        ? gsl::as_bytes(gsl::make_span(bvh.bvh_nodes))
+                                        : gsl::as_bytes(gsl::make_span(bvh.bvh_compressed_nodes));
+#elif BVH_WIDE_NODES
+  res.sections[bvh::kBvhCacheNodes] = bvh.binary_nodes
+                                        ? gsl::as_bytes(gsl::make_span(bvh.bvh_nodes))
+                                        : gsl::as_bytes(gsl::make_span(bvh.bvh_wide_nodes));
+#else
+  res.sections[bvh::kBvhCacheNodes] = gsl::as_bytes(gsl::make_span(bvh.bvh_nodes));
+#endif
+#if BVH_TRIANGLE_FORMAT
+  res.sections[bvh::kBvhCacheVertices] = gsl::as_bytes(gsl::make_span(bvh.bvh_triangles));
+#elif BVH_QUANTIZED_VERTICES
+  res.sections[bvh::kBvhCacheVertices] = gsl::as_bytes(gsl::make_span(bvh.bvh_quantized_vtx));
+#else
+  res.sections[bvh::kBvhCacheVertices] = gsl::as_bytes(gsl::make_span(bvh.bvh_vtx));
+#endif
+#if !BVH_TRIANGLE_FORMAT
+  res.sections[bvh::kBvhCacheIndices] = bvh.short_indices
+                                          ? gsl::as_bytes(gsl::make_span(bvh.bvh_short_idx))
+                                          : gsl::as_bytes(gsl::make_span(bvh.bvh_idx));
+#endif
+  return res;
+}
+
+static_assert(
+  BVH_MAX_LEAF_SIZE >= 1 && BVH_MAX_LEAF_SIZE <= bvh::kMaxLeafSize,
+  "BVH_MAX_LEAF_SIZE does not fit the count of leaf ranges");
+
+// Triangles per leaf the payloads of the nodes of bvh are packed for, see bvh.max_leaf_size.
+int get_bvh_max_leaf_size(const BvhData &bvh) {
+  return bvh.single_triangle_leafs ? 1 : BVH_MAX_LEAF_SIZE;
+}
+
+// Extra BVH references per triangle made by splitting the bounds of large triangles, see
+// presplit_triangles. 0 disables the splits.
+constexpr float kBvhPresplitBudget = 0.3f;
+
+// Whether the faces of mesh are uploaded as 16-bit indices: 16-bit glTF indices stay 16-bit, and
+// so do the indices of any mesh they can address.
+bool use_bvh_short_indices(const SceneFormats::Mesh &mesh) {
+  const size_t vertex_count = mesh.positions.size() / mesh.position_stride;
+  return mesh.index_type == VK_INDEX_TYPE_UINT16 ||
+         vertex_count <= size_t(RadeonRays::kMaxShortFaceVertices);
+}
+
+// Key of the BVH cache file of mesh: everything the uploaded buffers depend on.
+uint64_t hash_bvh_inputs(const SceneFormats::Mesh &mesh, const bvh::BvhOptions &options) {
+  const uint32_t formats[] = { uint32_t(mesh.position_stride), uint32_t(mesh.index_type),
+                               BVH_MAX_LEAF_SIZE, BVH_COMPRESSED_NODES, BVH_WIDE_NODES,
+                               BVH_TRIANGLE_FORMAT, BVH_QUANTIZED_VERTICES };
+  uint64_t hash = bvh::hash_bytes(formats, sizeof(formats));
+  hash = bvh::hash_bytes(&kBvhPresplitBudget, sizeof(kBvhPresplitBudget), hash);
+  hash = bvh::hash_bytes(mesh.positions.data(), mesh.positions.size(), hash);
+  hash = bvh::hash_bytes(mesh.indices.data(), mesh.indices.size(), hash);
+  return bvh::hash_bvh_options(options, hash);
+}
+
+std::string get_bvh_cache_path(uint64_t key) {
+  char name[64];
+  snprintf(name, sizeof(name), "cache://bvh_%016llx.bin", (unsigned long long)key);
+  return name;
+}
+
+// Map the BVH cache file of key into out_bvh, if there is a valid one.
+bool load_bvh_cache(uint64_t key, BvhData &out_bvh) {
+  const auto path = get_bvh_cache_path(key);
+  FileStat stat;
+  if (!Global::filesystem()->stat(path, stat) || stat.type != PathType::File) {
+    return false;
+  }
+  auto file = Global::filesystem()->open(path, FileMode::ReadOnly);
+  const void *data = file ? file->map() : nullptr;
+  bvh::BvhCacheContents contents;
+  if (!data || !bvh::read_bvh_cache(data, file->get_size(), key, contents)) {
+    LOGW("Ignoring invalid BVH cache %s", path.c_str());
+    return false;
+  }
+  out_bvh.cache_file = std::move(file);
+  out_bvh.cache_contents = contents;
+  return true;
+}
+
+// Write the buffers of bvh to the BVH cache file of key, unless it has no nodes to upload.
+void save_bvh_cache(uint64_t key, const BvhData &bvh) {
+  const auto path = get_bvh_cache_path(key);
+  const auto contents = get_bvh_buffers(bvh);
+  if (contents.sections[bvh::kBvhCacheNodes].empty()) {
+    LOGW("Not writing BVH cache %s without nodes", path.c_str());
+    return;
+  }
+  auto file = Global::filesystem()->open(path, FileMode::WriteOnly);
+  void *data = file ? file->map_write(bvh::bvh_cache_file_size(contents)) : nullptr;
+  if (!data) {
+    LOGW("Failed to write BVH cache %s", path.c_str());
+    return;
+  }
+  bvh::write_bvh_cache(contents, key, data);
+  file->unmap();
+}
+
+// Log build time and quality of the available BVH builders on the same leafs.
+void log_bvh_builder_comparison(gsl::span<bvh::bbox> leafs) {
+  LOGI("BVH builder comparison on %d leafs:", int(leafs.size()));
+  float reference_sah_cost = 0.f;
+  for (const auto &preset : bvh::builder_presets()) {
+    bvh::BvhOptions options;
+    bvh::set_builder_preset(preset, options);
+    bvh::BvhStats stats;
+    bvh::build_bvh(leafs, options, &stats);
+    if (reference_sah_cost == 0.f) {
+      reference_sah_cost = stats.sah_cost;
+    }
+    LOGI(
+      "  %-26s %9.1f ms  SAH cost %8.2f (%.3fx sah, %8.2f before treelets)", preset.label,
+      stats.build_time_ms, stats.sah_cost, stats.sah_cost / reference_sah_cost,
+      stats.unoptimized_sah_cost);
+  }
+}
+
+// Options of the mesh BVHs: the tree of "sah" built on all cores, with SAH-sized leafs.
+bvh::BvhOptions get_mesh_bvh_options() {
+  bvh::BvhOptions options;
+  options.SetValue("bvh.builder", "sah_parallel");
+  options.SetValue("bvh.max_leaf_size", float(BVH_MAX_LEAF_SIZE));
+  return options;
+}
+
+// Set BVH_COMPARE_BUILDERS to see how the other builders fare on the mesh, which needs a build
+// rather than a cache lookup.
+bool compare_bvh_builders() {
+  return getenv("BVH_COMPARE_BUILDERS") != nullptr;
+}
+
+// Build the BVH of mesh and its buffers. Touches no files, so that it can run on a worker
+// thread: the cache is read and written by BvhBuildQueue on the main thread.
 void build_mesh_bvh(const SceneFormats::Mesh &mesh, BvhData &out_bvh) {
+  const auto options = get_mesh_bvh_options();
+  out_bvh.short_indices = use_bvh_short_indices(mesh);
+
   int index_stride = 0;
   if (mesh.index_type == VK_INDEX_TYPE_UINT16) {
     index_stride = 2;
@@ -149,9 +330,8 @@ void build_mesh_bvh(const SceneFormats::Mesh &mesh, BvhData &out_bvh) {
   idx.clear();
   idx.reserve(index_count);
 
-  std::vector<bvh::bbox> leafs;
+  std::vector<bvh::bbox> leafs(triangle_count);
   {
-    leafs.reserve(triangle_count);
     using vec3 = float[3];
     vec3 *positions = (vec3 *)(&mesh.positions[0]);
     for (uint32_t i = 0; i < vertex_count; ++i) {
@@ -159,24 +339,223 @@ void build_mesh_bvh(const SceneFormats::Mesh &mesh, BvhData &out_bvh) {
         vtx.push_back(positions[i][j]);
       }
     }
-    for (uint32_t i = 0; i < index_count; i += 3) {
-      bvh::bbox box;
+    // The build works on 32-bit indices, the leaf bounds come straight from the index buffer.
+    for (uint32_t i = 0; i < index_count; ++i) {
+      idx.push_back(get_index(i));
+    }
+    const bvh::VertexStream vertices = { vtx.data(), 3 * sizeof(float) };
+    const bvh::IndexStream indices = {
+      mesh.indices.data(), index_stride, 3 * size_t(index_stride)
+    };
+    bvh::compute_triangle_bounds(vertices, indices, int(triangle_count), leafs);
+  }
+
+  // The leafs hold references to triangles then, some triangles have several.
+  bvh::PresplitTriangles presplit;
+  if (kBvhPresplitBudget > 0.f) {
+    presplit = bvh::presplit_triangles(vtx, idx, kBvhPresplitBudget);
+    leafs = std::move(presplit.bounds);
+    LOGI("BVH triangles split into %d references", int(leafs.size()));
+  }
+  const auto &ref_triangles = presplit.triangles;
+
+  bvh::BuildContext context;
+  bvh::BvhStats stats;
+  const auto built_nodes = bvh::build_bvh(leafs, options, context, &stats);
+  nodes.assign(built_nodes.begin(), built_nodes.end());
+
+  // Leafs hold ranges of triangles in leaf order, split triangles are repeated.
+  const auto order = context.getPrimitiveOrder();
+  out_bvh.single_triangle_leafs = BVH_MAX_LEAF_SIZE > 1 && order.empty();
+  if (out_bvh.single_triangle_leafs) {
+    LOGW(
+      "BVH leafs hold single triangles, %d references are too many for leaf ranges",
+      int(leafs.size()));
+  }
+  if (!order.empty()) {
+    std::vector<int> unordered_idx;
+    unordered_idx.swap(idx);
+    idx.resize(3 * order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      const int triangle = ref_triangles.empty() ? order[i] : ref_triangles[order[i]];
       for (int j = 0; j < 3; ++j) {
-        const auto index = get_index(i + j);
-        idx.push_back(index);
+        idx[3 * i + j] = unordered_idx[3 * triangle + j];
+      }
+    }
+  }
 
-        auto &p = positions[index];
-        box.grow(bvh::float3(p[0], p[1], p[2]));
+#if BVH_QUANTIZED_VERTICES
+  // The decoded triangles move by the quantization error, which the leaf bounds grow by. Every
+  // point of a decoded triangle is that close to the matching point of the original one, so the
+  // grown bounds of split references still cover it. vtx is reordered along with idx.
+  out_bvh.bvh_quantized_vtx = bvh::quantize_vertices(vtx, idx);
+  {
+    std::vector<bvh::bbox> grown_leafs(leafs);
+    const auto grow_leaf = [&](int leaf, int triangle) {
+      bvh::float3 error(0.f, 0.f, 0.f);
+      for (int j = 0; j < 3; ++j) {
+        error = vmax(
+          error, bvh::vertex_quantization_error(out_bvh.bvh_quantized_vtx, idx[3 * triangle + j]));
+      }
+      grown_leafs[leaf].pmin = grown_leafs[leaf].pmin - error;
+      grown_leafs[leaf].pmax = grown_leafs[leaf].pmax + error;
+    };
+    if (!order.empty()) {
+      for (size_t i = 0; i < order.size(); ++i) {
+        grow_leaf(order[i], int(i));
+      }
+    } else {
+      for (size_t i = 0; i < leafs.size(); ++i) {
+        grow_leaf(int(i), ref_triangles.empty() ? int(i) : ref_triangles[i]);
       }
-      leafs.push_back(box);
     }
+    bvh::refit_bvh(nodes, grown_leafs, order);
   }
+  LOGI(
+    "BVH vertices quantized from %.1f MB to %.1f MB", vtx.size() * sizeof(float) / 1048576.0,
+    out_bvh.bvh_quantized_vtx.size() * sizeof(uint32_t) / 1048576.0);
+#endif
+  if (order.empty() && !ref_triangles.empty()) {
+    bvh::remap_leaf_triangles(nodes, ref_triangles);
+  }
+  // Memory of the triangle formats, to weigh against their speed.
+  const auto triangle_storage_mb = [&](bvh::TriangleFormat format) {
+    return bvh::triangle_storage_bytes(format, idx.size() / 3, vertex_count) / 1048576.0;
+  };
+  LOGI(
+    "BVH triangles take %.1f MB indexed, %.1f MB inline, %.1f MB as Woop transforms",
+    triangle_storage_mb(bvh::kTrianglesIndexed), triangle_storage_mb(bvh::kTrianglesInline),
+    triangle_storage_mb(bvh::kTrianglesWoop));
+#if BVH_TRIANGLE_FORMAT
+  out_bvh.bvh_triangles =
+    bvh::pack_triangles(vtx, idx, bvh::TriangleFormat(BVH_TRIANGLE_FORMAT));
+#endif
 
-  bvh::BvhOptions options;
-  options.SetValue("bvh.builder", "sah");
-  nodes = bvh::build_bvh(leafs, options);
+  LOGI(
+    "BVH built in %.1f ms: %d leafs, %d nodes, SAH cost %.2f, %d allocations, %.1f MB peak",
+    stats.build_time_ms, stats.leaf_count, stats.node_count, stats.sah_cost, stats.alloc_count,
+    stats.peak_bytes / (1024.0 * 1024.0));
+
+#if BVH_COMPRESSED_NODES
+  out_bvh.bvh_compressed_nodes = bvh::compress_bvh(nodes);
+  if (out_bvh.bvh_compressed_nodes.empty()) {
+    LOGW(
+      "BVH too deep for compressed nodes (%d levels at most), uploading binary nodes",
+      bvh::kCompressedBvhStackSize);
+    out_bvh.binary_nodes = true;
+  } else {
+    LOGI(
+      "BVH nodes compressed from %.1f MB to %.1f MB",
+      nodes.size() * sizeof(bvh::bbox) / 1048576.0,
+      out_bvh.bvh_compressed_nodes.size() * sizeof(bvh::CompressedBvhNode) / 1048576.0);
+  }
+#endif
+
+#if BVH_WIDE_NODES
+  out_bvh.bvh_wide_nodes = bvh::collapse_bvh<4>(gsl::span<const bvh::bbox>(nodes));
+  if (out_bvh.bvh_wide_nodes.empty()) {
+    LOGW(
+      "BVH too deep for wide nodes (%d stack entries at most), uploading binary nodes",
+      bvh::kWideBvhStackSize<4>);
+    out_bvh.binary_nodes = true;
+  } else {
+    LOGI(
+      "BVH collapsed from %d to %d nodes, SAH cost %.2f",
+      stats.node_count, int(out_bvh.bvh_wide_nodes.size()),
+      bvh::calc_sah_cost<4>(
+        out_bvh.bvh_wide_nodes, 1.f, 1.f, get_bvh_max_leaf_size(out_bvh)));
+  }
+#endif
+
+#if !BVH_TRIANGLE_FORMAT
+  // The faces keep no shape or primitive ids, shaders report their index in leaf order.
+  const int index_bits = out_bvh.short_indices ? 16 : 32;
+  LOGI(
+    "BVH faces take %.1f MB as %d-bit indices", idx.size() * index_bits / 8 / 1048576.0,
+    index_bits);
+  if (out_bvh.short_indices) {
+    out_bvh.bvh_short_idx.assign(idx.begin(), idx.end());
+    out_bvh.bvh_short_idx.resize((idx.size() + 1) & ~size_t(1));
+    idx.clear();
+    idx.shrink_to_fit();
+  }
+#endif
+
+  if (compare_bvh_builders()) {
+    log_bvh_builder_comparison(leafs);
+  }
 }
 
+// Builds mesh BVHs on a worker thread, so that neither startup nor rebuilds after scene edits
+// stall the frame loop. The renderer polls for the result once per frame. BVHs are looked up in
+// the cache and written to it on the calling thread, the filesystem is not thread-safe.
+class BvhBuildQueue {
+ public:
+  // Build the BVH of mesh, after the running build if there is one. A newer request replaces
+  // one still waiting.
+  void request(const SceneFormats::Mesh &mesh) {
+    if (m_build.valid()) {
+      m_pending_mesh = std::make_unique<SceneFormats::Mesh>(mesh);
+    } else {
+      start(mesh);
+    }
+  }
+
+  // The BVH of the build finished since the last call, if any.
+  std::unique_ptr<BvhData> poll() {
+    if (m_loaded) {
+      return std::move(m_loaded);
+    }
+    if (!m_build.valid()) {
+      return nullptr;
+    }
+    if (m_build.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      return nullptr;
+    }
+    auto res = m_build.get();
+    if (!res->binary_nodes && !res->single_triangle_leafs) {
+      save_bvh_cache(m_build_key, *res);
+    }
+    if (m_pending_mesh) {
+      start(*m_pending_mesh);
+      m_pending_mesh.reset();
+    }
+    return res;
+  }
+
+ private:
+  void start(const SceneFormats::Mesh &mesh) {
+    const auto start_time = std::chrono::steady_clock::now();
+    const uint64_t key = hash_bvh_inputs(mesh, get_mesh_bvh_options());
+    auto loaded = std::make_unique<BvhData>();
+    loaded->short_indices = use_bvh_short_indices(mesh);
+    if (!compare_bvh_builders() && load_bvh_cache(key, *loaded)) {
+      const std::chrono::duration<double, std::milli> load_time =
+        std::chrono::steady_clock::now() - start_time;
+      LOGI("BVH loaded from %s in %.1f ms", get_bvh_cache_path(key).c_str(), load_time.count());
+      // Replaces a cached BVH not polled yet, it is older.
+      m_loaded = std::move(loaded);
+      return;
+    }
+
+    // The worker owns a copy, the scene may change while it runs.
+    m_build_key = key;
+    m_build = std::async(std::launch::async, [mesh]() {
+      auto res = std::make_unique<BvhData>();
+      build_mesh_bvh(mesh, *res);
+      return res;
+    });
+  }
+
+  // Waits for the running build on destruction.
+  std::future<std::unique_ptr<BvhData>> m_build;
+  // Cache key of the running build.
+  uint64_t m_build_key = 0;
+  // Found in the cache by the last start, for the next poll.
+  std::unique_ptr<BvhData> m_loaded;
+  std::unique_ptr<SceneFormats::Mesh> m_pending_mesh;
+};
+
 void init_device_data(Device &device, DeviceData &device_data, BvhData &bvh) {
   // Upload BVH nodes to GPU
   {
@@ -188,9 +567,17 @@ void init_device_data(Device &device, DeviceData &device_data, BvhData &bvh) {
       return device.create_buffer(info, data.data());
     };
 
-    device_data.bvh_nodes_buffer = create_bvh_buffer(gsl::as_bytes(gsl::make_span(bvh.bvh_nodes)));
-    device_data.bvh_vtx_buffer = create_bvh_buffer(gsl::as_bytes(gsl::make_span(bvh.bvh_vtx)));
-    device_data.bvh_faces_buffer = create_bvh_buffer(gsl::as_bytes(gsl::make_span(bvh.bvh_idx)));
+    // Straight from the mapped file when the BVH was loaded from the cache.
+    const auto buffers = get_bvh_buffers(bvh);
+    if (buffers.sections[bvh::kBvhCacheNodes].empty()) {
+      // Not built yet.
+      return;
+    }
+    device_data.bvh_nodes_buffer = create_bvh_buffer(buffers.sections[bvh::kBvhCacheNodes]);
+    device_data.bvh_vtx_buffer = create_bvh_buffer(buffers.sections[bvh::kBvhCacheVertices]);
+    // None for packed triangles.
+    const auto &indices = buffers.sections[bvh::kBvhCacheIndices];
+    device_data.bvh_faces_buffer = indices.empty() ? BufferHandle() : create_bvh_buffer(indices);
   }
 
   {
@@ -276,8 +663,7 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
       // transform.scale = vec3(0.1f);
     }
 
-    // Build BVH.
-    LOGI("Building BVH");
+    // Build BVH in the background, the raster pass is shown until it is done.
     {
       auto &scene = scene_loader_.get_scene();
 
@@ -295,7 +681,7 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
       }
       assert(test_mesh_ != nullptr);
 
-      build_mesh_bvh(test_mesh_->get_mesh(), bvh_);
+      request_bvh_build();
     }
 
     // Set up real-time rendering context.
@@ -319,22 +705,40 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
     delete_device_data(global_data_.device_data, e.get_device());
   }
 
-  void on_swapchain_created(const SwapchainParameterEvent &e) {
-    auto &device = e.get_device();
+  // Rebuild the BVH of the test mesh in the background, e.g. after it was edited. The current
+  // one stays in use until the new one is swapped in by render_frame.
+  void request_bvh_build() {
+    LOGI("Building BVH");
+    bvh_builds_.request(test_mesh_->get_mesh());
+  }
+
+  // Replace the BVH buffers by the ones of bvh. Called between frames, so that every frame
+  // traces a single BVH. The old buffers are released once the frames in flight are done.
+  void swap_bvh(Device &device, BvhData &&bvh) {
+    const bool had_bvh = bool(global_data_.device_data.bvh_nodes_buffer);
+    bvh_ = std::move(bvh);
+    init_device_data(device, global_data_.device_data, bvh_);
+    if (!had_bvh && global_data_.device_data.bvh_nodes_buffer) {
+      // Show the path tracing pass instead of the raster one.
+      setup_render_graph(device);
+    }
+  }
 
+  void on_swapchain_created(const SwapchainParameterEvent &e) {
     // Update swapchain extent
     global_data_.swapchain_data.window_size = { int32_t(e.get_width()), int32_t(e.get_height()) };
+    swapchain_dim_ = {};
+    swapchain_dim_.width = e.get_width();
+    swapchain_dim_.height = e.get_height();
+    swapchain_dim_.format = e.get_format();
 
-    // Rebuild render graph.
+    setup_render_graph(e.get_device());
+  }
 
+  void setup_render_graph(Device &device) {
     graph_.reset();
     graph_.set_device(&device);
-
-    ResourceDimensions dim;
-    dim.width = e.get_width();
-    dim.height = e.get_height();
-    dim.format = e.get_format();
-    graph_.set_backbuffer_dimensions(dim);
+    graph_.set_backbuffer_dimensions(swapchain_dim_);
 
     scene_loader_.get_scene().add_render_passes(graph_);
 
@@ -383,6 +787,14 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
 
     scene_loader_.get_scene().add_render_pass_dependencies(graph_, pass_graphics);
 
+    // Until the BVH is built.
+    if (!global_data_.device_data.bvh_nodes_buffer) {
+      graph_.set_backbuffer_source("back");
+      graph_.bake();
+      graph_.log();
+      return;
+    }
+
     // Path tracing pass
 
     AttachmentInfo path_trace_out;
@@ -416,12 +828,19 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
 
       // Hack: debug ray casting shader
       {
-        CommandBufferUtil::setup_fullscreen_quad(cmd, "builtin://shaders/quad.vert", "shaders://depth.frag");
+        CommandBufferUtil::setup_fullscreen_quad(
+          cmd, "builtin://shaders/quad.vert", "shaders://depth.frag",
+          { { "BVH_SHORT_INDICES", bvh_.short_indices ? 1 : 0 },
+            { "BVH_MAX_LEAF_SIZE", get_bvh_max_leaf_size(bvh_) },
+            { "BVH_COMPRESSED_NODES", BVH_COMPRESSED_NODES && !bvh_.binary_nodes ? 1 : 0 },
+            { "BVH_WIDE_NODES", BVH_WIDE_NODES && !bvh_.binary_nodes ? 1 : 0 } });
         // BVH
         {
           cmd.set_storage_buffer(BVH_SET_BINDING, 1, *global_data_.device_data.bvh_nodes_buffer);
           cmd.set_storage_buffer(BVH_SET_BINDING, 2, *global_data_.device_data.bvh_vtx_buffer);
-          cmd.set_storage_buffer(BVH_SET_BINDING, 3, *global_data_.device_data.bvh_faces_buffer);
+          if (global_data_.device_data.bvh_faces_buffer) {
+            cmd.set_storage_buffer(BVH_SET_BINDING, 3, *global_data_.device_data.bvh_faces_buffer);
+          }
 
           // cmd.set_storage_buffer(BVH_SET_BINDING, 1, *test_mesh_->vbo_position);
           // cmd.set_storage_buffer(BVH_SET_BINDING, 2, *test_mesh_->ibo);
@@ -465,6 +884,11 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
     auto &device = wsi.get_device();
     auto &scene = scene_loader_.get_scene();
 
+    // Swap in a finished BVH at the frame boundary.
+    if (auto bvh = bvh_builds_.poll()) {
+      swap_bvh(device, std::move(*bvh));
+    }
+
     // Per-frame updates
     // TODO: update ViewData
     scene.update_cached_transforms();
@@ -522,8 +946,10 @@ struct RenderGraphSandboxApplication : Granite::Application, Granite::EventHandl
   }
 
   RenderGraph graph_;
+  ResourceDimensions swapchain_dim_;
   GlobalData global_data_;
   BvhData bvh_;
+  BvhBuildQueue bvh_builds_;
   ImportedMesh *test_mesh_;
 
   FPSCamera cam_;
@@ -1,10 +1,54 @@
 #include <cstdio>
-#include <cstdlib>
+#include <cstring>
+#include <vector>
 
-#include <granite/vulkan/context.hpp>
+#include "tests/test.h"
 
-int main() {
-  //
-  printf("hello world!\n");
-  system("pause");
+namespace test {
+
+namespace {
+struct TestCase {
+  const char *name;
+  TestFn fn;
+};
+
+std::vector<TestCase> &registry() {
+  static std::vector<TestCase> tests;
+  return tests;
+}
+
+int g_failures = 0;
+} // namespace
+
+Register::Register(const char *name, TestFn fn) {
+  registry().push_back({ name, fn });
+}
+
+void fail(const char *file, int line, const std::string &message) {
+  ++g_failures;
+  printf("  %s:%d: %s\n", file, line, message.c_str());
+}
+
+} // namespace test
+
+// Runs every test, or those whose name contains the first argument.
+int main(int argc, char **argv) {
+  const char *filter = argc > 1 ? argv[1] : "";
+  int failed_tests = 0;
+  int num_tests = 0;
+  for (const auto &test_case : test::registry()) {
+    if (!strstr(test_case.name, filter)) {
+      continue;
+    }
+    ++num_tests;
+    printf("[ RUN  ] %s\n", test_case.name);
+    fflush(stdout);
+    const int failures = test::g_failures;
+    test_case.fn();
+    const bool ok = test::g_failures == failures;
+    failed_tests += ok ? 0 : 1;
+    printf("[ %s ] %s\n", ok ? " OK " : "FAIL", test_case.name);
+  }
+  printf("%d of %d tests passed\n", num_tests - failed_tests, num_tests);
+  return failed_tests == 0 ? 0 : 1;
 }
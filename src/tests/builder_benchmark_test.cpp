@@ -0,0 +1,131 @@
+#include <cstdio>
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/node_layout.h>
+#include <bvh/traversal.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+// Every builder on the same fixed geometry: the shape of the tree, the coverage of the leafs
+// and the SAH cost relative to "sah" are checked, and the build times are printed for
+// comparing builders across changes. Run alone with `main_test builder_benchmark`.
+// The cache lines and pages random rays fetch are measured the same way for the node layouts,
+// with `main_test node_layout_benchmark`.
+
+namespace {
+
+// Highest SAH cost of the presets relative to "sah" on the test scenes, with some margin.
+constexpr float kMaxSahRatio = 1.25f;
+
+constexpr int kNumRays = 20000;
+
+struct BenchmarkScene {
+  const char *label;
+  test::TestMesh mesh;
+  std::vector<bvh::bbox> leafs;
+};
+
+std::vector<BenchmarkScene> make_benchmark_scenes() {
+  std::vector<BenchmarkScene> scenes = {
+    { "soup", test::make_triangle_soup(20000) },
+    { "sphere", test::make_sphere(40) },
+  };
+  for (auto &scene : scenes) {
+    scene.leafs = test::triangle_bounds(scene.mesh);
+  }
+  return scenes;
+}
+
+} // namespace
+
+TEST(builder_benchmark) {
+  for (const auto &scene : make_benchmark_scenes()) {
+    const int num_leafs = int(scene.leafs.size());
+    printf("  %s, %d leafs:\n", scene.label, num_leafs);
+    float reference_sah_cost = 0.f;
+    for (const auto &preset : bvh::builder_presets()) {
+      bvh::BvhOptions options;
+      bvh::set_builder_preset(preset, options);
+      std::vector<bvh::bbox> leafs(scene.leafs);
+      bvh::BuildContext context;
+      bvh::BvhStats stats;
+      const auto nodes = bvh::build_bvh(leafs, options, context, &stats);
+      if (reference_sah_cost == 0.f) {
+        reference_sah_cost = stats.sah_cost;
+      }
+      const float sah_ratio = stats.sah_cost / reference_sah_cost;
+      printf(
+        "    %-26s %8.1f ms  %6d nodes  SAH cost %7.2f (%.3fx sah)\n", preset.label,
+        stats.build_time_ms, stats.node_count, stats.sah_cost, sah_ratio);
+
+      // Binary trees, with one leaf per primitive unless leafs hold several or spatial splits
+      // reference primitives from several leafs.
+      const auto validation = test::validation_options(options);
+      const auto order = context.getPrimitiveOrder();
+      CHECK(stats.node_count == int(nodes.size()));
+      CHECK(stats.node_count == 2 * stats.leaf_count - 1);
+      if (validation.split_references) {
+        CHECK(stats.leaf_count >= num_leafs);
+      } else if (order.empty()) {
+        CHECK(stats.leaf_count == num_leafs);
+      } else {
+        CHECK(stats.leaf_count <= num_leafs);
+      }
+      const auto error = test::validate_skip_links(nodes, scene.leafs, order, validation);
+      CHECK_VALID(error.empty() ? error : std::string(preset.label) + ": " + error);
+      CHECK(sah_ratio <= kMaxSahRatio);
+    }
+  }
+}
+
+TEST(node_layout_benchmark) {
+  for (const auto &scene : make_benchmark_scenes()) {
+    bvh::bbox bounds;
+    for (const auto &leaf : scene.leafs) {
+      bounds.grow(leaf);
+    }
+    const auto rays = test::make_rays(bounds, kNumRays);
+    for (float max_leaf_size : { 1.f, 4.f }) {
+      printf("  %s, %d per leaf:\n", scene.label, int(max_leaf_size));
+      bvh::TraversalStats stats[2];
+      std::vector<float> hits[2];
+      for (int layout = 0; layout < 2; ++layout) {
+        bvh::BvhOptions options;
+        options.SetValue("bvh.builder", "sah_parallel");
+        options.SetValue("bvh.max_leaf_size", max_leaf_size);
+        if (layout) {
+          options.SetValue("bvh.layout.block_size", float(bvh::kPageBlockSize));
+        }
+        std::vector<int> order;
+        const auto nodes = test::build_nodes(scene.leafs, options, &order);
+        for (const auto &ray : rays) {
+          const auto intersect_leaf = [&](uint32_t payload, float &tmax) {
+            const float w = bvh::encode_index(payload);
+            const int start = order.empty() ? int(payload) : bvh::leaf_range_start(w);
+            const int count = order.empty() ? 1 : bvh::leaf_range_count(w);
+            for (int i = start; i < start + count; ++i) {
+              const int *triangle = &scene.mesh.indices[3 * (order.empty() ? i : order[i])];
+              test::intersect_triangle(
+                scene.mesh.vertex(triangle[0]), scene.mesh.vertex(triangle[1]),
+                scene.mesh.vertex(triangle[2]), ray.o, ray.d, tmax);
+            }
+          };
+          hits[layout].push_back(
+            bvh::traverse_bvh(nodes, ray.o, ray.d, 1e30f, intersect_leaf, &stats[layout]));
+        }
+        printf(
+          "    %-14s %7.1f nodes %7.1f lines %6.2f pages per ray\n",
+          layout ? "page blocks" : "depth-first", double(stats[layout].nodes) / kNumRays,
+          double(stats[layout].lines) / kNumRays, double(stats[layout].pages) / kNumRays);
+      }
+
+      // The layout moves the nodes, the traversals visit the same ones.
+      CHECK(hits[0] == hits[1]);
+      CHECK(stats[0].nodes == stats[1].nodes);
+      CHECK(stats[1].pages <= stats[0].pages);
+    }
+  }
+}
@@ -0,0 +1,56 @@
+#include <cstring>
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/bvh_cache.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+TEST(cache_round_trip) {
+  const auto mesh = test::make_sphere(40);
+  const auto leafs = test::triangle_bounds(mesh);
+  bvh::BvhOptions options;
+  options.SetValue("bvh.builder", "sah_parallel");
+  const auto nodes = test::build_nodes(leafs, options);
+
+  bvh::BvhCacheContents contents;
+  contents.sections[bvh::kBvhCacheNodes] = gsl::as_bytes(gsl::make_span(nodes));
+  contents.sections[bvh::kBvhCacheVertices] = gsl::as_bytes(gsl::make_span(mesh.vertices));
+  contents.sections[bvh::kBvhCacheIndices] = gsl::as_bytes(gsl::make_span(mesh.indices));
+  const uint64_t key = bvh::hash_bvh_options(options, 42);
+  // Sections are 64 byte aligned in the file, so is the file.
+  std::vector<bvh::bbox> file(bvh::bvh_cache_file_size(contents) / sizeof(bvh::bbox) + 1);
+  const size_t file_size = bvh::bvh_cache_file_size(contents);
+  bvh::write_bvh_cache(contents, key, file.data());
+
+  bvh::BvhCacheContents loaded;
+  CHECK(bvh::read_bvh_cache(file.data(), file_size, key, loaded));
+  for (int i = 0; i < bvh::kBvhCacheSectionCount; ++i) {
+    CHECK(loaded.sections[i].size() == contents.sections[i].size());
+    CHECK(
+      std::memcmp(
+        loaded.sections[i].data(), contents.sections[i].data(), contents.sections[i].size()) ==
+      0);
+  }
+  const auto &loaded_nodes = loaded.sections[bvh::kBvhCacheNodes];
+  CHECK_VALID(test::validate_skip_links(
+    gsl::span<const bvh::bbox>(
+      reinterpret_cast<const bvh::bbox *>(loaded_nodes.data()),
+      loaded_nodes.size() / sizeof(bvh::bbox)),
+    leafs));
+
+  // Other keys, and files cut short or with a broken magic number, are rejected.
+  CHECK(!bvh::read_bvh_cache(file.data(), file_size, key + 1, loaded));
+  CHECK(!bvh::read_bvh_cache(file.data(), file_size - 64, key, loaded));
+  std::memset(static_cast<void *>(file.data()), 0, sizeof(uint32_t));
+  CHECK(!bvh::read_bvh_cache(file.data(), file_size, key, loaded));
+
+  // So are files without nodes.
+  contents.sections[bvh::kBvhCacheNodes] = {};
+  std::vector<bvh::bbox> empty_file(bvh::bvh_cache_file_size(contents) / sizeof(bvh::bbox) + 1);
+  bvh::write_bvh_cache(contents, key, empty_file.data());
+  CHECK(!bvh::read_bvh_cache(
+    empty_file.data(), bvh::bvh_cache_file_size(contents), key, loaded));
+}
@@ -0,0 +1,306 @@
+#include "bvh_validation.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <vector>
+
+namespace test {
+
+namespace {
+std::string format(const char *fmt, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buffer, sizeof(buffer), fmt, args);
+  va_end(args);
+  return buffer;
+}
+
+// Counts the leafs that reference every primitive.
+class PrimitiveCoverage {
+ public:
+  PrimitiveCoverage(
+    gsl::span<const bvh::bbox> leaf_bounds,
+    gsl::span<const int> primitive_order,
+    const ValidationOptions &options)
+    : m_leaf_bounds(leaf_bounds)
+    , m_primitive_order(primitive_order)
+    , m_options(options)
+    , m_counts(leaf_bounds.size(), 0) {}
+
+  // Primitives of the leaf with payload and bounds.
+  std::string addLeaf(uint32_t payload, const bvh::bbox &bounds) {
+    if (m_primitive_order.empty()) {
+      return addPrimitive(int(payload), bounds);
+    }
+    const float w = bvh::encode_index(payload);
+    const int start = bvh::leaf_range_start(w);
+    const int count = bvh::leaf_range_count(w);
+    if (count < 1 || start + count > int(m_primitive_order.size())) {
+      return format("leaf range (%d, %d) out of the primitive order", start, count);
+    }
+    for (int i = start; i < start + count; ++i) {
+      auto error = addPrimitive(m_primitive_order[i], bounds);
+      if (!error.empty()) {
+        return error;
+      }
+    }
+    return {};
+  }
+
+  std::string finish() const {
+    for (size_t i = 0; i < m_counts.size(); ++i) {
+      if (m_counts[i] == 0 || (m_counts[i] > 1 && !m_options.split_references)) {
+        return format("primitive %d reached %d times", int(i), m_counts[i]);
+      }
+    }
+    return {};
+  }
+
+ private:
+  std::string addPrimitive(int primitive, const bvh::bbox &bounds) {
+    if (primitive < 0 || primitive >= int(m_counts.size())) {
+      return format("primitive %d out of range", primitive);
+    }
+    ++m_counts[primitive];
+    if (!m_options.split_references && !encloses(bounds, m_leaf_bounds[primitive])) {
+      return format("leaf does not contain primitive %d", primitive);
+    }
+    return {};
+  }
+
+  gsl::span<const bvh::bbox> m_leaf_bounds;
+  gsl::span<const int> m_primitive_order;
+  ValidationOptions m_options;
+  std::vector<int> m_counts;
+};
+} // namespace
+
+ValidationOptions validation_options(const bvh::BvhOptions &options) {
+  auto splits = options.GetOption("bvh.sah.use_splits");
+  ValidationOptions res;
+  res.split_references = splits && splits->AsFloat() > 0.f;
+  return res;
+}
+
+bool encloses(const bvh::bbox &outer, const bvh::bbox &inner) {
+  for (int axis = 0; axis < 3; ++axis) {
+    if (!(outer.pmin[axis] <= inner.pmin[axis] && outer.pmax[axis] >= inner.pmax[axis])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string validate_skip_links(
+  gsl::span<const bvh::bbox> nodes,
+  gsl::span<const bvh::bbox> leaf_bounds,
+  gsl::span<const int> primitive_order,
+  const ValidationOptions &options) {
+  PrimitiveCoverage coverage(leaf_bounds, primitive_order, options);
+  const int num_nodes = int(nodes.size());
+  if (num_nodes == 0) {
+    return leaf_bounds.empty() ? std::string() : "no nodes";
+  }
+
+  // Depth-first walk of the tree the skip links describe: the first child of an internal node
+  // follows it, the second one is where the first child links to, and the last node of a
+  // subtree links to where its root does.
+  struct StackEntry {
+    int node;
+    int next;
+    int parent;
+  };
+  std::vector<StackEntry> stack = { { 0, -1, -1 } };
+  std::vector<bool> visited(num_nodes, false);
+  int num_visited = 0;
+  while (!stack.empty()) {
+    const StackEntry entry = stack.back();
+    stack.pop_back();
+    if (entry.node < 0 || entry.node >= num_nodes || visited[entry.node]) {
+      return format("node %d out of range or reached twice", entry.node);
+    }
+    visited[entry.node] = true;
+    ++num_visited;
+    const bvh::bbox &node = nodes[entry.node];
+    if (bvh::decode_index(node.pmax.w) != entry.next) {
+      return format(
+        "node %d links to %d instead of %d", entry.node, bvh::decode_index(node.pmax.w),
+        entry.next);
+    }
+    if (entry.parent != -1 && !encloses(nodes[entry.parent], node)) {
+      return format("node %d does not contain its child %d", entry.parent, entry.node);
+    }
+
+    if (bvh::is_leaf_node(node)) {
+      auto error = coverage.addLeaf(uint32_t(bvh::decode_index(node.pmin.w)), node);
+      if (!error.empty()) {
+        return format("node %d: ", entry.node) + error;
+      }
+      continue;
+    }
+    const int first = entry.node + 1;
+    if (first >= num_nodes) {
+      return format("internal node %d has no children", entry.node);
+    }
+    const int second = bvh::decode_index(nodes[first].pmax.w);
+    if (second <= first) {
+      return format("second child %d of node %d before its first one", second, entry.node);
+    }
+    stack.push_back({ second, entry.next, entry.node });
+    stack.push_back({ first, second, entry.node });
+  }
+  if (num_visited != num_nodes) {
+    return format("%d of %d nodes are not in the tree", num_nodes - num_visited, num_nodes);
+  }
+  return coverage.finish();
+}
+
+std::string validate_compressed_bvh(
+  gsl::span<const bvh::CompressedBvhNode> nodes, gsl::span<const bvh::bbox> skip_links) {
+  if (skip_links.empty()) {
+    return nodes.empty() ? std::string() : "nodes of an empty tree";
+  }
+  if (nodes.empty()) {
+    return "no nodes";
+  }
+  bvh::CompressedBvhHeader header;
+  std::memcpy(&header, &nodes[0], sizeof(header));
+  const bool root_leaf = bvh::is_leaf_node(skip_links[0]);
+  const uint32_t root_payload =
+    root_leaf ? uint32_t(bvh::decode_index(skip_links[0].pmin.w)) : bvh::kInvalidIndex;
+  if (header.root_payload != root_payload) {
+    return "wrong root payload";
+  }
+  if (root_leaf) {
+    return nodes.size() == 1 ? std::string() : "nodes below a leaf root";
+  }
+
+  // Walk both trees together, every compressed node decodes its children with the grid origin
+  // its parent decoded for it.
+  struct StackEntry {
+    int node;
+    int skip_node;
+    bvh::float3 origin;
+    int depth;
+  };
+  std::vector<StackEntry> stack = {
+    { 1, 0, bvh::float3(header.origin[0], header.origin[1], header.origin[2]), 1 }
+  };
+  std::vector<bool> visited(nodes.size(), false);
+  int num_visited = 1;
+  while (!stack.empty()) {
+    const StackEntry entry = stack.back();
+    stack.pop_back();
+    if (entry.node < 1 || entry.node >= int(nodes.size()) || visited[entry.node]) {
+      return format("node %d out of range or reached twice", entry.node);
+    }
+    if (entry.depth > bvh::kCompressedBvhStackSize) {
+      return format("node %d deeper than the traversal stack", entry.node);
+    }
+    visited[entry.node] = true;
+    ++num_visited;
+
+    const auto &node = nodes[entry.node];
+    const int skip_children[2] = { entry.skip_node + 1,
+                                   bvh::decode_index(skip_links[entry.skip_node + 1].pmax.w) };
+    for (int child = 0; child < 2; ++child) {
+      const bvh::bbox &original = skip_links[skip_children[child]];
+      const bvh::bbox decoded = bvh::decode_child_bounds(node, child, entry.origin);
+      if (!encloses(decoded, original)) {
+        return format("child %d of node %d decodes smaller than it was", child, entry.node);
+      }
+      const bool leaf = (node.exponents & (bvh::kCompressedLeafChild << child)) != 0;
+      if (leaf != bvh::is_leaf_node(original)) {
+        return format("child %d of node %d has the wrong type", child, entry.node);
+      }
+      if (leaf) {
+        if (node.children[child] != uint32_t(bvh::decode_index(original.pmin.w))) {
+          return format("child %d of node %d has the wrong payload", child, entry.node);
+        }
+      } else {
+        stack.push_back(
+          { int(node.children[child]), skip_children[child], decoded.pmin, entry.depth + 1 });
+      }
+    }
+  }
+  if (num_visited != int(nodes.size())) {
+    return format("%d nodes are not in the tree", int(nodes.size()) - num_visited);
+  }
+  return {};
+}
+
+template <int Width>
+std::string validate_wide_bvh(
+  gsl::span<const bvh::WideBvhNode<Width>> nodes,
+  gsl::span<const bvh::bbox> leaf_bounds,
+  gsl::span<const int> primitive_order,
+  const ValidationOptions &options) {
+  PrimitiveCoverage coverage(leaf_bounds, primitive_order, options);
+  if (nodes.empty()) {
+    return leaf_bounds.empty() ? std::string() : "no nodes";
+  }
+
+  // Nodes with the bounds their parent has for them, none for the root.
+  struct StackEntry {
+    int node;
+    bvh::bbox bounds;
+  };
+  std::vector<StackEntry> stack = { { 0, bvh::bbox() } };
+  std::vector<bool> visited(nodes.size(), false);
+  int num_visited = 0;
+  while (!stack.empty()) {
+    const StackEntry entry = stack.back();
+    stack.pop_back();
+    if (entry.node < 0 || entry.node >= int(nodes.size()) || visited[entry.node]) {
+      return format("node %d out of range or reached twice", entry.node);
+    }
+    visited[entry.node] = true;
+    ++num_visited;
+
+    const auto &node = nodes[entry.node];
+    if (node.num_children < 1 || node.num_children > uint32_t(Width)) {
+      return format("node %d has %u children", entry.node, node.num_children);
+    }
+    for (int child = 0; child < Width; ++child) {
+      if (child >= int(node.num_children)) {
+        if (node.children[child] != bvh::kInvalidIndex || (node.leaf_mask >> child & 1)) {
+          return format("unused slot %d of node %d is set", child, entry.node);
+        }
+        continue;
+      }
+      const bvh::bbox bounds = bvh::child_bounds(node, child);
+      if (entry.node != 0 && !encloses(entry.bounds, bounds)) {
+        return format("node %d is larger in its parent than its child %d", entry.node, child);
+      }
+      if (node.leaf_mask >> child & 1) {
+        auto error = coverage.addLeaf(node.children[child], bounds);
+        if (!error.empty()) {
+          return format("child %d of node %d: ", child, entry.node) + error;
+        }
+      } else {
+        if (int(node.children[child]) <= entry.node) {
+          return format("child %d of node %d comes before it", child, entry.node);
+        }
+        stack.push_back({ int(node.children[child]), bounds });
+      }
+    }
+  }
+  if (num_visited != int(nodes.size())) {
+    return format("%d nodes are not in the tree", int(nodes.size()) - num_visited);
+  }
+  return coverage.finish();
+}
+
+template std::string validate_wide_bvh<4>(
+  gsl::span<const bvh::WideBvhNode<4>>,
+  gsl::span<const bvh::bbox>,
+  gsl::span<const int>,
+  const ValidationOptions &);
+template std::string validate_wide_bvh<8>(
+  gsl::span<const bvh::WideBvhNode<8>>,
+  gsl::span<const bvh::bbox>,
+  gsl::span<const int>,
+  const ValidationOptions &);
+
+} // namespace test
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+
+#include <gsl/span>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/compressed_bvh.h>
+#include <bvh/wide_bvh.h>
+
+namespace test {
+
+// Validators of the node formats. They return a description of the first problem found, or an
+// empty string for a valid BVH, see CHECK_VALID.
+
+struct ValidationOptions {
+  // Spatial split builders reference a primitive from several leafs with bounds clipped to part
+  // of it: primitives have to be reached at least once, and leafs need not contain them.
+  bool split_references = false;
+};
+
+// Validation options for BVHs built with options.
+ValidationOptions validation_options(const bvh::BvhOptions &options);
+
+// Skip-links BVH over leaf_bounds: the links form a tree whose depth-first walk visits every
+// node once and ends at the root's kInvalidIndex, every parent contains its children, every
+// leaf contains the bounds of its primitives, and every primitive is reached exactly once.
+// Leaf payloads are primitive indices, or ranges of primitive_order if it is not empty.
+std::string validate_skip_links(
+  gsl::span<const bvh::bbox> nodes,
+  gsl::span<const bvh::bbox> leaf_bounds,
+  gsl::span<const int> primitive_order = {},
+  const ValidationOptions &options = {});
+
+// Compressed BVH of skip_links, a valid skip-links BVH: the nodes mirror its tree, and the
+// decoded child bounds contain the original ones.
+std::string validate_compressed_bvh(
+  gsl::span<const bvh::CompressedBvhNode> nodes, gsl::span<const bvh::bbox> skip_links);
+
+// Wide BVH over leaf_bounds, the same checks as validate_skip_links.
+template <int Width>
+std::string validate_wide_bvh(
+  gsl::span<const bvh::WideBvhNode<Width>> nodes,
+  gsl::span<const bvh::bbox> leaf_bounds,
+  gsl::span<const int> primitive_order = {},
+  const ValidationOptions &options = {});
+
+// Whether outer contains inner, exactly.
+bool encloses(const bvh::bbox &outer, const bvh::bbox &inner);
+
+} // namespace test
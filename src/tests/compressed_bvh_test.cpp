@@ -0,0 +1,23 @@
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/compressed_bvh.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+TEST(compressed_nodes_contain_the_original_bounds) {
+  for (const auto &leafs : test::test_leaf_sets()) {
+    for (float max_leaf_size : { 1.f, 4.f }) {
+      bvh::BvhOptions options;
+      options.SetValue("bvh.builder", "sah_parallel");
+      options.SetValue("bvh.max_leaf_size", max_leaf_size);
+      std::vector<int> order;
+      const auto nodes = test::build_nodes(leafs, options, &order);
+      const auto compressed = bvh::compress_bvh(nodes);
+      CHECK(!compressed.empty());
+      CHECK_VALID(test::validate_compressed_bvh(compressed, nodes));
+    }
+  }
+}
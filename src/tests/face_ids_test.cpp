@@ -0,0 +1,139 @@
+#include <memory>
+#include <vector>
+
+#include <bvh/RadeonRays/intersector_skip_links.h>
+
+#include "primitive/instance.h"
+#include "primitive/mesh.h"
+#include "world/world.h"
+
+#include "test.h"
+#include "test_scenes.h"
+
+// Faces of a single-level BVH are in leaf order and do not store what they belong to:
+// BvhBuilder::getFaceIds finds the shape and mesh face of every position in the faces buffer, in
+// 32-bit and 16-bit faces alike.
+
+namespace {
+
+struct FaceIdsScene {
+  std::vector<test::TestMesh> meshes;
+  std::vector<std::vector<int>> face_vertex_counts;
+  std::vector<std::unique_ptr<RadeonRays::Shape>> shapes;
+  // Index into meshes of every shape.
+  std::vector<int> shape_meshes;
+  RadeonRays::World world;
+};
+
+RadeonRays::matrix translation(float x, float y, float z) {
+  RadeonRays::matrix m;
+  m.m[0][3] = x;
+  m.m[1][3] = y;
+  m.m[2][3] = z;
+  return m;
+}
+
+// A sphere and a soup of an odd number of triangles, then an instance of the sphere, attached
+// instance first to check that shapes are not assumed in order.
+void make_scene(FaceIdsScene &scene) {
+  scene.meshes = { test::make_sphere(12), test::make_triangle_soup(501) };
+  for (int i = 0; i < int(scene.meshes.size()); ++i) {
+    const auto &mesh = scene.meshes[i];
+    scene.face_vertex_counts.emplace_back(mesh.triangle_count(), 3);
+    auto shape = std::make_unique<RadeonRays::Mesh>(
+      mesh.vertices.data(), int(mesh.vertices.size() / 3), 3 * int(sizeof(float)),
+      mesh.indices.data(), 0, scene.face_vertex_counts.back().data(), mesh.triangle_count());
+    shape->SetId(i + 1);
+    const auto m = translation(0.f, 0.f, 3.f * i);
+    shape->SetTransform(m, m);
+    scene.shapes.push_back(std::move(shape));
+    scene.shape_meshes.push_back(i);
+  }
+  auto instance = std::make_unique<RadeonRays::Instance>(scene.shapes[0].get());
+  instance->SetId(7);
+  const auto m = translation(3.f, 1.f, 0.f);
+  instance->SetTransform(m, m);
+  scene.shapes.push_back(std::move(instance));
+  scene.shape_meshes.push_back(0);
+
+  scene.world.AttachShape(scene.shapes[2].get());
+  scene.world.AttachShape(scene.shapes[0].get());
+  scene.world.AttachShape(scene.shapes[1].get());
+}
+
+} // namespace
+
+TEST(face_ids_find_the_faces_of_every_shape) {
+  FaceIdsScene scene;
+  make_scene(scene);
+  RadeonRays::BvhBuilder builder;
+  builder.updateBvh(scene.world);
+
+  const int num_faces = builder.getFaceCount();
+  std::vector<RadeonRays::Node> nodes(builder.getNodeCount());
+  std::vector<RadeonRays::Vertex> vertices(builder.getVertexCount());
+  std::vector<RadeonRays::Face> faces(num_faces);
+  builder.fillBuffers(nodes, vertices, faces);
+  CHECK(num_faces == 2 * scene.meshes[0].triangle_count() + scene.meshes[1].triangle_count());
+  CHECK(num_faces % 2 == 1);
+
+  // Every face position names a shape and a face of its mesh, whose world space vertices are the
+  // ones the face indexes, and every face of every shape is named once.
+  std::vector<std::vector<int>> counts;
+  for (int i = 0; i < int(scene.shapes.size()); ++i) {
+    counts.emplace_back(scene.meshes[scene.shape_meshes[i]].triangle_count());
+  }
+  int num_unknown = 0;
+  int num_wrong_vertices = 0;
+  for (int i = 0; i < num_faces; ++i) {
+    const auto ids = builder.getFaceIds(i);
+    int shape = 0;
+    while (shape < int(scene.shapes.size()) && scene.shapes[shape]->GetId() != ids.shape_id) {
+      ++shape;
+    }
+    if (shape == int(scene.shapes.size()) || ids.prim_id < 0 ||
+        ids.prim_id >= int(counts[shape].size())) {
+      ++num_unknown;
+      continue;
+    }
+    ++counts[shape][ids.prim_id];
+
+    RadeonRays::matrix m, minv;
+    scene.shapes[shape]->GetTransform(m, minv);
+    const auto &mesh = scene.meshes[scene.shape_meshes[shape]];
+    for (int j = 0; j < 3; ++j) {
+      const auto expected =
+        RadeonRays::transform_point(mesh.vertex(mesh.indices[3 * ids.prim_id + j]), m);
+      const auto &vertex = vertices[faces[i].idx[j]];
+      num_wrong_vertices +=
+        vertex.x != expected.x || vertex.y != expected.y || vertex.z != expected.z ? 1 : 0;
+    }
+  }
+  CHECK(num_unknown == 0);
+  CHECK(num_wrong_vertices == 0);
+  bool once = true;
+  for (const auto &shape_counts : counts) {
+    for (int count : shape_counts) {
+      once &= count == 1;
+    }
+  }
+  CHECK(once);
+
+  // 16-bit faces hold the same indices, padded with a zero face to a whole uint.
+  CHECK(builder.hasShortFaces());
+  CHECK(builder.getShortFaceCount() == num_faces + 1);
+  std::vector<RadeonRays::ShortFace> short_faces(builder.getShortFaceCount());
+  for (auto &face : short_faces) {
+    face = { { 0xffff, 0xffff, 0xffff } };
+  }
+  builder.fillBuffersShortFaces(nodes, vertices, short_faces);
+  int num_different = 0;
+  for (int i = 0; i < num_faces; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      num_different += short_faces[i].idx[j] != faces[i].idx[j] ? 1 : 0;
+    }
+  }
+  CHECK(num_different == 0);
+  const auto &padding = short_faces[num_faces];
+  CHECK(padding.idx[0] == 0 && padding.idx[1] == 0 && padding.idx[2] == 0);
+}
@@ -0,0 +1,82 @@
+#include <memory>
+#include <vector>
+
+#include <bvh/RadeonRays/intersector_skip_links.h>
+
+#include "primitive/instance.h"
+#include "primitive/mesh.h"
+#include "world/world.h"
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+// Flattened instances are bounded by their transformed object space face bounds, or with the
+// "bvh.tight_instance_bounds" option by their transformed vertices, which stay inside the former
+// under rotation.
+
+namespace {
+
+// Leaf bounds of every face of a single-level BVH over a world holding a single shape, whose
+// faces are numbered like the faces of its mesh. LBVH leafs are the bounds of their face. The
+// SAH builders keep the bounds grown by a partition that failed, as RadeonRays does, which
+// leaves the pole triangles of spheres in the bounds of their neighbors.
+std::vector<bvh::bbox> face_leaf_bounds(RadeonRays::World &world, bool tight_instance_bounds) {
+  world.options_.SetValue("bvh.builder", "lbvh");
+  world.options_.SetValue("bvh.max_leaf_size", 1.f);
+  world.options_.SetValue("bvh.tight_instance_bounds", tight_instance_bounds ? 1.f : 0.f);
+  RadeonRays::BvhBuilder builder;
+  builder.updateBvh(world);
+
+  std::vector<RadeonRays::Node> nodes(builder.getNodeCount());
+  std::vector<RadeonRays::Vertex> vertices(builder.getVertexCount());
+  std::vector<RadeonRays::Face> faces(builder.getFaceCount());
+  builder.fillBuffers(nodes, vertices, faces);
+  std::vector<bvh::bbox> res(builder.getFaceCount());
+  for (const auto &node : nodes) {
+    const int face = bvh::decode_index(node.bounds.pmin.w);
+    if (face != -1) {
+      res[face] = bvh::bbox(node.bounds.pmin, node.bounds.pmax);
+    }
+  }
+  return res;
+}
+
+} // namespace
+
+TEST(tight_instance_bounds_stay_inside_the_transformed_bounds) {
+  const auto mesh = test::make_sphere(16, 2.f);
+  std::vector<int> face_vertex_counts(mesh.triangle_count(), 3);
+  RadeonRays::Mesh base(
+    mesh.vertices.data(), int(mesh.vertices.size() / 3), 3 * int(sizeof(float)),
+    mesh.indices.data(), 0, face_vertex_counts.data(), mesh.triangle_count());
+  RadeonRays::Instance instance(&base);
+  const auto m = test::rotation(0.7f, bvh::float3(10.f, -20.f, 5.f));
+  instance.SetTransform(m, m);
+  RadeonRays::World world;
+  world.AttachShape(&instance);
+
+  const auto loose = face_leaf_bounds(world, false);
+  const auto tight = face_leaf_bounds(world, true);
+  CHECK(int(tight.size()) == mesh.triangle_count() && loose.size() == tight.size());
+
+  // Every tight leaf contains the transformed vertices of its face, within the loose leaf.
+  int num_outside = 0;
+  int num_loose = 0;
+  float loose_area = 0.f;
+  float tight_area = 0.f;
+  for (int i = 0; i < mesh.triangle_count(); ++i) {
+    bvh::bbox vertices;
+    for (int j = 0; j < 3; ++j) {
+      vertices.grow(RadeonRays::transform_point(mesh.vertex(mesh.indices[3 * i + j]), m));
+    }
+    num_outside += test::encloses(tight[i], vertices) ? 0 : 1;
+    num_loose += test::encloses(loose[i], tight[i]) ? 0 : 1;
+    loose_area += loose[i].surface_area();
+    tight_area += tight[i].surface_area();
+  }
+  CHECK(num_outside == 0);
+  CHECK(num_loose == 0);
+  // Rotating about a diagonal tilts every face, so the tight leafs are much smaller.
+  CHECK(tight_area < 0.8f * loose_area);
+}
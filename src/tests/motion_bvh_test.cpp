@@ -0,0 +1,77 @@
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/motion_bvh.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+namespace {
+
+// Leaf bounds of a soup whose vertices move randomly from one time step to the next, the time
+// steps one after the other as build_motion_bvh takes them.
+std::vector<bvh::bbox> make_moving_leafs(int num_time_steps) {
+  auto mesh = test::make_triangle_soup(5000);
+  test::Random random(5);
+  std::vector<bvh::bbox> res;
+  for (int step = 0; step < num_time_steps; ++step) {
+    const auto bounds = test::triangle_bounds(mesh);
+    res.insert(res.end(), bounds.begin(), bounds.end());
+    for (auto &x : mesh.vertices) {
+      x += (random.next() - 0.5f) * 10.f;
+    }
+  }
+  return res;
+}
+
+// Node i of a motion BVH, or leaf i of the leaf bounds, at time.
+std::vector<bvh::bbox> bounds_at(gsl::span<const bvh::bbox> nodes, int num_time_steps, float time) {
+  std::vector<bvh::bbox> res(nodes.size() / num_time_steps);
+  for (int i = 0; i < int(res.size()); ++i) {
+    res[i] = bvh::motion_node_bounds(nodes, num_time_steps, i, time);
+  }
+  return res;
+}
+
+} // namespace
+
+TEST(motion_bounds_contain_the_leafs_at_any_time) {
+  for (int num_time_steps : { 2, 3, 5 }) {
+    const auto leafs = make_moving_leafs(num_time_steps);
+    const int num_leafs = int(leafs.size()) / num_time_steps;
+    // Node-major like the nodes, to interpolate the leafs the same way.
+    std::vector<bvh::bbox> leaf_steps(leafs.size());
+    for (int step = 0; step < num_time_steps; ++step) {
+      for (int i = 0; i < num_leafs; ++i) {
+        leaf_steps[i * num_time_steps + step] = leafs[step * num_leafs + i];
+      }
+    }
+
+    for (float max_leaf_size : { 1.f, 4.f }) {
+      bvh::BvhOptions options;
+      options.SetValue("bvh.builder", "sah_parallel");
+      options.SetValue("bvh.max_leaf_size", max_leaf_size);
+      bvh::BuildContext context;
+      bvh::BvhStats stats;
+      const auto nodes = bvh::build_motion_bvh(leafs, num_time_steps, options, context, &stats);
+      const auto order = context.getPrimitiveOrder();
+      CHECK(int(nodes.size()) == stats.node_count * num_time_steps);
+
+      // The time steps themselves, and random times between them.
+      std::vector<float> times;
+      for (int step = 0; step < num_time_steps; ++step) {
+        times.push_back(float(step) / float(num_time_steps - 1));
+      }
+      test::Random random(7 * num_time_steps);
+      for (int i = 0; i < 20; ++i) {
+        times.push_back(random.next());
+      }
+      for (float time : times) {
+        CHECK_VALID(test::validate_skip_links(
+          bounds_at(nodes, num_time_steps, time), bounds_at(leaf_steps, num_time_steps, time),
+          order));
+      }
+    }
+  }
+}
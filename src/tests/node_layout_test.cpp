@@ -0,0 +1,23 @@
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/node_layout.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+TEST(node_layout_keeps_the_tree) {
+  const auto leafs = test::triangle_bounds(test::make_triangle_soup(20000));
+  for (int block_size : { 8, bvh::kPageBlockSize }) {
+    for (float max_leaf_size : { 1.f, 4.f }) {
+      bvh::BvhOptions options;
+      options.SetValue("bvh.builder", "sah_parallel");
+      options.SetValue("bvh.max_leaf_size", max_leaf_size);
+      options.SetValue("bvh.layout.block_size", float(block_size));
+      std::vector<int> order;
+      const auto nodes = test::build_nodes(leafs, options, &order);
+      CHECK_VALID(test::validate_skip_links(nodes, leafs, order));
+    }
+  }
+}
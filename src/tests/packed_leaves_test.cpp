@@ -0,0 +1,26 @@
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+// Leafs of several primitives hold packed ranges of the primitive order of the build, up to
+// kMaxLeafSize primitives each.
+
+TEST(packed_leaves_reference_the_primitive_order) {
+  for (const auto &leafs : test::test_leaf_sets()) {
+    for (const char *builder : { "sah", "sah_parallel", "lbvh", "ploc" }) {
+      for (int max_leaf_size : { 4, bvh::kMaxLeafSize }) {
+        bvh::BvhOptions options;
+        options.SetValue("bvh.builder", builder);
+        options.SetValue("bvh.max_leaf_size", float(max_leaf_size));
+        std::vector<int> order;
+        const auto nodes = test::build_nodes(leafs, options, &order);
+        CHECK(order.size() == leafs.size());
+        CHECK_VALID(test::validate_skip_links(nodes, leafs, order));
+      }
+    }
+  }
+}
@@ -0,0 +1,133 @@
+#include <cstring>
+#include <vector>
+
+#include <bvh/build_arena.h>
+#include <bvh/bvh_access.h>
+#include <bvh/bvh_builder.h>
+#include <bvh/parallel_bvh.h>
+#include <bvh/task_pool.h>
+
+#include "test.h"
+#include "test_scenes.h"
+
+// ParallelBvh builds the tree of RadeonRays::Bvh with SAH on all cores: the trees have to match
+// node for node, whatever the number of threads.
+
+namespace {
+
+constexpr float kTraversalCost = 10.f;
+constexpr int kNumBins = 64;
+
+bool same_bounds(const bvh::bbox &a, const bvh::bbox &b) {
+  for (int axis = 0; axis < 3; ++axis) {
+    if (a.pmin[axis] != b.pmin[axis] || a.pmax[axis] != b.pmax[axis]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Number of nodes of the tree of actual that differ from those of expected in bounds, type or
+// the primitives of leafs, walking both trees together.
+int count_mismatched_nodes(const RadeonRays::Bvh &expected, const RadeonRays::Bvh &actual) {
+  using Node = bvh::BvhAccess::Node;
+  struct StackEntry {
+    const Node *expected;
+    const Node *actual;
+  };
+  std::vector<StackEntry> stack = {
+    { bvh::BvhAccess::root(expected), bvh::BvhAccess::root(actual) }
+  };
+  int mismatches = 0;
+  while (!stack.empty()) {
+    const StackEntry entry = stack.back();
+    stack.pop_back();
+    if (!entry.expected || !entry.actual) {
+      mismatches += entry.expected != entry.actual ? 1 : 0;
+      continue;
+    }
+    const Node &a = *entry.expected;
+    const Node &b = *entry.actual;
+    if (a.type != b.type || !same_bounds(a.bounds, b.bounds)) {
+      ++mismatches;
+      continue;
+    }
+    if (a.type == bvh::BvhAccess::kInternal) {
+      stack.push_back({ a.lc, b.lc });
+      stack.push_back({ a.rc, b.rc });
+      continue;
+    }
+    bool same_primitives = a.numprims == b.numprims;
+    for (int i = 0; same_primitives && i < a.numprims; ++i) {
+      same_primitives =
+        expected.GetIndices()[a.startidx + i] == actual.GetIndices()[b.startidx + i];
+    }
+    mismatches += same_primitives ? 0 : 1;
+  }
+  return mismatches;
+}
+
+std::vector<bvh::bbox> build_skip_links(
+  const std::vector<bvh::bbox> &leafs,
+  bvh::TaskPool &pool,
+  int max_leaf_size,
+  std::vector<int> &out_order) {
+  bvh::ParallelBvh builder(kTraversalCost, kNumBins, pool);
+  bvh::BuildArena arena;
+  std::vector<bvh::bbox> nodes(2 * leafs.size() - 1);
+  out_order.assign(leafs.size(), -1);
+  const int num_nodes = builder.BuildSkipLinks(
+    leafs.data(), int(leafs.size()), nodes.data(), arena, max_leaf_size, out_order.data());
+  nodes.resize(num_nodes);
+  return nodes;
+}
+
+bool same_bytes(const std::vector<bvh::bbox> &a, const std::vector<bvh::bbox> &b) {
+  return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(a[0])) == 0;
+}
+
+} // namespace
+
+TEST(parallel_bvh_matches_radeon_rays_node_by_node) {
+  bvh::TaskPool single_thread(1);
+  bvh::TaskPool four_threads(4);
+  for (const auto &leafs : test::test_leaf_sets()) {
+    RadeonRays::Bvh reference(kTraversalCost, kNumBins, true);
+    reference.Build(leafs.data(), int(leafs.size()));
+    for (bvh::TaskPool *pool : { &single_thread, &four_threads, &bvh::TaskPool::global() }) {
+      bvh::ParallelBvh parallel(kTraversalCost, kNumBins, *pool);
+      parallel.Build(leafs.data(), int(leafs.size()));
+      CHECK(count_mismatched_nodes(reference, parallel) == 0);
+    }
+  }
+}
+
+TEST(sah_parallel_skip_links_match_sah) {
+  for (const auto &leafs : test::test_leaf_sets()) {
+    std::vector<bvh::bbox> nodes[2];
+    const char *builders[2] = { "sah", "sah_parallel" };
+    for (int i = 0; i < 2; ++i) {
+      bvh::BvhOptions options;
+      options.SetValue("bvh.builder", builders[i]);
+      bvh::BuildContext context;
+      std::vector<bvh::bbox> build_leafs(leafs);
+      const auto built = bvh::build_bvh(build_leafs, options, context);
+      nodes[i].assign(built.begin(), built.end());
+    }
+    CHECK(same_bytes(nodes[0], nodes[1]));
+  }
+}
+
+TEST(parallel_skip_links_do_not_depend_on_the_thread_count) {
+  bvh::TaskPool single_thread(1);
+  bvh::TaskPool four_threads(4);
+  for (const auto &leafs : test::test_leaf_sets()) {
+    for (int max_leaf_size : { 1, 4 }) {
+      std::vector<int> order[2];
+      const auto serial = build_skip_links(leafs, single_thread, max_leaf_size, order[0]);
+      const auto parallel = build_skip_links(leafs, four_threads, max_leaf_size, order[1]);
+      CHECK(same_bytes(serial, parallel));
+      CHECK(order[0] == order[1]);
+    }
+  }
+}
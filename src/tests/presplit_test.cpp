@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/presplit.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+// presplit_triangles splits the bounds of large triangles into references clipped to the
+// triangle. Long slivers across the diagonal of the scene waste the most of their bounds, and
+// get most of the references.
+
+namespace {
+
+// Small triangles, with num_slivers long thin triangles along the diagonals of the scene.
+test::TestMesh make_slivers(int num_slivers) {
+  auto mesh = test::make_triangle_soup(4000);
+  test::Random random(11);
+  for (int i = 0; i < num_slivers; ++i) {
+    const bvh::float3 start(random.next() * 20.f, random.next() * 20.f, random.next() * 20.f);
+    const float sign = i % 2 ? -1.f : 1.f;
+    const bvh::float3 end = start + bvh::float3(80.f, 80.f * sign, 80.f) * (0.5f + random.next());
+    const bvh::float3 width(random.next() * 0.1f, 0.f, random.next() * 0.1f);
+    for (const auto &v : { start, end, start + width }) {
+      mesh.vertices.insert(mesh.vertices.end(), { v.x, v.y, v.z });
+      mesh.indices.push_back(int(mesh.vertices.size() / 3) - 1);
+    }
+  }
+  return mesh;
+}
+
+// Whether the triangle has a point in bounds grown by epsilon relative to the scene: the
+// triangle clipped to the six planes of the bounds keeps some of its area or edges.
+bool overlaps(const bvh::float3 (&triangle)[3], const bvh::bbox &bounds, float epsilon) {
+  std::vector<bvh::float3> polygon(triangle, triangle + 3);
+  for (int axis = 0; axis < 3 && !polygon.empty(); ++axis) {
+    for (int side = 0; side < 2 && !polygon.empty(); ++side) {
+      const float sign = side ? -1.f : 1.f;
+      const float plane = side ? bounds.pmax[axis] + epsilon : bounds.pmin[axis] - epsilon;
+      // Signed distance inside the plane, clip to the positive side.
+      const auto distance = [&](const bvh::float3 &p) { return sign * (p[axis] - plane); };
+      std::vector<bvh::float3> clipped;
+      for (size_t i = 0; i < polygon.size(); ++i) {
+        const auto &a = polygon[i];
+        const auto &b = polygon[(i + 1) % polygon.size()];
+        const float da = distance(a);
+        const float db = distance(b);
+        if (da >= 0.f) {
+          clipped.push_back(a);
+        }
+        if ((da < 0.f && db > 0.f) || (da > 0.f && db < 0.f)) {
+          clipped.push_back(a + (b - a) * (da / (da - db)));
+        }
+      }
+      polygon.swap(clipped);
+    }
+  }
+  return !polygon.empty();
+}
+
+} // namespace
+
+TEST(presplit_references_cover_their_triangles) {
+  const auto mesh = make_slivers(200);
+  const int num_triangles = mesh.triangle_count();
+  const auto triangle_bounds = test::triangle_bounds(mesh);
+  bvh::bbox scene;
+  for (const auto &bounds : triangle_bounds) {
+    scene.grow(bounds);
+  }
+  const float epsilon = 1e-5f * std::max(scene.extents().x, 1.f);
+
+  for (float budget : { 0.1f, 0.3f, 1.f }) {
+    const auto presplit = bvh::presplit_triangles(mesh.vertices, mesh.indices, budget);
+    const int num_refs = int(presplit.bounds.size());
+    CHECK(presplit.triangles.size() == presplit.bounds.size());
+    CHECK(num_refs > num_triangles);
+    CHECK(num_refs <= num_triangles + int(std::floor(budget * num_triangles)));
+
+    // Every triangle keeps a reference, and references are in triangle order.
+    std::vector<int> counts(num_triangles);
+    bool sorted = true;
+    for (int i = 0; i < num_refs; ++i) {
+      ++counts[presplit.triangles[i]];
+      sorted &= i == 0 || presplit.triangles[i - 1] <= presplit.triangles[i];
+    }
+    CHECK(sorted);
+    CHECK(*std::min_element(counts.begin(), counts.end()) >= 1);
+
+    // The slivers, added last, got split.
+    int num_split_slivers = 0;
+    for (int i = num_triangles - 200; i < num_triangles; ++i) {
+      num_split_slivers += counts[i] > 1 ? 1 : 0;
+    }
+    CHECK(num_split_slivers > 100);
+
+    // References are clipped to their triangle.
+    int num_outside = 0;
+    int num_disjoint = 0;
+    for (int i = 0; i < num_refs; ++i) {
+      const int triangle = presplit.triangles[i];
+      const auto &bounds = presplit.bounds[i];
+      const bvh::float3 vertices[3] = {
+        mesh.vertex(mesh.indices[3 * triangle]),
+        mesh.vertex(mesh.indices[3 * triangle + 1]),
+        mesh.vertex(mesh.indices[3 * triangle + 2]),
+      };
+      num_outside += test::encloses(triangle_bounds[triangle], bounds) ? 0 : 1;
+      num_disjoint += overlaps(vertices, bounds, epsilon) ? 0 : 1;
+    }
+    CHECK(num_outside == 0);
+    CHECK(num_disjoint == 0);
+  }
+}
+
+TEST(presplit_bvh_reaches_every_triangle) {
+  const auto mesh = make_slivers(200);
+  const auto triangle_bounds = test::triangle_bounds(mesh);
+  const auto presplit = bvh::presplit_triangles(mesh.vertices, mesh.indices, 0.3f);
+  test::ValidationOptions split_references;
+  split_references.split_references = true;
+
+  for (float max_leaf_size : { 1.f, 4.f }) {
+    bvh::BvhOptions options;
+    options.SetValue("bvh.builder", "sah_parallel");
+    options.SetValue("bvh.max_leaf_size", max_leaf_size);
+    std::vector<int> order;
+    auto nodes = test::build_nodes(presplit.bounds, options, &order);
+    // Over the references, every one of them in exactly one leaf.
+    CHECK_VALID(test::validate_skip_links(nodes, presplit.bounds, order));
+
+    // Over the triangles, as the Granite app uploads them: single triangle leafs remapped to
+    // their triangle, or the primitive order of ranges replaced by the triangles.
+    if (order.empty()) {
+      bvh::remap_leaf_triangles(nodes, presplit.triangles);
+    } else {
+      for (auto &primitive : order) {
+        primitive = presplit.triangles[primitive];
+      }
+    }
+    CHECK_VALID(test::validate_skip_links(nodes, triangle_bounds, order, split_references));
+  }
+}
@@ -0,0 +1,79 @@
+#include <cmath>
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/quantized_vertices.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+// Vertices quantized to 16 bits per cluster by quantize_vertices decode within their error, and
+// leafs grown by that error keep the decoded triangles.
+
+TEST(quantized_triangles_stay_in_their_leafs) {
+  const auto mesh = test::make_sphere(64, 100.f);
+  const auto leafs = test::triangle_bounds(mesh);
+  bvh::BvhOptions options;
+  options.SetValue("bvh.builder", "sah_parallel");
+  options.SetValue("bvh.max_leaf_size", 4.f);
+  std::vector<int> order;
+  auto nodes = test::build_nodes(leafs, options, &order);
+
+  // As the Granite app does: faces in leaf order, vertices quantized in that order, leafs grown
+  // by the quantization error of their vertices and the tree refitted.
+  std::vector<int> indices(mesh.indices.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    for (int j = 0; j < 3; ++j) {
+      indices[3 * i + j] = mesh.indices[3 * order[i] + j];
+    }
+  }
+  std::vector<float> vertices(mesh.vertices);
+  const auto quantized = bvh::quantize_vertices(vertices, indices);
+  std::vector<bvh::bbox> grown_leafs(leafs);
+  std::vector<bvh::bbox> decoded_leafs(leafs.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    bvh::float3 error(0.f, 0.f, 0.f);
+    for (int j = 0; j < 3; ++j) {
+      error = vmax(error, bvh::vertex_quantization_error(quantized, indices[3 * i + j]));
+      decoded_leafs[order[i]].grow(bvh::decode_vertex(quantized, indices[3 * i + j]));
+    }
+    grown_leafs[order[i]].pmin = grown_leafs[order[i]].pmin - error;
+    grown_leafs[order[i]].pmax = grown_leafs[order[i]].pmax + error;
+  }
+  bvh::refit_bvh(nodes, grown_leafs, order);
+  CHECK_VALID(test::validate_skip_links(nodes, decoded_leafs, order));
+  CHECK_VALID(test::validate_skip_links(nodes, leafs, order));
+}
+
+TEST(quantized_vertices_round_trip) {
+  const auto mesh = test::make_sphere(64, 100.f);
+  std::vector<float> vertices(mesh.vertices);
+  std::vector<int> indices(mesh.indices);
+  const auto quantized = bvh::quantize_vertices(vertices, indices);
+
+  // The renumbered indices address the same positions in the reordered vertices.
+  CHECK(vertices.size() == mesh.vertices.size());
+  bool same_positions = true;
+  for (size_t i = 0; i < indices.size(); ++i) {
+    for (int axis = 0; axis < 3; ++axis) {
+      same_positions &=
+        vertices[3 * indices[i] + axis] == mesh.vertices[3 * mesh.indices[i] + axis];
+    }
+  }
+  CHECK(same_positions);
+
+  // Every vertex decodes within the quantization error of its position.
+  int num_far_vertices = 0;
+  for (int i = 0; i < int(vertices.size() / 3); ++i) {
+    const bvh::float3 decoded = bvh::decode_vertex(quantized, i);
+    const bvh::float3 error = bvh::vertex_quantization_error(quantized, i);
+    for (int axis = 0; axis < 3; ++axis) {
+      if (std::abs(decoded[axis] - vertices[3 * i + axis]) > error[axis]) {
+        ++num_far_vertices;
+        break;
+      }
+    }
+  }
+  CHECK(num_far_vertices == 0);
+}
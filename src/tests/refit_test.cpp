@@ -0,0 +1,27 @@
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+TEST(refit_contains_moved_primitives) {
+  auto mesh = test::make_triangle_soup(20000);
+  const auto leafs = test::triangle_bounds(mesh);
+  test::Random random(7);
+  for (auto &x : mesh.vertices) {
+    x += (random.next() - 0.5f) * 2.f;
+  }
+  const auto moved_leafs = test::triangle_bounds(mesh);
+
+  for (float max_leaf_size : { 1.f, 4.f }) {
+    bvh::BvhOptions options;
+    options.SetValue("bvh.builder", "sah_parallel");
+    options.SetValue("bvh.max_leaf_size", max_leaf_size);
+    std::vector<int> order;
+    auto nodes = test::build_nodes(leafs, options, &order);
+    bvh::refit_bvh(nodes, moved_leafs, order);
+    CHECK_VALID(test::validate_skip_links(nodes, moved_leafs, order));
+  }
+}
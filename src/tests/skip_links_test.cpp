@@ -0,0 +1,25 @@
+#include <string>
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+// Every builder preset produces valid skip-links nodes over the test leaf sets. The other node
+// formats and the steps after the build have their own test files.
+
+TEST(builders_produce_valid_skip_links) {
+  for (const auto &leafs : test::test_leaf_sets()) {
+    for (const auto &preset : bvh::builder_presets()) {
+      bvh::BvhOptions options;
+      bvh::set_builder_preset(preset, options);
+      std::vector<int> order;
+      const auto nodes = test::build_nodes(leafs, options, &order);
+      const auto error =
+        test::validate_skip_links(nodes, leafs, order, test::validation_options(options));
+      CHECK_VALID(error.empty() ? error : std::string(preset.label) + ": " + error);
+    }
+  }
+}
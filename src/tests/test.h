@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+
+// Minimal test harness of main_test.cpp. TEST(name) defines a test that main runs, CHECK(expr)
+// reports a failed expression and carries on, CHECK_VALID(error) reports the error strings of
+// the validators in bvh_validation.h.
+namespace test {
+
+using TestFn = void (*)();
+
+struct Register {
+  Register(const char *name, TestFn fn);
+};
+
+void fail(const char *file, int line, const std::string &message);
+
+} // namespace test
+
+#define TEST(name)                                          \
+  static void name();                                       \
+  static const test::Register name##_register(#name, name); \
+  static void name()
+
+#define CHECK(expr)                            \
+  do {                                         \
+    if (!(expr)) {                             \
+      test::fail(__FILE__, __LINE__, #expr);   \
+    }                                          \
+  } while (0)
+
+#define CHECK_VALID(error)                               \
+  do {                                                   \
+    const std::string check_error = (error);             \
+    if (!check_error.empty()) {                          \
+      test::fail(__FILE__, __LINE__, check_error);       \
+    }                                                    \
+  } while (0)
@@ -0,0 +1,182 @@
+#include "test_scenes.h"
+
+#include <cmath>
+
+namespace test {
+
+float Random::next() {
+  m_state ^= m_state << 13;
+  m_state ^= m_state >> 17;
+  m_state ^= m_state << 5;
+  return float(m_state >> 8) * (1.f / 16777216.f);
+}
+
+TestMesh make_triangle_soup(int num_triangles, uint32_t seed) {
+  TestMesh mesh;
+  Random random(seed);
+  const auto add_vertex = [&](float x, float y, float z) {
+    mesh.vertices.insert(mesh.vertices.end(), { x, y, z });
+    mesh.indices.push_back(int(mesh.vertices.size() / 3) - 1);
+  };
+  for (int i = 0; i < num_triangles; ++i) {
+    if (i % 1013 == 5 && i > 0) {
+      // Duplicate of the previous triangle.
+      const int first = int(mesh.indices.size()) - 3;
+      for (int j = 0; j < 3; ++j) {
+        const int v = mesh.indices[first + j];
+        add_vertex(mesh.vertices[3 * v], mesh.vertices[3 * v + 1], mesh.vertices[3 * v + 2]);
+      }
+      continue;
+    }
+    // Clusters of small triangles on a grid, with long thin and large ones in between.
+    const int cluster = int(random.next() * 64.f);
+    const float cx = float(cluster % 4) * 25.f + random.next() * 10.f;
+    const float cy = float(cluster / 4 % 4) * 25.f + random.next() * 10.f;
+    const float cz = float(cluster / 16) * 25.f + random.next() * 10.f;
+    float size = 0.1f;
+    if (i % 97 == 0) {
+      size = 40.f;
+    } else if (i % 31 == 0) {
+      size = 8.f;
+    }
+    if (i % 509 == 3) {
+      // Degenerate: all three vertices at one point.
+      for (int j = 0; j < 3; ++j) {
+        add_vertex(cx, cy, cz);
+      }
+      continue;
+    }
+    for (int j = 0; j < 3; ++j) {
+      add_vertex(
+        cx + random.next() * size, cy + random.next() * (i % 31 == 0 ? 0.05f : size),
+        cz + random.next() * size);
+    }
+  }
+  return mesh;
+}
+
+TestMesh make_sphere(int rings, float radius) {
+  TestMesh mesh;
+  const float pi = 3.14159265358979f;
+  const int segments = 2 * rings;
+  for (int i = 0; i <= rings; ++i) {
+    const float theta = pi * float(i) / float(rings);
+    for (int j = 0; j <= segments; ++j) {
+      const float phi = pi * float(j) / float(rings);
+      mesh.vertices.insert(
+        mesh.vertices.end(), { radius * std::sin(theta) * std::cos(phi),
+                               radius * std::cos(theta),
+                               radius * std::sin(theta) * std::sin(phi) });
+    }
+  }
+  const int row = segments + 1;
+  for (int i = 0; i < rings; ++i) {
+    for (int j = 0; j < segments; ++j) {
+      const int a = i * row + j;
+      const int b = a + row;
+      mesh.indices.insert(mesh.indices.end(), { a, b, a + 1, a + 1, b, b + 1 });
+    }
+  }
+  return mesh;
+}
+
+RadeonRays::matrix rotation(float angle, const bvh::float3 &translation) {
+  const float c = std::cos(angle);
+  const float s = std::sin(angle);
+  const float t = (1.f - c) / 3.f;
+  const float r = s / std::sqrt(3.f);
+  RadeonRays::matrix m;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      m.m[i][j] = t + (i == j ? c : ((j - i + 3) % 3 == 1 ? -r : r));
+    }
+    m.m[i][3] = translation[i];
+  }
+  return m;
+}
+
+std::vector<bvh::bbox> triangle_bounds(const TestMesh &mesh) {
+  std::vector<bvh::bbox> res(mesh.triangle_count());
+  for (int i = 0; i < mesh.triangle_count(); ++i) {
+    for (int j = 0; j < 3; ++j) {
+      res[i].grow(mesh.vertex(mesh.indices[3 * i + j]));
+    }
+  }
+  return res;
+}
+
+std::vector<TestRay> make_rays(const bvh::bbox &bounds, int num_rays, uint32_t seed) {
+  Random random(seed);
+  const auto point = [&](float margin) {
+    bvh::float3 p;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float extent = bounds.pmax[axis] - bounds.pmin[axis];
+      p[axis] = bounds.pmin[axis] + extent * ((1.f + 2.f * margin) * random.next() - margin);
+    }
+    return p;
+  };
+  std::vector<TestRay> res(num_rays);
+  for (auto &ray : res) {
+    ray.o = point(0.5f);
+    ray.d = point(0.f) - ray.o;
+    ray.time = random.next();
+  }
+  return res;
+}
+
+bool intersect_triangle(
+  const bvh::float3 &v0,
+  const bvh::float3 &v1,
+  const bvh::float3 &v2,
+  const bvh::float3 &o,
+  const bvh::float3 &d,
+  float &tmax) {
+  const bvh::float3 e1 = v1 - v0;
+  const bvh::float3 e2 = v2 - v0;
+  const bvh::float3 p = cross(d, e2);
+  const float det = dot(e1, p);
+  if (det == 0.f) {
+    return false;
+  }
+  const float inv_det = 1.f / det;
+  const bvh::float3 s = o - v0;
+  const float u = dot(s, p) * inv_det;
+  if (u < 0.f || u > 1.f) {
+    return false;
+  }
+  const bvh::float3 q = cross(s, e1);
+  const float v = dot(d, q) * inv_det;
+  if (v < 0.f || u + v > 1.f) {
+    return false;
+  }
+  const float t = dot(e2, q) * inv_det;
+  if (!(t > 0.f && t < tmax)) {
+    return false;
+  }
+  tmax = t;
+  return true;
+}
+
+std::vector<std::vector<bvh::bbox>> test_leaf_sets() {
+  std::vector<std::vector<bvh::bbox>> res = {
+    triangle_bounds(make_triangle_soup(20000)),
+    triangle_bounds(make_sphere(40)),
+  };
+  for (int count : { 1, 2, 3, 17 }) {
+    res.push_back(triangle_bounds(make_triangle_soup(count, uint32_t(count))));
+  }
+  return res;
+}
+
+std::vector<bvh::bbox> build_nodes(
+  std::vector<bvh::bbox> leafs, const bvh::BvhOptions &options, std::vector<int> *out_order) {
+  bvh::BuildContext context;
+  const auto nodes = bvh::build_bvh(leafs, options, context);
+  if (out_order) {
+    const auto order = context.getPrimitiveOrder();
+    out_order->assign(order.begin(), order.end());
+  }
+  return std::vector<bvh::bbox>(nodes.begin(), nodes.end());
+}
+
+} // namespace test
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+
+namespace test {
+
+// Indexed triangles: xyz vertex triples and three vertex indices per triangle.
+struct TestMesh {
+  std::vector<float> vertices;
+  std::vector<int> indices;
+
+  int triangle_count() const { return int(indices.size() / 3); }
+  bvh::float3 vertex(int index) const {
+    return bvh::float3(vertices[3 * index], vertices[3 * index + 1], vertices[3 * index + 2]);
+  }
+};
+
+// Same geometry on every platform: a xorshift generator rather than the standard distributions,
+// whose results differ between standard libraries.
+class Random {
+ public:
+  explicit Random(uint32_t seed) : m_state(seed ? seed : 1) {}
+  // Uniform in [0, 1).
+  float next();
+
+ private:
+  uint32_t m_state;
+};
+
+// Triangle soup with the cases builders trip over: clusters of small triangles, long thin and
+// large ones, exact duplicates and degenerate triangles. Vertices are not shared.
+TestMesh make_triangle_soup(int num_triangles, uint32_t seed = 1);
+
+// Sphere of 4 * rings * rings triangles sharing their vertices, a closed mesh like the ones
+// of real scenes.
+TestMesh make_sphere(int rings, float radius = 1.f);
+
+// Rotation by angle radians about the (1, 1, 1) axis, which moves every axis into the others,
+// then translation.
+RadeonRays::matrix rotation(float angle, const bvh::float3 &translation);
+
+// Bounds of every triangle, the leaf bounds to build a BVH over.
+std::vector<bvh::bbox> triangle_bounds(const TestMesh &mesh);
+
+// Rays from random points around bounds towards random points inside them, at random times in
+// [0, 1] for motion BVHs.
+struct TestRay {
+  bvh::float3 o;
+  bvh::float3 d;
+  float time;
+};
+std::vector<TestRay> make_rays(const bvh::bbox &bounds, int num_rays, uint32_t seed = 1);
+
+// Moller-Trumbore test of the triangle v0 v1 v2. On a hit closer than tmax, lowers tmax to it.
+bool intersect_triangle(
+  const bvh::float3 &v0,
+  const bvh::float3 &v1,
+  const bvh::float3 &v2,
+  const bvh::float3 &o,
+  const bvh::float3 &d,
+  float &tmax);
+
+// Leaf bounds most tests run on: the soup, a sphere, and trees of a few leafs.
+std::vector<std::vector<bvh::bbox>> test_leaf_sets();
+
+// Skip-links nodes of build_bvh over leafs, and the primitive order of their leaf ranges if
+// out_order is not null.
+std::vector<bvh::bbox> build_nodes(
+  std::vector<bvh::bbox> leafs,
+  const bvh::BvhOptions &options,
+  std::vector<int> *out_order = nullptr);
+
+} // namespace test
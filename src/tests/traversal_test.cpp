@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/compressed_bvh.h>
+#include <bvh/motion_bvh.h>
+#include <bvh/traversal.h>
+#include <bvh/wide_bvh.h>
+
+#include "test.h"
+#include "test_scenes.h"
+
+// The CPU traversals of traversal.h find the closest hits of brute force in every node format,
+// and report what they fetch per ray: the node bytes per ray table of the node formats. Run
+// alone with `main_test traversal`.
+
+namespace {
+
+constexpr int kNumRays = 2000;
+constexpr float kNoHit = 1e30f;
+
+// Triangles of a mesh moving linearly between num_time_steps copies of its vertices, a single
+// one for static meshes.
+struct MovingMesh {
+  std::vector<test::TestMesh> steps;
+
+  bvh::float3 vertex(int index, float time) const {
+    if (steps.size() < 2) {
+      return steps[0].vertex(index);
+    }
+    // The interpolation of motion_node_bounds, and of get_vertex in bvh.glslh.
+    const int num_steps = int(steps.size());
+    const float t = time * float(num_steps - 1);
+    const int step = std::min(int(t), num_steps - 2);
+    const float weight = t - float(step);
+    return steps[step].vertex(index) * (1.f - weight) + steps[step + 1].vertex(index) * weight;
+  }
+
+  bool intersect(int triangle, const test::TestRay &ray, float &tmax) const {
+    const auto &indices = steps[0].indices;
+    return test::intersect_triangle(
+      vertex(indices[3 * triangle], ray.time), vertex(indices[3 * triangle + 1], ray.time),
+      vertex(indices[3 * triangle + 2], ray.time), ray.o, ray.d, tmax);
+  }
+
+  float closest_hit(const test::TestRay &ray) const {
+    float tmax = kNoHit;
+    for (int i = 0; i < steps[0].triangle_count(); ++i) {
+      intersect(i, ray, tmax);
+    }
+    return tmax;
+  }
+};
+
+// Intersects the triangles of a leaf payload, a triangle index or a range of order.
+struct LeafIntersector {
+  const MovingMesh &mesh;
+  gsl::span<const int> order;
+  const test::TestRay &ray;
+
+  void operator()(uint32_t payload, float &tmax) const {
+    if (order.empty()) {
+      mesh.intersect(int(payload), ray, tmax);
+    } else {
+      const float w = bvh::encode_index(payload);
+      const int start = bvh::leaf_range_start(w);
+      for (int i = start; i < start + bvh::leaf_range_count(w); ++i) {
+        mesh.intersect(order[i], ray, tmax);
+      }
+    }
+  }
+};
+
+struct FormatResult {
+  const char *label;
+  bvh::TraversalStats stats;
+  int mismatches = 0;
+};
+
+void print_results(const std::vector<FormatResult> &results) {
+  for (const auto &result : results) {
+    const auto &stats = result.stats;
+    printf(
+      "    %-16s %7.1f nodes %8.1f KB %7.1f lines %5.2f pages %6.1f leafs per ray\n",
+      result.label, double(stats.nodes) / kNumRays, stats.node_bytes / 1024.0 / kNumRays,
+      double(stats.lines) / kNumRays, double(stats.pages) / kNumRays,
+      double(stats.leafs) / kNumRays);
+  }
+}
+
+MovingMesh make_moving_soup(int num_time_steps) {
+  MovingMesh mesh;
+  mesh.steps.push_back(test::make_triangle_soup(5000));
+  test::Random random(3);
+  for (int step = 1; step < num_time_steps; ++step) {
+    mesh.steps.push_back(mesh.steps.back());
+    for (auto &x : mesh.steps.back().vertices) {
+      x += (random.next() - 0.5f) * 4.f;
+    }
+  }
+  return mesh;
+}
+
+} // namespace
+
+TEST(traversals_find_the_closest_hits) {
+  const struct {
+    const char *label;
+    test::TestMesh mesh;
+  } scenes[] = {
+    { "soup", test::make_triangle_soup(5000) },
+    { "sphere", test::make_sphere(24) },
+  };
+  for (const auto &scene : scenes) {
+    const MovingMesh mesh = { { scene.mesh } };
+    const auto leafs = test::triangle_bounds(scene.mesh);
+    bvh::bbox bounds;
+    for (const auto &leaf : leafs) {
+      bounds.grow(leaf);
+    }
+    const auto rays = test::make_rays(bounds, kNumRays);
+    std::vector<float> expected(rays.size());
+    for (size_t i = 0; i < rays.size(); ++i) {
+      expected[i] = mesh.closest_hit(rays[i]);
+    }
+
+    for (float max_leaf_size : { 1.f, 4.f }) {
+      printf("  %s, %d per leaf:\n", scene.label, int(max_leaf_size));
+      bvh::BvhOptions options;
+      options.SetValue("bvh.builder", "sah_parallel");
+      options.SetValue("bvh.max_leaf_size", max_leaf_size);
+      std::vector<int> order;
+      const auto nodes = test::build_nodes(leafs, options, &order);
+      const auto compressed = bvh::compress_bvh(nodes);
+      const auto wide4 = bvh::collapse_bvh<4>(gsl::span<const bvh::bbox>(nodes));
+      const auto wide8 = bvh::collapse_bvh<8>(gsl::span<const bvh::bbox>(nodes));
+      CHECK(!compressed.empty() && !wide4.empty() && !wide8.empty());
+
+      std::vector<FormatResult> results = {
+        { "binary" }, { "compressed" }, { "wide 4" }, { "wide 8" }
+      };
+      for (size_t i = 0; i < rays.size(); ++i) {
+        const auto &ray = rays[i];
+        const LeafIntersector leaf = { mesh, order, ray };
+        const float t[4] = {
+          bvh::traverse_bvh(nodes, ray.o, ray.d, kNoHit, leaf, &results[0].stats),
+          bvh::traverse_compressed_bvh(compressed, ray.o, ray.d, kNoHit, leaf, &results[1].stats),
+          bvh::traverse_wide_bvh<4>(wide4, ray.o, ray.d, kNoHit, leaf, &results[2].stats),
+          bvh::traverse_wide_bvh<8>(wide8, ray.o, ray.d, kNoHit, leaf, &results[3].stats),
+        };
+        for (int format = 0; format < 4; ++format) {
+          results[format].mismatches += t[format] != expected[i] ? 1 : 0;
+        }
+      }
+      print_results(results);
+      for (const auto &result : results) {
+        CHECK(result.mismatches == 0);
+      }
+    }
+  }
+}
+
+TEST(motion_traversal_finds_the_closest_hits) {
+  for (int num_time_steps : { 2, 3 }) {
+    const auto mesh = make_moving_soup(num_time_steps);
+    std::vector<bvh::bbox> leafs;
+    bvh::bbox bounds;
+    for (const auto &step : mesh.steps) {
+      for (const auto &leaf : test::triangle_bounds(step)) {
+        leafs.push_back(leaf);
+        bounds.grow(leaf);
+      }
+    }
+    const auto rays = test::make_rays(bounds, kNumRays);
+
+    for (float max_leaf_size : { 1.f, 4.f }) {
+      printf("  soup, %d time steps, %d per leaf:\n", num_time_steps, int(max_leaf_size));
+      bvh::BvhOptions options;
+      options.SetValue("bvh.builder", "sah_parallel");
+      options.SetValue("bvh.max_leaf_size", max_leaf_size);
+      bvh::BuildContext context;
+      const auto nodes = bvh::build_motion_bvh(leafs, num_time_steps, options, context);
+      const auto order = context.getPrimitiveOrder();
+
+      std::vector<FormatResult> results = { { "motion" } };
+      for (const auto &ray : rays) {
+        const float t = bvh::traverse_motion_bvh(
+          nodes, num_time_steps, ray.o, ray.d, ray.time, kNoHit,
+          LeafIntersector{ mesh, order, ray }, &results[0].stats);
+        results[0].mismatches += t != mesh.closest_hit(ray) ? 1 : 0;
+      }
+      print_results(results);
+      CHECK(results[0].mismatches == 0);
+    }
+  }
+}
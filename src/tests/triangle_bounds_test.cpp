@@ -0,0 +1,132 @@
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+#include <bvh/triangle_bounds.h>
+
+#include "test.h"
+#include "test_scenes.h"
+
+// compute_triangle_bounds gives the bounds of the scalar loop it replaces, in every instruction
+// set, for every layout of vertices and indices it reads in place.
+
+namespace {
+
+// Vertices of mesh at stride bytes, anything but positions set to NaN.
+std::vector<float> vertex_buffer(const test::TestMesh &mesh, int floats_per_vertex) {
+  const int num_vertices = int(mesh.vertices.size() / 3);
+  std::vector<float> res(
+    size_t(num_vertices) * floats_per_vertex, std::numeric_limits<float>::quiet_NaN());
+  for (int i = 0; i < num_vertices; ++i) {
+    for (int axis = 0; axis < 3; ++axis) {
+      res[size_t(i) * floats_per_vertex + axis] = mesh.vertices[3 * i + axis];
+    }
+  }
+  return res;
+}
+
+// Indices of mesh as Index, indices_per_face to a face, the ones past the triangle set to ~0.
+template <typename Index>
+std::vector<Index> index_buffer(const test::TestMesh &mesh, int indices_per_face) {
+  std::vector<Index> res(size_t(mesh.triangle_count()) * indices_per_face, Index(~0u));
+  for (int i = 0; i < mesh.triangle_count(); ++i) {
+    for (int j = 0; j < 3; ++j) {
+      res[size_t(i) * indices_per_face + j] = Index(mesh.indices[3 * i + j]);
+    }
+  }
+  return res;
+}
+
+struct Layout {
+  const char *label;
+  int floats_per_vertex;
+  int index_size;
+  int indices_per_face;
+};
+
+bool same(const bvh::bbox &a, const bvh::bbox &b) {
+  return a.pmin.x == b.pmin.x && a.pmin.y == b.pmin.y && a.pmin.z == b.pmin.z &&
+    a.pmax.x == b.pmax.x && a.pmax.y == b.pmax.y && a.pmax.z == b.pmax.z && a.pmin.w == 0.f &&
+    a.pmax.w == 0.f;
+}
+
+} // namespace
+
+TEST(triangle_bounds_match_the_scalar_loop) {
+  // An odd number of triangles in more than one parallel chunk, few enough vertices for 16-bit
+  // indices, and a single triangle, the tail of the AVX2 loop alone.
+  const auto soup = test::make_triangle_soup(20001);
+  test::TestMesh single;
+  single.vertices.assign(soup.vertices.begin(), soup.vertices.begin() + 9);
+  single.indices = { 2, 0, 1 };
+  const test::TestMesh *meshes[] = { &soup, &single };
+  const Layout layouts[] = {
+    { "float3, uint32", 3, 4, 3 },
+    { "float3, uint16", 3, 2, 3 },
+    { "float4, uint32 in 16 bytes", 4, 4, 4 },
+    { "float4, uint16 in 8 bytes", 4, 2, 4 },
+  };
+  const auto rotated = test::rotation(0.7f, bvh::float3(10.f, -20.f, 5.f));
+  const RadeonRays::matrix *transforms[] = { nullptr, &rotated };
+  const bvh::TriangleBoundsSimd simds[] = {
+    bvh::kTriangleBoundsBest, bvh::kTriangleBoundsSse, bvh::kTriangleBoundsAvx2
+  };
+  CHECK(bvh::has_triangle_bounds_simd(bvh::kTriangleBoundsBest));
+
+  for (const auto simd : simds) {
+    if (!bvh::has_triangle_bounds_simd(simd)) {
+      printf("  instruction set %d not supported, skipped\n", int(simd));
+      continue;
+    }
+    for (const auto *mesh : meshes) {
+      for (const auto *transform : transforms) {
+        // The scalar loop.
+        const int num_triangles = mesh->triangle_count();
+        std::vector<bvh::bbox> expected(num_triangles);
+        bvh::bbox expected_bounds;
+        bvh::bbox expected_centroids;
+        for (int i = 0; i < num_triangles; ++i) {
+          for (int j = 0; j < 3; ++j) {
+            const auto vertex = mesh->vertex(mesh->indices[3 * i + j]);
+            expected[i].grow(transform ? RadeonRays::transform_point(vertex, *transform) : vertex);
+          }
+          expected_bounds.grow(expected[i]);
+          expected_centroids.grow(expected[i].center());
+        }
+
+        for (const auto &layout : layouts) {
+          const auto vertices = vertex_buffer(*mesh, layout.floats_per_vertex);
+          const auto indices16 = index_buffer<uint16_t>(*mesh, layout.indices_per_face);
+          const auto indices32 = index_buffer<uint32_t>(*mesh, layout.indices_per_face);
+          const bvh::VertexStream vertex_stream = {
+            vertices.data(), layout.floats_per_vertex * sizeof(float)
+          };
+          const bvh::IndexStream index_stream = {
+            layout.index_size == 2 ? static_cast<const void *>(indices16.data())
+                                   : static_cast<const void *>(indices32.data()),
+            layout.index_size, size_t(layout.index_size * layout.indices_per_face)
+          };
+          std::vector<bvh::bbox> bounds(num_triangles);
+          const auto res = bvh::compute_triangle_bounds(
+            vertex_stream, index_stream, num_triangles, bounds, transform,
+            bvh::TaskPool::global(), simd);
+
+          int num_different = 0;
+          for (int i = 0; i < num_triangles; ++i) {
+            num_different += same(bounds[i], expected[i]) ? 0 : 1;
+          }
+          if (num_different || !same(res.bounds, expected_bounds) ||
+              !same(res.centroid_bounds, expected_centroids)) {
+            printf(
+              "  instruction set %d, %d triangles, %s, %s: %d different bounds\n", int(simd),
+              num_triangles, transform ? "rotated" : "object space", layout.label, num_different);
+          }
+          CHECK(num_different == 0);
+          CHECK(same(res.bounds, expected_bounds));
+          CHECK(same(res.centroid_bounds, expected_centroids));
+        }
+      }
+    }
+  }
+}
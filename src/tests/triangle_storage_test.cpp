@@ -0,0 +1,148 @@
+#include <cmath>
+#include <vector>
+
+#include <bvh/triangle_storage.h>
+
+#include "test.h"
+#include "test_scenes.h"
+
+// The packed triangle formats of triangle_storage.h: inline vertices and Woop transforms hit
+// where the triangles of the mesh are.
+
+namespace {
+
+// The soup with its degenerate triangles, plus collinear ones, exactly so in float.
+test::TestMesh make_storage_mesh() {
+  auto mesh = test::make_triangle_soup(5000);
+  for (int i = 0; i < 20; ++i) {
+    const bvh::float3 start(float(i), float(i % 7), float(i % 5));
+    const bvh::float3 step(0.5f * float(i % 3), 0.25f * float(i % 4 + 1), 1.f);
+    for (float k : { 0.f, 1.f, 3.f }) {
+      const bvh::float3 v = start + step * k;
+      mesh.vertices.insert(mesh.vertices.end(), { v.x, v.y, v.z });
+      mesh.indices.push_back(int(mesh.vertices.size() / 3) - 1);
+    }
+  }
+  return mesh;
+}
+
+bvh::float3 normal(const bvh::float3 (&v)[3]) {
+  return cross(v[1] - v[0], v[2] - v[0]);
+}
+
+bool near(float a, float b, float tolerance) {
+  return std::abs(a - b) <= tolerance * std::max(1.f, std::abs(b));
+}
+
+} // namespace
+
+TEST(packed_triangles_hit_like_the_mesh) {
+  const auto mesh = make_storage_mesh();
+  const int num_triangles = mesh.triangle_count();
+  const auto inline_vertices =
+    bvh::pack_triangles(mesh.vertices, mesh.indices, bvh::kTrianglesInline);
+  const auto woop = bvh::pack_triangles(mesh.vertices, mesh.indices, bvh::kTrianglesWoop);
+  CHECK(inline_vertices.size() == size_t(num_triangles) * bvh::kPackedTriangleSize);
+  CHECK(woop.size() == inline_vertices.size());
+
+  test::Random random(4);
+  int num_degenerate = 0;
+  int num_wrong_vertices = 0;
+  int num_degenerate_hits = 0;
+  int num_inside_misses = 0;
+  int num_outside_hits = 0;
+  int num_wrong_hits = 0;
+  for (int i = 0; i < num_triangles; ++i) {
+    const bvh::float3 *packed = &inline_vertices[size_t(i) * bvh::kPackedTriangleSize];
+    const bvh::float3 *transform = &woop[size_t(i) * bvh::kPackedTriangleSize];
+    bvh::float3 v[3];
+    for (int j = 0; j < 3; ++j) {
+      v[j] = mesh.vertex(mesh.indices[3 * i + j]);
+      num_wrong_vertices += packed[j].x != v[j].x || packed[j].y != v[j].y ||
+          packed[j].z != v[j].z || packed[j].w != 0.f ? 1 : 0;
+    }
+
+    // Rays at the corners and the center of degenerate triangles, all of which miss.
+    const bvh::float3 n = normal(v);
+    const float area = std::sqrt(dot(n, n));
+    if (area == 0.f) {
+      ++num_degenerate;
+      const bvh::float3 o(random.next() * 100.f, random.next() * 100.f, random.next() * 100.f);
+      for (const auto &target : { v[0], v[1], v[2], (v[0] + v[1] + v[2]) * (1.f / 3.f) }) {
+        float tmax = 1e30f;
+        float u, w;
+        num_degenerate_hits +=
+          bvh::intersect_woop_triangle(transform, o, target - o, tmax, u, w) ? 1 : 0;
+      }
+      continue;
+    }
+
+    // A ray at a point well inside, hit by both formats at the same distance and point, and one
+    // at a point in the plane well outside, missed by both. They come from either side, away
+    // from grazing angles.
+    const float u = 0.1f + 0.5f * random.next();
+    const float w = 0.1f + (0.8f - u) * random.next();
+    const bvh::float3 e1 = v[1] - v[0];
+    const bvh::float3 e2 = v[2] - v[0];
+    const bvh::float3 inside = v[0] + e1 * u + e2 * w;
+    const bvh::float3 outside = v[0] + e1 * 0.7f + e2 * 0.7f;
+    const bvh::float3 o = inside + n * ((random.next() < 0.5f ? -20.f : 20.f) / area);
+    float t_inline = 1e30f;
+    float t_woop = 1e30f;
+    float hit_u = 0.f;
+    float hit_w = 0.f;
+    const bool inline_hit = test::intersect_triangle(
+      packed[0], packed[1], packed[2], o, inside - o, t_inline);
+    const bool woop_hit =
+      bvh::intersect_woop_triangle(transform, o, inside - o, t_woop, hit_u, hit_w);
+    num_inside_misses += inline_hit && woop_hit ? 0 : 1;
+    const bvh::float3 hit = v[0] + e1 * hit_u + e2 * hit_w;
+    bool same_hit = near(t_woop, t_inline, 1e-4f) && near(t_woop, 1.f, 1e-4f);
+    // The Woop rows map world space, a few ulps of the 100 units of the soup.
+    for (int axis = 0; axis < 3; ++axis) {
+      same_hit &= std::abs(hit[axis] - inside[axis]) < 1e-3f;
+    }
+    num_wrong_hits += same_hit ? 0 : 1;
+
+    float tmax = 1e30f;
+    num_outside_hits +=
+      test::intersect_triangle(packed[0], packed[1], packed[2], o, outside - o, tmax) ? 1 : 0;
+    num_outside_hits +=
+      bvh::intersect_woop_triangle(transform, o, outside - o, tmax, hit_u, hit_w) ? 1 : 0;
+  }
+  CHECK(num_degenerate > 20);
+  CHECK(num_wrong_vertices == 0);
+  CHECK(num_degenerate_hits == 0);
+  CHECK(num_inside_misses == 0);
+  CHECK(num_wrong_hits == 0);
+  CHECK(num_outside_hits == 0);
+}
+
+TEST(woop_triangles_find_the_closest_hits) {
+  const auto mesh = make_storage_mesh();
+  const auto woop = bvh::pack_triangles(mesh.vertices, mesh.indices, bvh::kTrianglesWoop);
+  bvh::bbox bounds;
+  for (const auto &leaf : test::triangle_bounds(mesh)) {
+    bounds.grow(leaf);
+  }
+
+  // Woop transforms are not watertight, rays through edges can find another triangle, or none.
+  int num_mismatches = 0;
+  int num_hits = 0;
+  for (const auto &ray : test::make_rays(bounds, 500)) {
+    float t_inline = 1e30f;
+    float t_woop = 1e30f;
+    for (int i = 0; i < mesh.triangle_count(); ++i) {
+      test::intersect_triangle(
+        mesh.vertex(mesh.indices[3 * i]), mesh.vertex(mesh.indices[3 * i + 1]),
+        mesh.vertex(mesh.indices[3 * i + 2]), ray.o, ray.d, t_inline);
+      float u, w;
+      bvh::intersect_woop_triangle(
+        &woop[size_t(i) * bvh::kPackedTriangleSize], ray.o, ray.d, t_woop, u, w);
+    }
+    num_hits += t_inline < 1e30f ? 1 : 0;
+    num_mismatches += near(t_woop, t_inline, 1e-4f) ? 0 : 1;
+  }
+  CHECK(num_hits > 100);
+  CHECK(num_mismatches <= 2);
+}
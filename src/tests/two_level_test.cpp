@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <bvh/RadeonRays/intersector_skip_links.h>
+#include <bvh/bvh_builder.h>
+
+#include "primitive/instance.h"
+#include "primitive/mesh.h"
+#include "world/world.h"
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+// Two-level BVHs: the top level tree over the shapes comes first, followed by one tree per
+// distinct mesh that the instances of the mesh share. Every tree is a skip-links BVH of its own.
+
+namespace {
+
+struct TwoLevelScene {
+  std::vector<test::TestMesh> meshes;
+  std::vector<std::vector<int>> face_vertex_counts;
+  std::vector<std::unique_ptr<RadeonRays::Shape>> shapes;
+  // Index into meshes of every shape.
+  std::vector<int> shape_meshes;
+  RadeonRays::World world;
+};
+
+RadeonRays::matrix translation(float x, float y, float z) {
+  RadeonRays::matrix m;
+  m.m[0][3] = x;
+  m.m[1][3] = y;
+  m.m[2][3] = z;
+  return m;
+}
+
+// A sphere and a soup, then three instances of the sphere.
+void make_scene(TwoLevelScene &scene) {
+  scene.meshes = { test::make_sphere(12), test::make_triangle_soup(500) };
+  for (int i = 0; i < int(scene.meshes.size()); ++i) {
+    const auto &mesh = scene.meshes[i];
+    scene.face_vertex_counts.emplace_back(mesh.triangle_count(), 3);
+    auto shape = std::make_unique<RadeonRays::Mesh>(
+      mesh.vertices.data(), int(mesh.vertices.size() / 3), 3 * int(sizeof(float)),
+      mesh.indices.data(), 0, scene.face_vertex_counts.back().data(), mesh.triangle_count());
+    shape->SetId(i + 1);
+    const auto m = translation(0.f, 0.f, 3.f * i);
+    shape->SetTransform(m, m);
+    scene.shapes.push_back(std::move(shape));
+    scene.shape_meshes.push_back(i);
+  }
+  for (int i = 0; i < 3; ++i) {
+    auto instance = std::make_unique<RadeonRays::Instance>(scene.shapes[0].get());
+    instance->SetId(10 + i);
+    const auto m = translation(3.f * (i + 1), 1.f, 0.f);
+    instance->SetTransform(m, m);
+    scene.shapes.push_back(std::move(instance));
+    scene.shape_meshes.push_back(0);
+  }
+  for (const auto &shape : scene.shapes) {
+    scene.world.AttachShape(shape.get());
+  }
+  scene.world.options_.SetValue("bvh.two_level", 1.f);
+}
+
+// World space bounds of the vertices of every shape, which its top level leaf contains.
+std::vector<bvh::bbox> shape_bounds(const TwoLevelScene &scene) {
+  std::vector<bvh::bbox> bounds;
+  for (int i = 0; i < int(scene.shapes.size()); ++i) {
+    RadeonRays::matrix m, minv;
+    scene.shapes[i]->GetTransform(m, minv);
+    const auto &mesh = scene.meshes[scene.shape_meshes[i]];
+    bvh::bbox box;
+    for (int v = 0; v < int(mesh.vertices.size() / 3); ++v) {
+      box.grow(RadeonRays::transform_point(mesh.vertex(v), m));
+    }
+    bounds.push_back(box);
+  }
+  return bounds;
+}
+
+// Nodes [begin, end) of the tree of a two-level BVH rooted at begin, moved to start at node 0
+// with primitive indices starting at 0, to validate it like a single-level BVH.
+std::vector<bvh::bbox> extract_tree(
+  const std::vector<RadeonRays::Node> &nodes, int begin, int end, int primitive_offset) {
+  std::vector<bvh::bbox> tree;
+  for (int i = begin; i < end; ++i) {
+    bvh::bbox node = nodes[i].bounds;
+    const int payload = bvh::decode_index(node.pmin.w);
+    if (payload != -1) {
+      node.pmin.w = bvh::encode_index(uint32_t(payload - primitive_offset));
+    }
+    const int skip_link = bvh::decode_index(node.pmax.w);
+    if (skip_link != -1) {
+      node.pmax.w = bvh::encode_index(uint32_t(skip_link - begin));
+    }
+    tree.push_back(node);
+  }
+  return tree;
+}
+
+bool same_nodes(
+  const std::vector<RadeonRays::Node> &a, const std::vector<RadeonRays::Node> &b, int begin) {
+  return a.size() == b.size() &&
+    std::memcmp(a.data() + begin, b.data() + begin, (a.size() - begin) * sizeof(a[0])) == 0;
+}
+
+} // namespace
+
+TEST(two_level_trees_are_reachable_from_their_roots) {
+  TwoLevelScene scene;
+  make_scene(scene);
+  RadeonRays::BvhBuilder builder;
+  builder.updateBvh(scene.world);
+
+  std::vector<RadeonRays::Node> nodes(builder.getNodeCount());
+  std::vector<RadeonRays::Vertex> vertices(builder.getVertexCount());
+  std::vector<RadeonRays::Face> faces(builder.getFaceCount());
+  builder.fillBuffers(nodes, vertices, faces);
+  std::vector<RadeonRays::ShapeData> shapes(builder.getShapeCount());
+  CHECK(shapes.size() == scene.shapes.size());
+  builder.fillShapeBuffer(shapes);
+
+  // Instances share the tree of their mesh.
+  std::vector<int> roots(scene.meshes.size(), -1);
+  for (int i = 0; i < int(shapes.size()); ++i) {
+    CHECK(shapes[i].id == scene.shapes[i]->GetId());
+    int &root = roots[scene.shape_meshes[i]];
+    CHECK(root == -1 || root == shapes[i].bvhidx);
+    root = shapes[i].bvhidx;
+  }
+
+  // The top level tree ends where the first mesh tree starts, and the mesh trees follow in the
+  // order of their faces.
+  const int top_level_end = roots[0];
+  CHECK(top_level_end > 0);
+  const auto top_level = extract_tree(nodes, 0, top_level_end, 0);
+  CHECK_VALID(test::validate_skip_links(top_level, shape_bounds(scene)));
+
+  int first_face = 0;
+  for (int i = 0; i < int(scene.meshes.size()); ++i) {
+    const int end = i + 1 < int(roots.size()) ? roots[i + 1] : int(nodes.size());
+    CHECK(roots[i] < end);
+    const auto tree = extract_tree(nodes, roots[i], end, first_face);
+    const auto &mesh = scene.meshes[i];
+    CHECK_VALID(test::validate_skip_links(tree, test::triangle_bounds(mesh)));
+    for (int face = 0; face < mesh.triangle_count(); ++face) {
+      const auto ids = builder.getFaceIds(first_face + face);
+      CHECK(ids.shape_id == -1 && ids.prim_id == face);
+    }
+    first_face += mesh.triangle_count();
+  }
+  CHECK(first_face == builder.getFaceCount());
+}
+
+TEST(updating_the_top_level_keeps_the_bottom_levels) {
+  TwoLevelScene scene;
+  make_scene(scene);
+  const auto &options = scene.world.options_;
+  std::vector<std::unique_ptr<bvh::Bvh>> mesh_bvhs;
+  std::vector<int> offsets;
+  int num_faces = 0;
+  for (const auto &mesh : scene.meshes) {
+    const auto bounds = test::triangle_bounds(mesh);
+    mesh_bvhs.push_back(bvh::make_bvh(options));
+    mesh_bvhs.back()->Build(bounds.data(), int(bounds.size()));
+    offsets.push_back(num_faces);
+    num_faces += mesh.triangle_count();
+  }
+
+  auto bounds = shape_bounds(scene);
+  auto top_level = bvh::make_bvh(options);
+  top_level->Build(bounds.data(), int(bounds.size()));
+  std::vector<const bvh::Bvh *> bvhs;
+  for (const auto &mesh_bvh : mesh_bvhs) {
+    bvhs.push_back(mesh_bvh.get());
+  }
+  bvhs.push_back(top_level.get());
+  RadeonRays::PlainBvhTranslator translator;
+  translator.Process(bvhs.data(), offsets.data(), int(mesh_bvhs.size()));
+  const auto nodes = translator.getNodes();
+  const int top_level_end = translator.getRoots()[0];
+
+  // Move the shapes apart and reorder them, which gives a top level tree of the same size.
+  std::reverse(bounds.begin(), bounds.end());
+  for (int i = 0; i < int(bounds.size()); ++i) {
+    const RadeonRays::float3 offset(0.f, 5.f * i, 0.f);
+    bounds[i] = bvh::bbox(bounds[i].pmin + offset, bounds[i].pmax + offset);
+  }
+  auto moved_top_level = bvh::make_bvh(options);
+  moved_top_level->Build(bounds.data(), int(bounds.size()));
+  translator.UpdateTopLevel(*moved_top_level);
+
+  const auto &updated = translator.getNodes();
+  CHECK(same_nodes(nodes, updated, top_level_end));
+  CHECK(translator.getRoots()[0] == top_level_end);
+  CHECK_VALID(test::validate_skip_links(extract_tree(updated, 0, top_level_end, 0), bounds));
+}
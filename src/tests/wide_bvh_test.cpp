@@ -0,0 +1,33 @@
+#include <vector>
+
+#include <bvh/bvh_builder.h>
+#include <bvh/wide_bvh.h>
+
+#include "bvh_validation.h"
+#include "test.h"
+#include "test_scenes.h"
+
+TEST(wide_nodes_cover_every_primitive) {
+  for (const auto &leafs : test::test_leaf_sets()) {
+    for (float max_leaf_size : { 1.f, 4.f }) {
+      bvh::BvhOptions options;
+      options.SetValue("bvh.builder", "sah_parallel");
+      options.SetValue("bvh.max_leaf_size", max_leaf_size);
+      std::vector<int> order;
+      const auto nodes = test::build_nodes(leafs, options, &order);
+      const auto wide4 = bvh::collapse_bvh<4>(gsl::span<const bvh::bbox>(nodes));
+      const auto wide8 = bvh::collapse_bvh<8>(gsl::span<const bvh::bbox>(nodes));
+      CHECK(!wide4.empty() && !wide8.empty());
+      CHECK_VALID(test::validate_wide_bvh<4>(wide4, leafs, order));
+      CHECK_VALID(test::validate_wide_bvh<8>(wide8, leafs, order));
+    }
+
+    // Straight from the node tree of a RadeonRays::Bvh.
+    bvh::BvhOptions options;
+    options.SetValue("bvh.builder", "sah");
+    auto tree = bvh::make_bvh(options);
+    tree->Build(leafs.data(), int(leafs.size()));
+    const auto wide = bvh::collapse_bvh<4>(*tree);
+    CHECK_VALID(test::validate_wide_bvh<4>(wide, leafs));
+  }
+}